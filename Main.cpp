@@ -1,19 +1,32 @@
 #include "Main.h"
 
+Random::Random(GLuint seed) : state(seed ? seed : 0x9E3779B9) {}
+
+inline GLuint Random::Next()
+{
+	// xorshift32, each world owns its generator so worlds can be stepped from different threads
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
 template<typename T>
 inline T Random::GetNumber(T min, T max)
 {
-	return T(min + rand() / (float)RAND_MAX * (max - min));
+	return T(min + Next() / 4294967295.0f * (max - min));
 }
 
-inline void Pointer::Delete(void *p)
+template<typename T>
+inline void Pointer::Delete(T *&p)
 {
 	if (!p) return;
 	delete p;
 	p = NULL;
 }
 
-inline void Array::Delete(void **p, GLuint count)
+template<typename T>
+inline void Array::Delete(T **&p, GLuint count)
 {
 	if (!p) return;
 	while (count) Pointer::Delete(p[--count]);
@@ -36,732 +49,5162 @@ char *File::ReadAll(const char *filename, GLuint *size)
 	return p;
 }
 
-const glm::mat4 Mat4::PROJECTION = glm::perspective<float>(M_PI / 180.0f * 70.0f, WINDOW_WIDTH / (float)WINDOW_HEIGHT, 0.01f, 100.0f);
-const glm::mat4 Mat4::IDENTITY = glm::mat4(1);
-const glm::mat4 Mat4::HAND = glm::scale(Mat4::IDENTITY, glm::vec3(2, 2, 0));
-
-Shader *Shader::WORLD = NULL;
-Shader *Shader::POST = NULL;
-
-Shader *Shader::Load(GLuint mask, const std::string &filename)
+bool File::WriteAll(const char *filename, const void *data, GLuint size)
 {
-	GLuint id = glCreateProgram();
-	GLuint doCompile = 0;
-	GLuint compiled = 0;
-	if (mask & 1) { ++doCompile; compiled += Compile(id, GL_VERTEX_SHADER, filename + ".vs"); }
-	if (mask & 2) { ++doCompile; compiled += Compile(id, GL_GEOMETRY_SHADER, filename + ".gs"); }
-	if (mask & 4) { ++doCompile; compiled += Compile(id, GL_FRAGMENT_SHADER, filename + ".fs"); }
-	if (compiled != doCompile) return NULL;
-
-	glLinkProgram(id);
-	GLint linked;
-	glGetProgramiv(id, GL_LINK_STATUS, &linked);
-	return linked == GL_TRUE ? new Shader(id) : NULL;
+	std::ofstream os(filename, std::ofstream::binary);
+	if (!os.is_open()) return false;
+	os.write((const char *)data, size);
+	return os.good();
 }
 
-Shader::Shader(GLuint _id) : id(_id) {}
-Shader::~Shader() { glDeleteProgram(id); }
+long long File::GetModified(const char *filename)
+{
+	struct stat s;
+	return stat(filename, &s) ? 0 : (long long)s.st_mtime;
+}
 
-inline void Shader::Bind() { glUseProgram(id); }
-inline void Shader::Unbind() { glUseProgram(0); }
+void File::MakeDirectory(const char *directory)
+{
+#ifdef _WIN32
+	_mkdir(directory);
+#else
+	mkdir(directory, 0755);
+#endif
+}
 
-GLuint Shader::Compile(GLuint id, GLenum type, const std::string &filename)
+#ifdef _WIN32
+MappedFile *MappedFile::Open(const char *filename)
 {
-	GLuint shader = glCreateShader(type);
-	if (shader == 0) return 0;
-	
-	char *src = File::ReadAll(filename.c_str());
-	if (!src) return 0;
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
 	
-	glShaderSource(shader, 1, (char **)&src, NULL);
-	delete[] src;
-
-	glCompileShader(shader);
-	GLint compiled;
-	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
-	if (compiled == GL_FALSE)
+	DWORD size = GetFileSize(file, NULL);
+	HANDLE mapping = size ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	const char *data = mapping ? (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (!data)
 	{
-		char msg[256];
-		int size = 0;
-		glGetShaderInfoLog(shader, 256, &size, msg);
-		msg[size] = '\0';
-		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", msg, NULL);
-		return 0;
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+		return NULL;
 	}
-	glAttachShader(id, shader);
-	return 1;
+	return new MappedFile(file, mapping, data, size);
 }
 
-Model *Model::E = NULL;
-Model *Model::I = NULL;
-Model *Model::H = NULL;
-Model *Model::L = NULL;
-Model *Model::U = NULL;
-Model *Model::ENEMY = NULL;
-Model *Model::POST = NULL;
+MappedFile::MappedFile(HANDLE _file, HANDLE _mapping, const char *_data, GLuint _size) : data(_data), size(_size), file(_file), mapping(_mapping) {}
 
-Model *Model::Load(const std::string &filename)
+MappedFile::~MappedFile()
 {
-	GLuint size = 0;
-	char *data = File::ReadAll(filename.c_str(), &size);
-	if (!data || size < 18 || (size % 18)) return NULL;
+	UnmapViewOfFile(data);
+	CloseHandle(mapping);
+	CloseHandle(file);
+}
+#else
+MappedFile *MappedFile::Open(const char *filename)
+{
+	int file = open(filename, O_RDONLY);
+	if (file < 0) return NULL;
 	
-	float *vertices = new float[size];
-	char s = -1;
-	for (GLuint i = 0; i < size; ++i)
+	struct stat s;
+	void *data = fstat(file, &s) || s.st_size == 0 ? MAP_FAILED : mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	if (data == MAP_FAILED)
 	{
-		s = i % 3 ? s : !s;
-		float f = data[i] - '0';
-		vertices[i] = s ? f * 0.25f : f * 0.5f;
+		close(file);
+		return NULL;
 	}
-	delete[] data;
-	
-	GLuint vbo;
-	glGenBuffers(1, &vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, size * sizeof(float), vertices, GL_STATIC_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	
-	delete[] vertices;
-	
-	GLuint vao;
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		glEnableVertexAttribArray(0);
-		glEnableVertexAttribArray(1);
-		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
-		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)&((Vertex *)0)->s);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
-	
-	return new Model(vbo, vao, size / 6);
+	return new MappedFile(file, (const char *)data, s.st_size);
+}
+
+MappedFile::MappedFile(int _file, const char *_data, GLuint _size) : data(_data), size(_size), file(_file) {}
+
+MappedFile::~MappedFile()
+{
+	munmap((void *)data, size);
+	close(file);
+}
+#endif
+
+inline unsigned long long Hash::Fnv(const void *data, size_t size, unsigned long long hash)
+{
+	for (const unsigned char *p = (const unsigned char *)data, *e = p + size; p != e; ++p) hash = (hash ^ *p) * 1099511628211ULL;
+	return hash;
 }
 
-Model::Model(GLuint _vbo, GLuint _vao, GLuint _count) : vbo(_vbo), vao(_vao), count(_count) {}
+GLuint Hash::Crc32(const void *data, size_t size, GLuint crc)
+{
+	// Built once, the first call may come from any encoder thread
+	static const struct Table
+	{
+		GLuint values[256];
+		Table()
+		{
+			for (GLuint i = 0; i < 256; ++i)
+			{
+				GLuint c = i;
+				for (GLuint k = 0; k < 8; ++k) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+				values[i] = c;
+			}
+		}
+	} table;
 	
-Model::~Model()
+	crc = ~crc;
+	for (const unsigned char *p = (const unsigned char *)data, *e = p + size; p != e; ++p) crc = table.values[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+GLuint Hash::Adler32(const void *data, size_t size, GLuint adler)
 {
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(0);
-	glDeleteVertexArrays(1, &vao);
-	glDeleteBuffers(1, &vbo);
+	GLuint a = adler & 0xFFFF, b = adler >> 16;
+	const unsigned char *p = (const unsigned char *)data;
+	while (size)
+	{
+		// 5552 bytes is the most that can be summed before the 32 bit sums overflow
+		size_t n = glm::min<size_t>(size, 5552);
+		size -= n;
+		for (const unsigned char *e = p + n; p != e; ++p)
+		{
+			a += *p;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
 }
 
-inline void Model::Bind() { glBindVertexArray(vao); }
-inline void Model::Unbind() { glBindVertexArray(0); }
+inline double Clock::Milliseconds()
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-Texture *Texture::GLOBAL = NULL;
+Memory::Counter Memory::HEAP[Memory::TAGS];
+Memory::Counter Memory::TOTAL;
+Memory::Counter Memory::DEVICE[Memory::OBJECTS];
+const char *Memory::TAG_NAMES[Memory::TAGS] = { "other", "map", "enemies", "assets", "audio", "render" };
+const char *Memory::OBJECT_NAMES[Memory::OBJECTS] = { "buffers", "textures", "framebuffers", "shaders", "programs", "sounds" };
+thread_local GLuint Memory::scope = Memory::OTHER;
+thread_local Memory::Pending Memory::pending;
+thread_local GLuint Memory::trap = 0;
 
-Texture *Texture::Load(const std::string &filename)
+inline void Memory::Counter::Update(long long bytes, GLuint allocated, GLuint freed)
 {
-	SDL_Surface *bmp = SDL_LoadBMP_RW(SDL_RWFromFile(filename.c_str(), "rb"), 1);
-	if (!bmp) return NULL;
+	long long now = live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+	if (allocated) allocations.fetch_add(allocated, std::memory_order_relaxed);
+	if (freed) frees.fetch_add(freed, std::memory_order_relaxed);
+	long long top = peak.load(std::memory_order_relaxed);
+	while (now > top && !peak.compare_exchange_weak(top, now, std::memory_order_relaxed));
+}
 
-	glActiveTexture(0);
+// Allocations of this thread go to the tag until the scope ends, scopes nest
+Memory::Scope::Scope(GLuint tag) : previous(scope) { scope = tag; }
+Memory::Scope::~Scope() { scope = previous; }
 
-	GLuint id;
-	glGenTextures(1, &id);
-	glBindTexture(GL_TEXTURE_2D, id);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, bmp->w, bmp->h, 0, GL_BGR, GL_UNSIGNED_BYTE, bmp->pixels);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	SDL_FreeSurface(bmp);
+// A thread leaving gives its last counts
+Memory::Pending::~Pending() { Flush(); }
 
-	return new Texture(id);
+void *Memory::Allocate(size_t size)
+{
+	// The header keeps the size and tag, so a block can be freed from any thread and scope
+	Header *header = (Header *)malloc(sizeof(Header) + size);
+	if (!header) return NULL;
+	header->size = size;
+	header->tag = scope;
+	
+	// Counted per thread and flushed in batches, the shared counters are only touched every few operations
+	Pending &local = pending;
+	local.bytes[header->tag] += size;
+	++local.allocations[header->tag];
+	++local.allocated;
+	if (trap) Trace(size);
+	if (++local.operations >= MEMORY_FLUSH_OPERATIONS || local.bytes[header->tag] >= MEMORY_FLUSH_BYTES) Flush();
+	return header + 1;
 }
 
-Texture::Texture(GLuint _id) : id(_id) {}
-Texture::~Texture() { glDeleteTextures(1, &id); }
+void Memory::Free(void *p)
+{
+	if (!p) return;
+	Header *header = (Header *)p - 1;
+	Pending &local = pending;
+	local.bytes[header->tag] -= header->size;
+	++local.frees[header->tag];
+	if (++local.operations >= MEMORY_FLUSH_OPERATIONS || local.bytes[header->tag] <= -MEMORY_FLUSH_BYTES) Flush();
+	free(header);
+}
 
-inline void Texture::Bind() { glBindTexture(GL_TEXTURE_2D, id); }
-inline void Texture::Unbind() { glBindTexture(GL_TEXTURE_2D, 0); }
+// Every operator new made by this thread since it started, malloc is not counted
+inline unsigned long long Memory::GetAllocations() { return pending.allocated; }
 
-SoundBuffer *SoundBuffer::MUSIC = NULL;
-SoundBuffer *SoundBuffer::HIT = NULL;
-SoundBuffer *SoundBuffer::CROWBAR = NULL;
-SoundBuffer *SoundBuffer::ENEMY = NULL;
+// The next allocations of this thread print their call stack, up to the given count
+void Memory::Trap(GLuint stacks) { trap = stacks; }
 
-SoundBuffer *SoundBuffer::Load(const std::string &filename)
+void Memory::Trace(size_t size)
 {
-	char *data = File::ReadAll(filename.c_str());
-	if (*(short *)(data + 20) != 1 ||	// Audio format PCM
-		*(short *)(data + 22) != 1 ||	// Number channels 1
-		*(GLuint *)(data + 24) != 44100 ||	// Sample rate 44100
-		*(short *)(data + 34) != 16)	// Bits per sample 16
-		return NULL;
-	
-	GLuint id;
-	alGenBuffers(1, &id);
-	alBufferData(id, AL_FORMAT_MONO16, data + 44, *(GLuint *)(data + 40), 44100);
-	delete[] data;
-	
-	return new SoundBuffer(id);
+	// Off while printing, the stream and the unwinder may allocate too
+	GLuint left = trap - 1;
+	trap = 0;
+	std::cerr << "allocation of " << size << " bytes" << (left ? "" : ", last stack printed") << std::endl;
+#ifdef __GLIBC__
+	// Addresses can be resolved with addr2line, or names printed directly when linked with -rdynamic
+	void *frames[MEMORY_TRACE_FRAMES];
+	int count = backtrace(frames, MEMORY_TRACE_FRAMES);
+	backtrace_symbols_fd(frames + 1, count - 1, 2);
+#endif
+	trap = left;
 }
 
-SoundBuffer::SoundBuffer(GLuint _id) : id(_id) {}
-SoundBuffer::~SoundBuffer() { alDeleteBuffers(1, &id); }
+void Memory::Flush()
+{
+	// Live and peak bytes of other threads are behind by at most their pending batch
+	Pending &local = pending;
+	long long bytes = 0;
+	GLuint allocated = 0, freed = 0;
+	for (GLuint i = 0; i < TAGS; ++i)
+	{
+		if (!local.allocations[i] && !local.frees[i]) continue;
+		HEAP[i].Update(local.bytes[i], local.allocations[i], local.frees[i]);
+		bytes += local.bytes[i];
+		allocated += local.allocations[i];
+		freed += local.frees[i];
+		local.bytes[i] = 0;
+		local.allocations[i] = local.frees[i] = 0;
+	}
+	if (allocated || freed) TOTAL.Update(bytes, allocated, freed);
+	local.operations = 0;
+}
 
-Sound *Sound::MUSIC = NULL;
-Sound *Sound::HIT = NULL;
-Sound *Sound::CROWBAR = NULL;
+// Driver side objects are estimated from their size and format, the driver may pad them
+inline void Memory::Created(GLuint object, long long bytes) { DEVICE[object].Update(bytes, 1, 0); }
+inline void Memory::Deleted(GLuint object, long long bytes) { DEVICE[object].Update(-bytes, 0, 1); }
 
-Sound::Sound(SoundBuffer *buf)
+void Memory::Report(std::ostream &os, const char *title)
 {
-	alGenSources(1, &id);
-	alSourcei(id, AL_BUFFER, buf->id);
+	Flush();
+	os << "Memory " << title << std::endl << std::fixed << std::setprecision(1);
+	os << "  " << std::left << std::setw(14) << "heap" << std::right << std::setw(12) << "live KB" << std::setw(12) << "peak KB" << std::setw(14) << "allocations" << std::setw(10) << "blocks" << std::endl;
+	for (GLuint i = 0; i <= TAGS; ++i)
+	{
+		const Counter &counter = i < TAGS ? HEAP[i] : TOTAL;
+		os << "  " << std::left << std::setw(14) << (i < TAGS ? TAG_NAMES[i] : "total") << std::right << std::setw(12) << counter.live / 1024.0 << std::setw(12) << counter.peak / 1024.0
+			<< std::setw(14) << counter.allocations << std::setw(10) << (long long)(counter.allocations - counter.frees) << std::endl;
+	}
+	os << "  " << std::left << std::setw(14) << "device" << std::right << std::setw(12) << "live KB" << std::setw(12) << "peak KB" << std::setw(14) << "created" << std::setw(10) << "objects" << std::endl;
+	for (GLuint i = 0; i < OBJECTS; ++i)
+	{
+		os << "  " << std::left << std::setw(14) << OBJECT_NAMES[i] << std::right << std::setw(12) << DEVICE[i].live / 1024.0 << std::setw(12) << DEVICE[i].peak / 1024.0
+			<< std::setw(14) << DEVICE[i].allocations << std::setw(10) << (long long)(DEVICE[i].allocations - DEVICE[i].frees) << std::endl;
+	}
+	os.unsetf(std::ios::floatfield);
+	os << std::setprecision(6);
 }
-Sound::~Sound() { Stop(); alDeleteSources(1, &id); }
 
-inline int Sound::GetState() { int s; alGetSourcei(id, AL_SOURCE_STATE, &s); return s; }
-inline void Sound::SetLooping(bool looping) { alSourcei(id, AL_LOOPING, looping); }
-inline void Sound::Play() { if (GetState() != AL_PLAYING) alSourcePlay(id); }
-inline void Sound::Pause() { if (GetState() == AL_PLAYING) alSourcePause(id); }
-inline void Sound::Stop() { if (GetState() != AL_STOPPED) alSourceStop(id); }
-inline void Sound::SetVolume(float volume) { alSourcef(id, AL_GAIN, volume); }
+#if MEMORY_TRACKING
+// Every new and delete of the program goes through the tagged heap
+void *operator new(size_t size)
+{
+	void *p = Memory::Allocate(size);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return Memory::Allocate(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return Memory::Allocate(size); }
+void operator delete(void *p) noexcept { Memory::Free(p); }
+void operator delete[](void *p) noexcept { Memory::Free(p); }
+void operator delete(void *p, size_t) noexcept { Memory::Free(p); }
+void operator delete[](void *p, size_t) noexcept { Memory::Free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { Memory::Free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { Memory::Free(p); }
+#endif
 
-FrameBuffer *FrameBuffer::POST = NULL;
+Config Config::CURRENT;
 
-FrameBuffer *FrameBuffer::Create(GLuint width, GLuint height)
+const Config::Key Config::KEYS[] =
 {
-	GLuint fbo, color, depth;
-	
-	glGenTextures(1, &color);
-	glBindTexture(GL_TEXTURE_2D, color);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, NULL);
+	{ "window.width", offsetof(Config, windowWidth), false, 64, 16384 },
+	{ "window.height", offsetof(Config, windowHeight), false, 64, 16384 },
+	{ "buffer.width", offsetof(Config, bufferWidth), false, 16, 4096 },
+	{ "buffer.height", offsetof(Config, bufferHeight), false, 16, 4096 },
+	{ "frame.delay", offsetof(Config, frameDelay), false, 0, 1000 },
+	{ "post.filter", offsetof(Config, postFilter), false, 0, POST_FILTERS - 1 },
+	{ "view.top", offsetof(Config, topView), true, 0, 1 },
+	{ "player.visible_distance", offsetof(Config, visibleDistance), false, 1, 64 },
+	{ "enemy.decision_ticks", offsetof(Config, enemyDecisionTicks), false, 1, 65535 },
+	{ "enemy.speak_min_ticks", offsetof(Config, enemySpeakMinTicks), false, 1, 65535 },
+	{ "enemy.speak_max_ticks", offsetof(Config, enemySpeakMaxTicks), false, 1, 65535 },
+	{ "enemy.animation_ticks", offsetof(Config, enemyAnimationTicks), false, 1, 65535 },
+	{ "map.cells", offsetof(Config, mapCells), false, 2, 1 << 20 },
+	{ "map.enemies", offsetof(Config, mapEnemies), false, 0, 1 << 20 },
+	{ "map.generator", offsetof(Config, mapGenerator), false, 0, MAP_GENERATORS - 1 },
+	{ NULL, 0, false, 0, 0 }
+};
+
+Config::Config() :
+	windowWidth(WINDOW_WIDTH), windowHeight(WINDOW_HEIGHT),
+	bufferWidth(BUFFER_WIDTH), bufferHeight(BUFFER_HEIGHT),
+	frameDelay(FPS), postFilter(POST_FILTER), topView(TOP_VIEW_MODE),
+	visibleDistance(PLAYER_VISIBLE_DISTANCE),
+	enemyDecisionTicks(ENEMY_DECISIONS_TICKS),
+	enemySpeakMinTicks(ENEMY_SPEAK_MIN_TICKS), enemySpeakMaxTicks(ENEMY_SPEAK_MAX_TICKS),
+	enemyAnimationTicks(ENEMY_ANIMATION_TICKS),
+	mapCells(MAP_CELLS), mapEnemies(MAP_ENEMIES), mapGenerator(MAP_GENERATOR)
+{}
+
+int Config::Parse(int argc, char *argv[])
+{
+	// The default file is optional, then --config files and --set overrides in order, all removed from the arguments
+	std::ifstream probe(CONFIG_FILENAME);
+	if (probe && !Load(CONFIG_FILENAME)) return -1;
 	
-	glGenTextures(1, &depth);
-	glBindTexture(GL_TEXTURE_2D, depth);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	int count = 1;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (i + 1 < argc && !strcmp(argv[i], "--config"))
+		{
+			if (!Load(argv[++i])) return -1;
+		}
+		else if (i + 1 < argc && !strcmp(argv[i], "--set"))
+		{
+			std::string setting = argv[++i];
+			size_t equal = setting.find('=');
+			if (equal == std::string::npos || !Set(setting.substr(0, equal), setting.substr(equal + 1))) return -1;
+		}
+		else argv[count++] = argv[i];
+	}
+	argv[count] = NULL;
 	
-	glGenFramebuffers(1, &fbo);
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	Apply();
+	return count;
+}
+
+bool Config::Load(const char *filename)
+{
+	std::ifstream is(filename);
+	if (!is)
+	{
+		std::cerr << "Failed to opening " << filename << std::endl;
+		return false;
+	}
 	
-	return new FrameBuffer(fbo, color, depth);
+	// key = value per line, # starts a comment
+	std::string line;
+	for (GLuint number = 1; std::getline(is, line); ++number)
+	{
+		line = line.substr(0, line.find('#'));
+		size_t equal = line.find('=');
+		if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+		
+		std::istringstream key(line.substr(0, equal)), value(equal == std::string::npos ? "" : line.substr(equal + 1));
+		std::string k, v;
+		key >> k;
+		value >> v;
+		if (equal == std::string::npos || !Set(k, v))
+		{
+			std::cerr << filename << ":" << number << ": invalid setting " << line << std::endl;
+			return false;
+		}
+	}
+	return true;
 }
 
-FrameBuffer::FrameBuffer(GLuint _fbo, GLuint _color, GLuint _depth) : fbo(_fbo), color(_color), depth(_depth) {}
-FrameBuffer::~FrameBuffer()
+bool Config::Set(const std::string &key, const std::string &value)
 {
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	for (const Key *it = KEYS; it->name; ++it)
+	{
+		if (key != it->name) continue;
+		
+		char *end;
+		long n = value == "true" ? 1 : value == "false" ? 0 : strtol(value.c_str(), &end, 10);
+		if ((value != "true" && value != "false" && (value.empty() || *end)) || n < it->min || n > it->max)
+		{
+			std::cerr << key << ": expected a value from " << it->min << " to " << it->max << ", got " << value << std::endl;
+			return false;
+		}
+		
+		char *field = (char *)&CURRENT + it->offset;
+		if (it->flag) *(bool *)field = n != 0;
+		else *(int *)field = n;
+		return true;
+	}
 	
-	glDeleteFramebuffers(1, &fbo);
-	glDeleteTextures(1, &depth);
-	glDeleteTextures(1, &color);
+	std::cerr << "Unknown setting " << key << std::endl;
+	return false;
 }
 
-inline void FrameBuffer::Bind() { glBindFramebuffer(GL_FRAMEBUFFER, fbo); }
-inline void FrameBuffer::Unbind() { glBindFramebuffer(GL_FRAMEBUFFER, 0); }
-inline void FrameBuffer::BindColor() { glBindTexture(GL_TEXTURE_2D, color); }
-inline void FrameBuffer::BindDepth() { glBindTexture(GL_TEXTURE_2D, depth); }
+void Config::Print(std::ostream &os)
+{
+	for (const Key *it = KEYS; it->name; ++it)
+	{
+		const char *field = (const char *)&CURRENT + it->offset;
+		os << it->name << " = " << (it->flag ? (int)*(const bool *)field : *(const int *)field) << std::endl;
+	}
+}
 
-bool *Input::KEYBOARD = 0;
+void Config::Apply()
+{
+	if (CURRENT.enemySpeakMaxTicks < CURRENT.enemySpeakMinTicks) CURRENT.enemySpeakMaxTicks = CURRENT.enemySpeakMinTicks;
+	Mat4::PROJECTION = glm::perspective<float>(M_PI / 180.0f * 70.0f, CURRENT.windowWidth / (float)CURRENT.windowHeight, 0.01f, 100.0f);
+}
 
-Point &Point::Set(short x, short y)
+glm::mat4 Mat4::PROJECTION = glm::perspective<float>(M_PI / 180.0f * 70.0f, WINDOW_WIDTH / (float)WINDOW_HEIGHT, 0.01f, 100.0f);
+const glm::mat4 Mat4::IDENTITY = glm::mat4(1);
+const glm::mat4 Mat4::HAND = glm::scale(Mat4::IDENTITY, glm::vec3(2, 2, 0));
+
+inline glm::vec2 Mat4::ClipPlanes(const glm::mat4 &projection)
 {
-	this->x = x;
-	this->y = y;
-	return *this;
+	// Near and far planes back from a perspective matrix, so the fog follows whatever projection is used
+	return glm::vec2(projection[3][2] / (projection[2][2] - 1), projection[3][2] / (projection[2][2] + 1));
+}
+
+Shader *Shader::WORLD = NULL;
+Shader *Shader::POST = NULL;
+std::vector<Shader *> Shader::LOADED;
+int Shader::watcher = -1;
+GLuint Shader::watchTicks = 0;
+
+Shader *Shader::Load(GLuint mask, const std::string &filename, const std::string &defines)
+{
+	Memory::Scope scope(Memory::ASSETS);
+	std::vector<std::string> files;
+	GLuint id = Build(mask, filename, defines, files);
+	return id ? new Shader(id, mask, filename, defines, files) : NULL;
+}
+
+Shader::Shader(GLuint _id, GLuint _mask, const std::string &_filename, const std::string &_defines, const std::vector<std::string> &_files) : id(_id), mask(_mask), filename(_filename), defines(_defines), files(_files), dirty(false)
+{
+	Track();
+	LOADED.push_back(this);
+}
+
+Shader::~Shader()
+{
+	LOADED.erase(std::remove(LOADED.begin(), LOADED.end(), this), LOADED.end());
+	glDeleteProgram(id);
+	Memory::Deleted(Memory::PROGRAMS, 0);
+}
+
+inline void Shader::Bind() { glUseProgram(id); }
+inline void Shader::Unbind() { glUseProgram(0); }
+
+void Shader::Watch(const char *directory)
+{
+#ifdef __linux__
+	watcher = inotify_init1(IN_NONBLOCK);
+	if (watcher >= 0 && inotify_add_watch(watcher, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		close(watcher);
+		watcher = -1;
+	}
+	if (watcher < 0) std::cerr << "Failed to watching " << directory << " (" << strerror(errno) << "), polling the shader files instead" << std::endl;
+#endif
+}
+
+void Shader::Unwatch()
+{
+#ifdef __linux__
+	if (watcher >= 0) close(watcher);
+	watcher = -1;
+#endif
+}
+
+bool Shader::Reload()
+{
+#ifdef __linux__
+	if (watcher >= 0)
+	{
+		char buffer[4096];
+		ssize_t size;
+		while ((size = read(watcher, buffer, sizeof(buffer))) > 0)
+		{
+			for (char *p = buffer; p < buffer + size; p += sizeof(inotify_event) + ((inotify_event *)p)->len)
+			{
+				inotify_event *event = (inotify_event *)p;
+				if (!event->len) continue;
+				
+				std::string name = event->name;
+				for (std::vector<Shader *>::iterator it = LOADED.begin(); it != LOADED.end(); ++it)
+					for (std::vector<std::string>::iterator f = (*it)->files.begin(); f != (*it)->files.end(); ++f)
+						if (f->size() > name.size() && f->compare(f->size() - name.size(), name.size(), name) == 0 && strchr("\\/", (*f)[f->size() - name.size() - 1])) (*it)->dirty = true;
+			}
+		}
+	}
+	else
+#endif
+	// Without inotify, poll modification times of the sources every few frames
+	if (++watchTicks >= SHADER_WATCH_TICKS)
+	{
+		watchTicks = 0;
+		for (std::vector<Shader *>::iterator it = LOADED.begin(); it != LOADED.end(); ++it)
+			for (GLuint i = 0; i < (*it)->files.size(); ++i)
+				if (File::GetModified((*it)->files[i].c_str()) != (*it)->modified[i]) (*it)->dirty = true;
+	}
+	
+	bool reloaded = false;
+	for (std::vector<Shader *>::iterator it = LOADED.begin(); it != LOADED.end(); ++it)
+	{
+		Shader *shader = *it;
+		if (!shader->dirty) continue;
+		shader->dirty = false;
+		
+		// On error the previous program stays in use, the log is already printed
+		std::vector<std::string> files;
+		GLuint id = Build(shader->mask, shader->filename, shader->defines, files);
+		if (id)
+		{
+			glDeleteProgram(shader->id);
+			Memory::Deleted(Memory::PROGRAMS, 0);
+			shader->id = id;
+			shader->files = files;
+			reloaded = true;
+			std::cout << "Reloaded " << shader->filename << std::endl;
+		}
+		shader->Track();
+	}
+	return reloaded;
+}
+
+void Shader::Track()
+{
+	modified.resize(files.size());
+	for (GLuint i = 0; i < files.size(); ++i) modified[i] = File::GetModified(files[i].c_str());
+}
+
+GLuint Shader::Build(GLuint mask, const std::string &filename, const std::string &defines, std::vector<std::string> &files)
+{
+	static const GLenum types[] = { GL_VERTEX_SHADER, GL_GEOMETRY_SHADER, GL_FRAGMENT_SHADER };
+	static const char *extensions[] = { ".vs", ".gs", ".fs" };
+	
+	std::string sources[3];
+	for (GLuint i = 0; i < 3; ++i)
+		if ((mask & (1 << i)) && !Preprocess(filename + extensions[i], defines, sources[i], files, 0)) return 0;
+	
+	// Programs binaries are only valid for the same sources on the same driver
+	unsigned long long hash = Hash::Fnv(&mask, sizeof(mask));
+	for (GLuint i = 0; i < 3; ++i) hash = Hash::Fnv(sources[i].data(), sources[i].size(), hash);
+	const GLenum strings[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+	for (GLuint i = 0; i < 3; ++i)
+	{
+		const char *s = (const char *)glGetString(strings[i]);
+		if (s) hash = Hash::Fnv(s, strlen(s), hash);
+	}
+	
+	std::ostringstream cache;
+	cache << SHADER_CACHE_DIRECTORY << "/" << filename.substr(filename.find_last_of("\\/") + 1) << '-' << std::hex << hash << ".bin";
+	
+	GLuint id = GLEW_ARB_get_program_binary ? LoadBinary(cache.str()) : 0;
+	if (id) return id;
+	
+	id = glCreateProgram();
+	Memory::Created(Memory::PROGRAMS, 0);
+	if (GLEW_ARB_get_program_binary) glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	
+	GLuint doCompile = 0;
+	GLuint compiled = 0;
+	for (GLuint i = 0; i < 3; ++i)
+	{
+		if (!(mask & (1 << i))) continue;
+		++doCompile;
+		compiled += Compile(id, types[i], sources[i], filename + extensions[i]);
+	}
+	
+	GLint linked = GL_FALSE;
+	if (compiled == doCompile)
+	{
+		glLinkProgram(id);
+		glGetProgramiv(id, GL_LINK_STATUS, &linked);
+		if (linked == GL_FALSE)
+		{
+			GLint length = 0;
+			glGetProgramiv(id, GL_INFO_LOG_LENGTH, &length);
+			std::string log(length + 1, '\0');
+			glGetProgramInfoLog(id, length, NULL, &log[0]);
+			std::cerr << filename << ":" << std::endl << log.c_str() << std::endl;
+		}
+	}
+	
+	// Shader objects are no longer needed once the program is linked
+	GLuint shaders[3];
+	GLsizei count = 0;
+	glGetAttachedShaders(id, 3, &count, shaders);
+	for (GLsizei i = 0; i < count; ++i)
+	{
+		glDetachShader(id, shaders[i]);
+		glDeleteShader(shaders[i]);
+		Memory::Deleted(Memory::SHADERS, 0);
+	}
+	
+	if (linked == GL_FALSE)
+	{
+		glDeleteProgram(id);
+		Memory::Deleted(Memory::PROGRAMS, 0);
+		return 0;
+	}
+	
+	if (GLEW_ARB_get_program_binary) SaveBinary(id, cache.str());
+	return id;
+}
+
+bool Shader::Preprocess(const std::string &filename, const std::string &defines, std::string &out, std::vector<std::string> &files, GLuint depth)
+{
+	char *src = depth <= SHADER_INCLUDE_DEPTH ? File::ReadAll(filename.c_str()) : NULL;
+	if (!src)
+	{
+		std::cerr << filename << ": failed to read" << (depth > SHADER_INCLUDE_DEPTH ? " (include too deep)" : "") << std::endl;
+		return false;
+	}
+	
+	if (std::find(files.begin(), files.end(), filename) == files.end()) files.push_back(filename);
+	std::string directory = filename.substr(0, filename.find_last_of("\\/") + 1);
+	
+	std::istringstream is(src);
+	delete[] src;
+	
+	std::string line;
+	while (std::getline(is, line))
+	{
+		if (line.compare(0, 8, "#include") == 0)
+		{
+			size_t begin = line.find('"');
+			size_t end = begin == std::string::npos ? begin : line.find('"', begin + 1);
+			if (end == std::string::npos)
+			{
+				std::cerr << filename << ": malformed " << line << std::endl;
+				return false;
+			}
+			if (!Preprocess(directory + line.substr(begin + 1, end - begin - 1), "", out, files, depth + 1)) return false;
+			continue;
+		}
+		
+		out += line;
+		out += '\n';
+		
+		// Variant defines go right after the version directive
+		if (line.compare(0, 8, "#version") == 0) out += defines;
+	}
+	return true;
+}
+
+GLuint Shader::Compile(GLuint id, GLenum type, const std::string &source, const std::string &filename)
+{
+	GLuint shader = glCreateShader(type);
+	if (shader == 0) return 0;
+	Memory::Created(Memory::SHADERS, 0);
+	
+	const char *src = source.c_str();
+	glShaderSource(shader, 1, &src, NULL);
+
+	glCompileShader(shader);
+	GLint compiled;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (compiled == GL_FALSE)
+	{
+		GLint length = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+		std::string log(length + 1, '\0');
+		glGetShaderInfoLog(shader, length, NULL, &log[0]);
+		std::cerr << filename << ":" << std::endl << log.c_str() << std::endl;
+		glDeleteShader(shader);
+		Memory::Deleted(Memory::SHADERS, 0);
+		return 0;
+	}
+	glAttachShader(id, shader);
+	return 1;
+}
+
+GLuint Shader::LoadBinary(const std::string &filename)
+{
+	GLuint size = 0;
+	char *data = File::ReadAll(filename.c_str(), &size);
+	if (!data) return 0;
+	
+	GLuint id = 0;
+	if (size > sizeof(GLenum))
+	{
+		id = glCreateProgram();
+		Memory::Created(Memory::PROGRAMS, 0);
+		glProgramBinary(id, *(GLenum *)data, data + sizeof(GLenum), size - sizeof(GLenum));
+		
+		// Rejected when the driver changed its binary format
+		GLint linked;
+		glGetProgramiv(id, GL_LINK_STATUS, &linked);
+		if (linked == GL_FALSE)
+		{
+			glDeleteProgram(id);
+			Memory::Deleted(Memory::PROGRAMS, 0);
+			id = 0;
+		}
+	}
+	delete[] data;
+	return id;
+}
+
+void Shader::SaveBinary(GLuint id, const std::string &filename)
+{
+	GLint length = 0;
+	glGetProgramiv(id, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return;
+	
+	char *data = new char[sizeof(GLenum) + length];
+	glGetProgramBinary(id, length, NULL, (GLenum *)data, data + sizeof(GLenum));
+	File::MakeDirectory(SHADER_CACHE_DIRECTORY);
+	File::WriteAll(filename.c_str(), data, sizeof(GLenum) + length);
+	delete[] data;
+}
+
+Model *Model::E = NULL;
+Model *Model::I = NULL;
+Model *Model::H = NULL;
+Model *Model::L = NULL;
+Model *Model::U = NULL;
+Model *Model::ENEMY = NULL;
+Model *Model::POST = NULL;
+
+float *Model::Parse(const std::string &filename, GLuint *size)
+{
+	char *data = File::ReadAll(filename.c_str(), size);
+	if (!data) return NULL;
+	if (*size < 18 || (*size % 18))
+	{
+		delete[] data;
+		return NULL;
+	}
+	
+	float *vertices = new float[*size];
+	char s = -1;
+	for (GLuint i = 0; i < *size; ++i)
+	{
+		s = i % 3 ? s : !s;
+		float f = data[i] - '0';
+		vertices[i] = s ? f * 0.25f : f * 0.5f;
+	}
+	delete[] data;
+	return vertices;
+}
+
+Model *Model::Load(const std::string &filename, bool upload)
+{
+	Memory::Scope scope(Memory::ASSETS);
+	GLuint size = 0;
+	float *vertices = Parse(filename, &size);
+	if (!vertices) return NULL;
+	
+	// The vertices stay in memory for the software renderer, headless runs have nothing to upload to
+	if (!upload) return new Model(0, 0, size / 6, (Vertex *)vertices);
+	
+	GLuint vbo;
+	glGenBuffers(1, &vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBufferData(GL_ARRAY_BUFFER, size * sizeof(float), vertices, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	Memory::Created(Memory::BUFFERS, size * sizeof(float));
+	
+	GLuint vao;
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glEnableVertexAttribArray(0);
+		glEnableVertexAttribArray(1);
+		glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)&((Vertex *)0)->s);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+	
+	return new Model(vbo, vao, size / 6, (Vertex *)vertices);
+}
+
+Model::Model(GLuint _vbo, GLuint _vao, GLuint _count, Vertex *_vertices) : vbo(_vbo), vao(_vao), count(_count), vertices(_vertices) {}
+	
+Model::~Model()
+{
+	delete[] (float *)vertices;
+	if (!vao) return;
+	
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+	glDeleteVertexArrays(1, &vao);
+	glDeleteBuffers(1, &vbo);
+	Memory::Deleted(Memory::BUFFERS, count * sizeof(Vertex));
+}
+
+inline void Model::Bind() { glBindVertexArray(vao); }
+inline void Model::Unbind() { glBindVertexArray(0); }
+
+void Model::BindInstances(GLuint buffer, GLuint offset, GLuint stride)
+{
+	// Per instance position (vec3) followed by animation index and frame (2 bytes), the VAO must be bound
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	glEnableVertexAttribArray(2);
+	glEnableVertexAttribArray(3);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (void *)(size_t)offset);
+	glVertexAttribIPointer(3, 2, GL_UNSIGNED_BYTE, stride, (void *)(size_t)(offset + sizeof(glm::vec3)));
+	glVertexAttribDivisor(2, 1);
+	glVertexAttribDivisor(3, 1);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+Texture *Texture::GLOBAL = NULL;
+
+char *Texture::Parse(const std::string &filename, GLuint *width, GLuint *height)
+{
+	GLuint size = 0;
+	char *data = File::ReadAll(filename.c_str(), &size);
+	if (!data) return NULL;
+	
+	// Uncompressed 24 bits BMP only
+	if (size < 54 || data[0] != 'B' || data[1] != 'M' ||
+		*(short *)(data + 28) != 24 ||	// Bits per pixel
+		*(GLuint *)(data + 30) != 0)	// Compression
+	{
+		delete[] data;
+		return NULL;
+	}
+	
+	GLuint offset = *(GLuint *)(data + 10);
+	int w = *(int *)(data + 18);
+	int h = *(int *)(data + 22);
+	GLuint pitch = (w * 3 + 3) & ~3;
+	GLuint rows = glm::abs(h);
+	if (w <= 0 || offset + pitch * rows > size)
+	{
+		delete[] data;
+		return NULL;
+	}
+	
+	// Rows are stored bottom-up unless the height is negative, flip them like SDL_LoadBMP does
+	char *pixels = new char[pitch * rows];
+	for (GLuint y = 0; y < rows; ++y) memcpy(pixels + y * pitch, data + offset + (h > 0 ? rows - 1 - y : y) * pitch, pitch);
+	delete[] data;
+	
+	*width = w;
+	*height = rows;
+	return pixels;
+}
+
+Texture *Texture::Load(const std::string &filename, bool upload)
+{
+	Memory::Scope scope(Memory::ASSETS);
+	GLuint width, height;
+	char *pixels = Parse(filename, &width, &height);
+	if (!pixels) return NULL;
+	
+	// Packed 0xRRGGBB copy for the software renderer
+	GLuint pitch = (width * 3 + 3) & ~3;
+	GLuint *texels = new GLuint[width * height];
+	for (GLuint y = 0; y < height; ++y)
+	{
+		const GLubyte *row = (const GLubyte *)pixels + y * pitch;
+		for (GLuint x = 0; x < width; ++x) texels[y * width + x] = row[x * 3 + 2] << 16 | row[x * 3 + 1] << 8 | row[x * 3];
+	}
+	if (!upload)
+	{
+		delete[] pixels;
+		return new Texture(0, width, height, texels);
+	}
+
+	glActiveTexture(0);
+
+	GLuint id;
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D, id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, pixels);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	delete[] pixels;
+	Memory::Created(Memory::TEXTURES, width * height * 4);
+
+	return new Texture(id, width, height, texels);
+}
+
+Texture::Texture(GLuint _id, GLuint _width, GLuint _height, GLuint *_texels) : id(_id), width(_width), height(_height), texels(_texels) {}
+
+Texture::~Texture()
+{
+	delete[] texels;
+	if (!id) return;
+	glDeleteTextures(1, &id);
+	Memory::Deleted(Memory::TEXTURES, width * height * 4);
+}
+
+inline void Texture::Bind() { glBindTexture(GL_TEXTURE_2D, id); }
+inline void Texture::Unbind() { glBindTexture(GL_TEXTURE_2D, 0); }
+
+SoundBuffer *SoundBuffer::MUSIC = NULL;
+SoundBuffer *SoundBuffer::HIT = NULL;
+SoundBuffer *SoundBuffer::CROWBAR = NULL;
+SoundBuffer *SoundBuffer::ENEMY = NULL;
+
+char *SoundBuffer::Parse(const std::string &filename, GLuint *size)
+{
+	GLuint fileSize = 0;
+	char *data = File::ReadAll(filename.c_str(), &fileSize);
+	if (!data) return NULL;
+	if (fileSize < 44 ||
+		*(short *)(data + 20) != 1 ||	// Audio format PCM
+		*(short *)(data + 22) != 1 ||	// Number channels 1
+		*(GLuint *)(data + 24) != 44100 ||	// Sample rate 44100
+		*(short *)(data + 34) != 16 ||	// Bits per sample 16
+		*(GLuint *)(data + 40) > fileSize - 44)	// Samples size
+	{
+		delete[] data;
+		return NULL;
+	}
+	
+	// Samples start after the 44 bytes header
+	*size = *(GLuint *)(data + 40);
+	return data;
+}
+
+SoundBuffer *SoundBuffer::Load(const std::string &filename)
+{
+	Memory::Scope scope(Memory::AUDIO);
+	GLuint size = 0;
+	char *data = Parse(filename, &size);
+	if (!data) return NULL;
+	
+	GLuint id;
+	alGenBuffers(1, &id);
+	alBufferData(id, AL_FORMAT_MONO16, data + 44, size, 44100);
+	delete[] data;
+	Memory::Created(Memory::SOUNDS, size);
+	
+	return new SoundBuffer(id, size);
+}
+
+SoundBuffer::SoundBuffer(GLuint _id, GLuint _size) : id(_id), size(_size) {}
+SoundBuffer::~SoundBuffer()
+{
+	alDeleteBuffers(1, &id);
+	Memory::Deleted(Memory::SOUNDS, size);
+}
+
+Sound *Sound::MUSIC = NULL;
+Sound *Sound::HIT = NULL;
+Sound *Sound::CROWBAR = NULL;
+
+Sound::Sound(SoundBuffer *buf)
+{
+	alGenSources(1, &id);
+	alSourcei(id, AL_BUFFER, buf->id);
+}
+Sound::~Sound() { Stop(); alDeleteSources(1, &id); }
+
+inline int Sound::GetState() { int s; alGetSourcei(id, AL_SOURCE_STATE, &s); return s; }
+inline void Sound::SetLooping(bool looping) { alSourcei(id, AL_LOOPING, looping); }
+inline void Sound::Play() { if (GetState() != AL_PLAYING) alSourcePlay(id); }
+inline void Sound::Pause() { if (GetState() == AL_PLAYING) alSourcePause(id); }
+inline void Sound::Stop() { if (GetState() != AL_STOPPED) alSourceStop(id); }
+inline void Sound::SetVolume(float volume) { alSourcef(id, AL_GAIN, volume); }
+
+StreamBuffer *StreamBuffer::ENEMIES = NULL;
+
+StreamBuffer *StreamBuffer::Create(GLenum target, GLuint size)
+{
+	Memory::Scope scope(Memory::RENDER);
+	GLuint id;
+	glGenBuffers(1, &id);
+	glBindBuffer(target, id);
+	
+	char *memory = NULL;
+	if (GLEW_ARB_buffer_storage)
+	{
+		// Immutable storage mapped once for the whole lifetime, CPU writes land directly in the buffer
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(target, size * STREAM_BUFFER_SECTIONS, NULL, flags);
+		memory = (char *)glMapBufferRange(target, 0, size * STREAM_BUFFER_SECTIONS, flags);
+		if (!memory)
+		{
+			glBindBuffer(target, 0);
+			glDeleteBuffers(1, &id);
+			return NULL;
+		}
+	}
+	else glBufferData(target, size * STREAM_BUFFER_SECTIONS, NULL, GL_STREAM_DRAW);
+	glBindBuffer(target, 0);
+	Memory::Created(Memory::BUFFERS, size * STREAM_BUFFER_SECTIONS);
+	
+	return new StreamBuffer(target, id, size, memory);
+}
+
+StreamBuffer::StreamBuffer(GLenum _target, GLuint _id, GLuint _size, char *_memory) : id(_id), size(_size), offset(0), waits(0), persistent(_memory != NULL), target(_target), section(0), used(0), memory(_memory)
+{
+	memset(fences, 0, sizeof(fences));
+}
+
+StreamBuffer::~StreamBuffer()
+{
+	for (GLuint i = 0; i < STREAM_BUFFER_SECTIONS; ++i) if (fences[i]) glDeleteSync(fences[i]);
+	if (persistent)
+	{
+		glBindBuffer(target, id);
+		glUnmapBuffer(target);
+		glBindBuffer(target, 0);
+	}
+	glDeleteBuffers(1, &id);
+	Memory::Deleted(Memory::BUFFERS, size * STREAM_BUFFER_SECTIONS);
+}
+
+inline void StreamBuffer::Bind() { glBindBuffer(target, id); }
+inline void StreamBuffer::Unbind() { glBindBuffer(target, 0); }
+
+void *StreamBuffer::Map(GLuint bytes)
+{
+	if (bytes == 0 || used + bytes > size) return NULL;
+	
+	// First write of the frame into this section, the GPU may still read it from 3 frames ago
+	if (used == 0) Wait();
+	
+	offset = section * size + used;
+	used += bytes;
+	if (persistent) return memory + offset;
+	
+	glBindBuffer(target, id);
+	void *p = glMapBufferRange(target, offset, bytes, GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+	glBindBuffer(target, 0);
+	return p;
+}
+
+void StreamBuffer::Unmap()
+{
+	if (persistent) return;
+	glBindBuffer(target, id);
+	glUnmapBuffer(target);
+	glBindBuffer(target, 0);
+}
+
+void StreamBuffer::Fence()
+{
+	if (used == 0) return;
+	fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	section = (section + 1) % STREAM_BUFFER_SECTIONS;
+	used = 0;
+}
+
+void StreamBuffer::Wait()
+{
+	GLsync fence = fences[section];
+	if (!fence) return;
+	fences[section] = NULL;
+	
+	if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+	{
+		++waits;
+		if (persistent) while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED);
+		else
+		{
+			// Without persistent storage, orphan the whole buffer instead of stalling on the driver
+			glBindBuffer(target, id);
+			glBufferData(target, size * STREAM_BUFFER_SECTIONS, NULL, GL_STREAM_DRAW);
+			glBindBuffer(target, 0);
+			for (GLuint i = 0; i < STREAM_BUFFER_SECTIONS; ++i)
+			{
+				if (fences[i]) glDeleteSync(fences[i]);
+				fences[i] = NULL;
+			}
+		}
+	}
+	glDeleteSync(fence);
+}
+
+FrameBuffer *FrameBuffer::POST = NULL;
+
+FrameBuffer *FrameBuffer::Create(GLuint width, GLuint height)
+{
+	Memory::Scope scope(Memory::RENDER);
+	GLuint fbo, color, depth;
+	
+	glGenTextures(1, &color);
+	glBindTexture(GL_TEXTURE_2D, color);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_BGR, GL_UNSIGNED_BYTE, NULL);
+	
+	glGenTextures(1, &depth);
+	glBindTexture(GL_TEXTURE_2D, depth);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, width, height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	
+	// Color and depth attachments, 4 bytes per pixel each
+	Memory::Created(Memory::FRAMEBUFFERS, width * height * 8);
+	return new FrameBuffer(fbo, color, depth, width, height);
+}
+
+FrameBuffer::FrameBuffer(GLuint _fbo, GLuint _color, GLuint _depth, GLuint _width, GLuint _height) : fbo(_fbo), color(_color), depth(_depth), width(_width), height(_height) {}
+FrameBuffer::~FrameBuffer()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteTextures(1, &depth);
+	glDeleteTextures(1, &color);
+	Memory::Deleted(Memory::FRAMEBUFFERS, width * height * 8);
+}
+
+Encoder *Encoder::Create(const std::string &filename, GLuint fps)
+{
+	Memory::Scope scope(Memory::RENDER);
+	
+	// The extension picks the format, a Y4M file is one stream and images are numbered
+	size_t dot = filename.find_last_of('.');
+	std::string extension = dot == std::string::npos ? "" : filename.substr(dot + 1);
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	
+	Format format;
+	if (extension == "y4m") format = Y4M;
+	else if (extension == "png") format = PNG;
+	else if (extension == "ppm") format = PPM;
+	else
+	{
+		std::cerr << filename << ": unknown capture format, use .y4m, .png or .ppm" << std::endl;
+		return NULL;
+	}
+	
+	Encoder *encoder = new Encoder(filename, format, fps);
+	if (format == Y4M && !encoder->stream)
+	{
+		std::cerr << "Failed to opening " << filename << std::endl;
+		delete encoder;
+		return NULL;
+	}
+	return encoder;
+}
+
+Encoder::Encoder(const std::string &_filename, Format _format, GLuint _fps) : filename(_filename), frames(0), dropped(0), microseconds(0), format(_format), fps(_fps), header(false), stopping(false)
+{
+	if (format == Y4M) stream.open(filename.c_str(), std::ios::binary);
+	worker = std::thread(&Encoder::Work, this);
+}
+
+Encoder::~Encoder()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_one();
+	worker.join();
+	
+	if (frames || dropped) std::cout << filename << ": " << frames << " frames, " << dropped << " dropped, " << (frames ? microseconds / 1000.0 / frames : 0.0) << " ms/frame encoding" << std::endl;
+	for (std::vector<Frame *>::iterator it = queue.begin(); it != queue.end(); ++it) delete *it;
+	for (std::vector<Frame *>::iterator it = spare.begin(); it != spare.end(); ++it) delete *it;
+}
+
+bool Encoder::Push(const GLuint *pixels, GLuint width, GLuint height, bool bottomUp, const float *depth, const glm::vec2 &planes)
+{
+	// The caller never waits for the disk, a frame is dropped when the worker is too far behind
+	Frame *frame;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (queue.size() >= ENCODER_QUEUE_FRAMES)
+		{
+			++dropped;
+			return false;
+		}
+		if (spare.empty()) frame = new Frame();
+		else
+		{
+			frame = spare.back();
+			spare.pop_back();
+		}
+	}
+	
+	frame->pixels.assign(pixels, pixels + width * height);
+	if (depth) frame->depth.assign(depth, depth + width * height);
+	else frame->depth.clear();
+	frame->width = width;
+	frame->height = height;
+	frame->bottomUp = bottomUp;
+	frame->planes = planes;
+	
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(frame);
+	}
+	wake.notify_one();
+	return true;
+}
+
+void Encoder::Work()
+{
+	Memory::Scope scope(Memory::RENDER);
+	std::vector<Frame *> batch;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [this] { return stopping || !queue.empty(); });
+			if (queue.empty()) return;
+			batch.swap(queue);
+		}
+		
+		for (std::vector<Frame *>::iterator it = batch.begin(); it != batch.end(); ++it)
+		{
+			double start = Clock::Milliseconds();
+			if (Encode(**it)) ++frames;
+			else ++dropped;
+			microseconds += (unsigned long long)((Clock::Milliseconds() - start) * 1000);
+		}
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		spare.insert(spare.end(), batch.begin(), batch.end());
+		batch.clear();
+	}
+}
+
+bool Encoder::Encode(Frame &frame)
+{
+	GLuint width = frame.width, height = frame.height;
+	
+	// GL rows start at the bottom, the files start at the top
+	if (frame.bottomUp)
+	{
+		for (GLuint y = 0; y < height / 2; ++y)
+		{
+			std::swap_ranges(frame.pixels.begin() + y * width, frame.pixels.begin() + (y + 1) * width, frame.pixels.begin() + (height - 1 - y) * width);
+			if (!frame.depth.empty()) std::swap_ranges(frame.depth.begin() + y * width, frame.depth.begin() + (y + 1) * width, frame.depth.begin() + (height - 1 - y) * width);
+		}
+	}
+	
+	// A frame read before the post pass still needs its fog
+	for (GLuint i = 0; i < frame.depth.size(); ++i)
+	{
+		float f = Renderer::Fog(frame.planes, frame.depth[i]);
+		GLuint c = frame.pixels[i];
+		frame.pixels[i] = (GLuint)((c >> 16 & 0xFF) * f + 0.5f) << 16 | (GLuint)((c >> 8 & 0xFF) * f + 0.5f) << 8 | (GLuint)((c & 0xFF) * f + 0.5f);
+	}
+	
+	if (format == Y4M) return WriteY4m(frame);
+	
+	std::ostringstream path;
+	path << filename.substr(0, filename.find_last_of('.')) << '-' << std::setw(6) << std::setfill('0') << frames << (format == PNG ? ".png" : ".ppm");
+	if (format == PNG) return WritePng(frame, path.str());
+	return SoftwareRenderer::Write(path.str().c_str(), frame.pixels.data(), width, height);
+}
+
+bool Encoder::WriteY4m(const Frame &frame)
+{
+	GLuint width = frame.width, height = frame.height;
+	GLuint cw = (width + 1) / 2, ch = (height + 1) / 2;
+	
+	// The stream header takes the size of the first frame written, later frames must match it
+	if (!header)
+	{
+		stream << "YUV4MPEG2 W" << width << " H" << height << " F" << fps << ":1 Ip A1:1 C420jpeg\n";
+		header = true;
+	}
+	
+	// Full range BT.601 like JPEG, chroma is averaged over 2x2 pixels
+	bytes.resize(width * height + cw * ch * 2);
+	unsigned char *y = bytes.data(), *u = y + width * height, *v = u + cw * ch;
+	for (GLuint i = 0; i < width * height; ++i)
+	{
+		GLuint c = frame.pixels[i];
+		y[i] = (unsigned char)glm::clamp(0.299f * (c >> 16 & 0xFF) + 0.587f * (c >> 8 & 0xFF) + 0.114f * (c & 0xFF) + 0.5f, 0.0f, 255.0f);
+	}
+	for (GLuint cy = 0; cy < ch; ++cy)
+	{
+		for (GLuint cx = 0; cx < cw; ++cx)
+		{
+			float r = 0, g = 0, b = 0;
+			for (GLuint k = 0; k < 4; ++k)
+			{
+				GLuint c = frame.pixels[glm::min(cy * 2 + (k >> 1), height - 1) * width + glm::min(cx * 2 + (k & 1), width - 1)];
+				r += c >> 16 & 0xFF;
+				g += c >> 8 & 0xFF;
+				b += c & 0xFF;
+			}
+			r *= 0.25f;
+			g *= 0.25f;
+			b *= 0.25f;
+			u[cy * cw + cx] = (unsigned char)glm::clamp(128 - 0.168736f * r - 0.331264f * g + 0.5f * b + 0.5f, 0.0f, 255.0f);
+			v[cy * cw + cx] = (unsigned char)glm::clamp(128 + 0.5f * r - 0.418688f * g - 0.081312f * b + 0.5f, 0.0f, 255.0f);
+		}
+	}
+	
+	stream << "FRAME\n";
+	stream.write((const char *)bytes.data(), bytes.size());
+	stream.flush();
+	return !stream.fail();
+}
+
+bool Encoder::WritePng(const Frame &frame, const std::string &path)
+{
+	GLuint width = frame.width, height = frame.height;
+	GLuint row = width * 3 + 1;
+	
+	// Scanlines with no filter in stored deflate blocks, larger than a compressed file but needs no zlib
+	std::vector<unsigned char> raw(row * height);
+	for (GLuint y = 0; y < height; ++y)
+	{
+		unsigned char *p = &raw[y * row];
+		*p++ = 0;
+		for (GLuint x = 0; x < width; ++x)
+		{
+			GLuint c = frame.pixels[y * width + x];
+			*p++ = c >> 16 & 0xFF;
+			*p++ = c >> 8 & 0xFF;
+			*p++ = c & 0xFF;
+		}
+	}
+	
+	bytes.clear();
+	bytes.push_back(0x78);
+	bytes.push_back(0x01);
+	for (size_t offset = 0; offset < raw.size();)
+	{
+		GLuint n = (GLuint)glm::min<size_t>(raw.size() - offset, 65535);
+		bytes.push_back(offset + n == raw.size());
+		bytes.push_back(n & 0xFF);
+		bytes.push_back(n >> 8);
+		bytes.push_back(~n & 0xFF);
+		bytes.push_back(~n >> 8 & 0xFF);
+		bytes.insert(bytes.end(), raw.begin() + offset, raw.begin() + offset + n);
+		offset += n;
+	}
+	GLuint adler = Hash::Adler32(raw.data(), raw.size());
+	for (int shift = 24; shift >= 0; shift -= 8) bytes.push_back(adler >> shift & 0xFF);
+	
+	std::ofstream os(path.c_str(), std::ios::binary);
+	if (!os) return false;
+	
+	// Chunks are a big endian length, the type, the data and a CRC of type and data
+	struct Chunk
+	{
+		static void Write(std::ofstream &os, const char *type, const unsigned char *data, GLuint size)
+		{
+			unsigned char length[4] = { (unsigned char)(size >> 24), (unsigned char)(size >> 16), (unsigned char)(size >> 8), (unsigned char)size };
+			GLuint crc = Hash::Crc32(data, size, Hash::Crc32(type, 4));
+			unsigned char check[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+			os.write((const char *)length, 4);
+			os.write(type, 4);
+			os.write((const char *)data, size);
+			os.write((const char *)check, 4);
+		}
+	};
+	
+	const unsigned char header[13] = { (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width, (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height, 8, 2, 0, 0, 0 };
+	os.write("\x89PNG\r\n\x1a\n", 8);
+	Chunk::Write(os, "IHDR", header, 13);
+	Chunk::Write(os, "IDAT", bytes.data(), bytes.size());
+	Chunk::Write(os, "IEND", NULL, 0);
+	return !os.fail();
+}
+
+Readback *Readback::Create()
+{
+	Memory::Scope scope(Memory::RENDER);
+	Readback *readback = new Readback();
+	for (GLuint i = 0; i < READBACK_BUFFERS; ++i)
+	{
+		glGenBuffers(1, &readback->slots[i].pbo);
+		if (!readback->slots[i].pbo)
+		{
+			delete readback;
+			return NULL;
+		}
+		Memory::Created(Memory::BUFFERS, 0);
+	}
+	return readback;
+}
+
+Readback::Readback() : requested(0), dropped(0), next(0), pending(0)
+{
+	for (GLuint i = 0; i < READBACK_BUFFERS; ++i)
+	{
+		slots[i].pbo = slots[i].size = 0;
+		slots[i].fence = NULL;
+	}
+}
+
+Readback::~Readback()
+{
+	// Frames still in flight are waited for, the last ones of a recording are not lost
+	if (pending)
+	{
+		glFinish();
+		Poll();
+	}
+	
+	for (GLuint i = 0; i < READBACK_BUFFERS; ++i)
+	{
+		if (slots[i].fence) glDeleteSync(slots[i].fence);
+		if (!slots[i].pbo) continue;
+		glDeleteBuffers(1, &slots[i].pbo);
+		Memory::Deleted(Memory::BUFFERS, slots[i].size);
+	}
+}
+
+bool Readback::Request(GLuint width, GLuint height, bool depth, Encoder *encoder, const glm::vec2 &planes)
+{
+	++requested;
+	
+	// Never wait for a buffer, the frame is dropped when the GPU has not released any
+	if (pending == READBACK_BUFFERS)
+	{
+		++dropped;
+		return false;
+	}
+	Slot &slot = slots[next];
+	next = (next + 1) % READBACK_BUFFERS;
+	++pending;
+	
+	// Colors first, then the depths when the fog is still to apply
+	GLuint bytes = width * height * (depth ? 8 : 4);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+	if (slot.size < bytes)
+	{
+		Memory::Deleted(Memory::BUFFERS, slot.size);
+		slot.size = bytes;
+		glBufferData(GL_PIXEL_PACK_BUFFER, slot.size, NULL, GL_STREAM_READ);
+		Memory::Created(Memory::BUFFERS, slot.size);
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, NULL);
+	if (depth) glReadPixels(0, 0, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, (void *)(size_t)(width * height * 4));
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	
+	slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.width = width;
+	slot.height = height;
+	slot.depth = depth;
+	slot.encoder = encoder;
+	slot.planes = planes;
+	return true;
+}
+
+void Readback::Poll()
+{
+	// Oldest first and only while the fences are signaled, so the frames of a video stay in order
+	while (pending)
+	{
+		Slot &slot = slots[(next + READBACK_BUFFERS - pending) % READBACK_BUFFERS];
+		if (glClientWaitSync(slot.fence, 0, 0) == GL_TIMEOUT_EXPIRED) return;
+		glDeleteSync(slot.fence);
+		slot.fence = NULL;
+		--pending;
+		
+		GLuint count = slot.width * slot.height;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		const GLuint *src = (const GLuint *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, count * (slot.depth ? 8 : 4), GL_MAP_READ_BIT);
+		if (src)
+		{
+			slot.encoder->Push(src, slot.width, slot.height, true, slot.depth ? (const float *)(src + count) : NULL, slot.planes);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+}
+
+inline void FrameBuffer::Bind() { glBindFramebuffer(GL_FRAMEBUFFER, fbo); }
+inline void FrameBuffer::Unbind() { glBindFramebuffer(GL_FRAMEBUFFER, 0); }
+inline void FrameBuffer::BindColor() { glBindTexture(GL_TEXTURE_2D, color); }
+inline void FrameBuffer::BindDepth() { glBindTexture(GL_TEXTURE_2D, depth); }
+
+bool *Input::KEYBOARD = 0;
+
+GLuint Input::Read()
+{
+	GLuint buttons = 0;
+	if (KEYBOARD[SDL_SCANCODE_W] || KEYBOARD[SDL_SCANCODE_UP]) buttons |= INPUT_FORWARD;
+	if (KEYBOARD[SDL_SCANCODE_S] || KEYBOARD[SDL_SCANCODE_DOWN]) buttons |= INPUT_BACKWARD;
+	if (KEYBOARD[SDL_SCANCODE_A]) buttons |= INPUT_STRAFE_LEFT;
+	if (KEYBOARD[SDL_SCANCODE_D]) buttons |= INPUT_STRAFE_RIGHT;
+	if (KEYBOARD[SDL_SCANCODE_LEFT]) buttons |= INPUT_TURN_LEFT;
+	if (KEYBOARD[SDL_SCANCODE_RIGHT]) buttons |= INPUT_TURN_RIGHT;
+	if (KEYBOARD[SDL_SCANCODE_SPACE]) buttons |= INPUT_ATTACK;
+	return buttons;
+}
+
+template<typename T, GLuint SIZE>
+SpscQueue<T, SIZE>::SpscQueue() : head(0), tail(0) {}
+
+template<typename T, GLuint SIZE>
+inline bool SpscQueue<T, SIZE>::Push(const T &item)
+{
+	// Only the producer moves the tail, only the consumer moves the head
+	GLuint t = tail.load(std::memory_order_relaxed);
+	if (t - head.load(std::memory_order_acquire) == SIZE) return false;
+	items[t % SIZE] = item;
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+template<typename T, GLuint SIZE>
+inline bool SpscQueue<T, SIZE>::Pop(T &item)
+{
+	GLuint h = head.load(std::memory_order_relaxed);
+	if (h == tail.load(std::memory_order_acquire)) return false;
+	item = items[h % SIZE];
+	head.store(h + 1, std::memory_order_release);
+	return true;
+}
+
+template<typename T>
+TripleBuffer<T>::TripleBuffer() : back(0), front(1), ready(false), middle(2) {}
+
+template<typename T>
+inline T &TripleBuffer<T>::Back() { return slots[back]; }
+
+template<typename T>
+inline void TripleBuffer<T>::Publish()
+{
+	// The written slot becomes the middle one, the writer takes whatever was there
+	back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & ~FRESH;
+}
+
+template<typename T>
+inline const T *TripleBuffer<T>::Latest()
+{
+	// The reader swaps only when something newer was published, and never waits for the writer
+	if (middle.load(std::memory_order_relaxed) & FRESH)
+	{
+		front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+		ready = true;
+	}
+	return ready ? &slots[front] : NULL;
+}
+
+template<typename T>
+template<typename F>
+void TripleBuffer<T>::Prepare(F prepare)
+{
+	// Only before the writer and the reader start
+	for (GLuint i = 0; i < 3; ++i) prepare(slots[i]);
+}
+
+Point &Point::Set(short x, short y)
+{
+	this->x = x;
+	this->y = y;
+	return *this;
+}
+
+bool Point::operator==(const Point &o) const
+{
+	return *((int*)this) == *((int*)&o);
+}
+
+Player::Player(glm::vec3 _position, float _angle) : position(_position), look(glm::vec3(glm::cos(_angle), 0, glm::sin(_angle))), angle(_angle), moving(0), frame(1), attackTicks(0), life(PLAYER_LIFES), buttons(0) {}
+
+void Player::Update(World &world)
+{
+	Map *map = world.map;
+	
+	// The low bits of the buttons are the movement mask, see INPUT_*
+	char moveMask = buttons & (INPUT_FORWARD | INPUT_BACKWARD | INPUT_STRAFE_LEFT | INPUT_STRAFE_RIGHT);
+	
+	if (moveMask & 1) map->Move(position, look * PLAYER_SPEED);
+	else if (moveMask & 2) map->Move(position, look * -PLAYER_SPEED);
+	
+	if (moveMask & 4) map->Move(position, glm::vec3(look.z * PLAYER_SPEED, 0, look.x * -PLAYER_SPEED));
+	else if (moveMask & 8) map->Move(position, glm::vec3(look.z * -PLAYER_SPEED, 0, look.x * PLAYER_SPEED));
+	
+	if (buttons & INPUT_TURN_LEFT)
+	{
+		angle -= PLAYER_ANGLE_SPEED;
+		look.x = glm::cos(angle);
+		look.z = glm::sin(angle);
+	}
+	else if (buttons & INPUT_TURN_RIGHT)
+	{
+		angle += PLAYER_ANGLE_SPEED;
+		look.x = glm::cos(angle);
+		look.z = glm::sin(angle);
+	}
+	
+	if (moveMask)
+	{
+		moving += 0.25f;
+		position.y = glm::cos(moving) * 0.05f;
+	}
+	
+	if (attackTicks > 1)
+	{
+		--attackTicks;
+		return;
+	}
+	
+	frame = 1;
+	
+	if (attackTicks == 1 && (buttons & INPUT_ATTACK)) return;
+	
+	attackTicks = 0;
+	
+	if (buttons & INPUT_ATTACK)
+	{
+		if (Sound::CROWBAR) Sound::CROWBAR->Play();
+		
+		attackTicks = PLAYER_ATTACK_TICKS;
+		frame = 2;
+		
+		bool hit = false;
+		
+		for (int z = position.z - map->origin.y + 0.5f - 1, ez = z + 2; z <= ez; ++z)
+		{
+			if (z < 0 || z >= map->size.y) continue;
+			
+			for (int x = position.x - map->origin.x + 0.5f - 1, ex = x + 2; x <= ex; ++x)
+			{
+				if (x < 0 || x >= map->size.x) continue;
+				
+				Block *b = map->blocks[z * map->size.x + x];
+				if (b == NULL) continue;
+				
+				for (Enemy *enemy = b->enemies.first; enemy; enemy = enemy->nextInBlock)
+				{
+					if (enemy->animation > 0) continue;
+					
+					glm::vec3 relative = enemy->position - position;
+					float dp = glm::dot(look, relative);
+					
+					if (dp > 0 && glm::length(relative) < HIT_DISTANCE)
+					{
+						enemy->PlayFallAnimation(world);
+						hit = true;
+					}
+				}
+			}
+		}
+		
+		if (hit && Sound::HIT) Sound::HIT->Play();
+	}
+	else frame = 1;
+}
+
+Timer::Timer() : prev(NULL), next(NULL), due(0), owner(NULL) {}
+Timer::~Timer() { Unlink(); }
+
+inline bool Timer::IsScheduled() const { return prev != NULL; }
+
+inline void Timer::Unlink()
+{
+	if (!prev) return;
+	prev->next = next;
+	next->prev = prev;
+	prev = next = NULL;
+}
+
+inline void Timer::Append(Timer &timer)
+{
+	// This timer is the sentinel of a circular list
+	timer.prev = prev;
+	timer.next = this;
+	prev->next = &timer;
+	prev = &timer;
+}
+
+TimerWheel::TimerWheel() : now(0), fired(0)
+{
+	for (GLuint l = 0; l < TIMER_LEVELS; ++l)
+		for (GLuint i = 0; i < TIMER_SLOTS; ++i) slots[l][i].prev = slots[l][i].next = &slots[l][i];
+}
+
+void TimerWheel::Schedule(Timer &timer, GLuint delay)
+{
+	// A timer is never due in the tick being processed, and the farthest level bounds the delay
+	timer.Unlink();
+	timer.due = now + glm::clamp<GLuint>(delay, 1, (1u << (TIMER_BITS * TIMER_LEVELS)) - 1);
+	Insert(timer);
+}
+
+inline GLuint TimerWheel::GetRemaining(const Timer &timer) const { return timer.IsScheduled() ? timer.due - now : 0; }
+
+void TimerWheel::Insert(Timer &timer)
+{
+	// Level l holds the timers due within 64^(l+1) ticks, in the slot of their 64^l ticks block
+	GLuint delta = timer.due - now;
+	GLuint level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= 1u << (TIMER_BITS * (level + 1))) ++level;
+	slots[level][(timer.due >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)].Append(timer);
+}
+
+void TimerWheel::Cascade(GLuint level)
+{
+	// Entering a new block of this level, its timers move down to finer levels
+	Timer &slot = slots[level][(now >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+	while (slot.next != &slot)
+	{
+		Timer *timer = slot.next;
+		timer->Unlink();
+		Insert(*timer);
+	}
+}
+
+template<typename F>
+void TimerWheel::Advance(F fire)
+{
+	++now;
+	
+	GLuint top = 0;
+	while (top < TIMER_LEVELS - 1 && !((now >> (TIMER_BITS * top)) & (TIMER_SLOTS - 1))) ++top;
+	for (GLuint level = top; level > 0; --level) Cascade(level);
+	
+	// Detached first, a fired handler can reschedule its own timer or cancel another one of the same slot
+	Timer &slot = slots[0][now & (TIMER_SLOTS - 1)];
+	if (slot.next == &slot) return;
+	Timer due;
+	due.prev = slot.prev;
+	due.next = slot.next;
+	slot.prev->next = &due;
+	slot.next->prev = &due;
+	slot.prev = slot.next = &slot;
+	
+	while (due.next != &due)
+	{
+		Timer *timer = due.next;
+		timer->Unlink();
+		++fired;
+		fire(*timer);
+	}
+	due.prev = due.next = NULL;
+}
+
+Enemy::Enemy(World &world, glm::vec3 _position) : position(_position), prevInBlock(NULL), nextInBlock(NULL)
+{
+	animation = 0;
+	frame = 0;
+	id = 0;
+	tier = LOD_NEAR;
+	decision.owner = speak.owner = animate.owner = this;
+	SetDirection(world);
+	world.wheel.Schedule(speak, world.random.GetNumber<GLushort>(Config::CURRENT.enemySpeakMinTicks, Config::CURRENT.enemySpeakMaxTicks));
+	world.wheel.Schedule(animate, Config::CURRENT.enemyAnimationTicks);
+}
+
+void Enemy::SetDirection(World &world)
+{
+	// Follow the flow field toward the player, walking from cell center to cell center
+	Map *map = world.map;
+	GLint cell = map->GetCell(position);
+	GLint next = cell < 0 ? -1 : map->nav->GetNext(cell);
+	if (next >= 0)
+	{
+		glm::vec3 delta = map->GetCenter(next) - position;
+		delta.y = 0;
+		float length = glm::length(delta);
+		if (length > ENEMY_SPEED)
+		{
+			direction = delta * (ENEMY_SPEED / length);
+			world.wheel.Schedule(decision, (GLuint)glm::min<float>(length / ENEMY_SPEED, Config::CURRENT.enemyDecisionTicks));
+			return;
+		}
+	}
+	
+	// Out of chase distance or already in the player cell, wander
+	direction.x = world.random.GetNumber<float>(-ENEMY_SPEED, ENEMY_SPEED);
+	direction.z = world.random.GetNumber<float>(-ENEMY_SPEED, ENEMY_SPEED);
+	world.wheel.Schedule(decision, world.random.GetNumber<GLuint>(1, Config::CURRENT.enemyDecisionTicks));
+}
+
+void Enemy::PlayFallAnimation(World &world)
+{
+	// A falling enemy neither decides nor speaks anymore
+	frame = 0;
+	animation = 1;
+	decision.Unlink();
+	speak.Unlink();
+	world.wheel.Schedule(animate, ENEMY_ANIMATION_FALL_FRAMES);
+}
+
+void Enemy::Fire(World &world, const Timer &timer)
+{
+	if (&timer == &decision)
+	{
+		if (tier == LOD_FAR) Plan(world);
+		else SetDirection(world);
+	}
+	else if (&timer == &speak)
+	{
+		// Voices are handed out by the audio side, the simulation only reports who speaks
+		world.speeches.push_back(this);
+		world.wheel.Schedule(speak, world.random.GetNumber<GLushort>(Config::CURRENT.enemySpeakMinTicks, Config::CURRENT.enemySpeakMaxTicks));
+	}
+	else if (animation == 1)
+	{
+		// The last fall frame leaves a corpse without any event
+		if (frame++ == ENEMY_ANIMATION_FALL_FRAMES)
+		{
+			animation = 2;
+			frame = 0;
+		}
+		else world.wheel.Schedule(animate, Config::CURRENT.enemyAnimationTicks);
+	}
+	else
+	{
+		frame = (frame + 1) % ENEMY_ANIMATION_WALK_FRAMES;
+		world.wheel.Schedule(animate, Config::CURRENT.enemyAnimationTicks);
+	}
+}
+
+void Enemy::SetTier(World &world, GLubyte _tier)
+{
+	// Far enemies are neither seen nor heard, speech and walk frames stop until they come back
+	GLubyte previous = tier;
+	tier = _tier;
+	if (animation) return;
+	
+	if (tier == LOD_FAR)
+	{
+		speak.Unlink();
+		animate.Unlink();
+	}
+	else if (previous == LOD_FAR)
+	{
+		world.wheel.Schedule(speak, world.random.GetNumber<GLushort>(Config::CURRENT.enemySpeakMinTicks, Config::CURRENT.enemySpeakMaxTicks));
+		world.wheel.Schedule(animate, Config::CURRENT.enemyAnimationTicks);
+		SetDirection(world);
+	}
+}
+
+void Enemy::Plan(World &world)
+{
+	// Far enemies head for the nearest player, the requests of a tick are routed together on the corridor graph
+	GLint cell = world.map->GetCell(position);
+	GLint target = cell < 0 ? -1 : world.GetTarget(cell);
+	if (target >= 0)
+	{
+		CorridorGraph::Request request = { (GLuint)cell, (GLuint)target, -1, CORRIDOR_UNREACHED };
+		world.routes.push_back(request);
+		world.routed.push_back(this);
+	}
+	else Hop(world, -1);
+	world.wheel.Schedule(decision, (GLuint)(1 / ENEMY_SPEED));
+}
+
+void Enemy::Hop(World &world, GLint next)
+{
+	// Coarse move from cell center to cell center at the walking speed without collision, a random open side without a route
+	Map *map = world.map;
+	GLint cell = map->GetCell(position);
+	Block *block = cell < 0 ? NULL : map->blocks[cell];
+	if (!block || !block->mask) return;
+	
+	if (next < 0)
+	{
+		GLuint open[4], count = 0;
+		for (GLuint i = 0; i < 4; ++i) if (block->mask & (1 << i)) open[count++] = i;
+		const Point &d = NavField::DIRECTIONS[open[world.random.Next() % count]];
+		next = cell + d.y * map->size.x + d.x;
+	}
+	
+	glm::vec3 center = map->GetCenter(next);
+	direction = (center - map->GetCenter(cell)) * ENEMY_SPEED;
+	map->Relocate(this, center);
+}
+
+inline void Enemy::Update(World &world, GLint cell, GLuint steps)
+{
+	// Only motion is integrated every tick, decisions, speech and animation frames are fired by the wheel
+	if (animation == 0) world.moves.Add(this, cell, direction * (float)steps);
+}
+
+EnemyList::EnemyList() : first(NULL), last(NULL), size(0) {}
+
+inline void EnemyList::Add(Enemy *enemy)
+{
+	// Linked through the enemies themselves, crossing a cell never allocates
+	enemy->prevInBlock = last;
+	enemy->nextInBlock = NULL;
+	if (last) last->nextInBlock = enemy;
+	else first = enemy;
+	last = enemy;
+	++size;
+}
+
+inline void EnemyList::Remove(Enemy *enemy)
+{
+	// Same order as before for the others, an enemy that is not in the list is ignored
+	if (enemy->prevInBlock) enemy->prevInBlock->nextInBlock = enemy->nextInBlock;
+	else if (first == enemy) first = enemy->nextInBlock;
+	else return;
+	if (enemy->nextInBlock) enemy->nextInBlock->prevInBlock = enemy->prevInBlock;
+	else last = enemy->prevInBlock;
+	enemy->prevInBlock = enemy->nextInBlock = NULL;
+	--size;
+}
+
+const Point NavField::DIRECTIONS[4] = { { -1, 0 }, { 0, -1 }, { 1, 0 }, { 0, 1 } };
+
+NavField::NavField(const Point &_size, GLuint _range) : size(_size), range(_range), visited(0)
+{
+	GLuint cells = size.x * size.y;
+	distance = new GLushort[cells];
+	next = new GLbyte[cells];
+	queue = new GLuint[cells];
+	memset(distance, 0xFF, cells * sizeof(GLushort));
+	memset(next, -1, cells);
+}
+
+NavField::~NavField()
+{
+	delete[] queue;
+	delete[] next;
+	delete[] distance;
+}
+
+inline GLint NavField::GetNext(GLuint cell)
+{
+	GLbyte d = next[cell];
+	return d < 0 ? -1 : (GLint)cell + DIRECTIONS[d].y * size.x + DIRECTIONS[d].x;
+}
+
+void NavField::Build(Block **blocks, const GLuint *cells, GLuint count)
+{
+	// Only the cells reached by the previous build need to be cleared
+	for (GLuint i = 0; i < visited; ++i)
+	{
+		distance[queue[i]] = NAV_UNREACHED;
+		next[queue[i]] = -1;
+	}
+	sources.assign(cells, cells + count);
+	
+	GLuint head = 0, tail = 0;
+	for (GLuint i = 0; i < count; ++i)
+	{
+		if (!blocks[cells[i]] || distance[cells[i]] != NAV_UNREACHED) continue;
+		distance[cells[i]] = 0;
+		queue[tail++] = cells[i];
+	}
+	
+	// Multi-source BFS bounded to the range, each reached cell points back to its parent
+	while (head < tail)
+	{
+		GLuint c = queue[head++];
+		GLushort d = distance[c];
+		if (d >= range) continue;
+		
+		int x = c % size.x;
+		int y = c / size.x;
+		for (GLbyte i = 0; i < 4; ++i)
+		{
+			int nx = x + DIRECTIONS[i].x;
+			int ny = y + DIRECTIONS[i].y;
+			if (nx < 0 || nx >= size.x || ny < 0 || ny >= size.y) continue;
+			
+			GLuint n = ny * size.x + nx;
+			if (!blocks[n] || distance[n] != NAV_UNREACHED) continue;
+			
+			distance[n] = d + 1;
+			next[n] = (i + 2) & 3;
+			queue[tail++] = n;
+		}
+	}
+	visited = tail;
+}
+
+CorridorGraph::CorridorGraph(Block **blocks, const Point &_size) : size(_size), clock(0), hits(0), misses(0), expanded(0)
+{
+	// Dead ends and junctions are the nodes, the chains of cells with two neighbors between them are the edges
+	GLuint count = size.x * size.y;
+	place.assign(count, CORRIDOR_UNREACHED);
+	for (GLuint i = 0; i < count; ++i)
+	{
+		if (!blocks[i]) continue;
+		GLubyte m = blocks[i]->mask;
+		if ((m & 1) + (m >> 1 & 1) + (m >> 2 & 1) + (m >> 3 & 1) != 2) AddNode(i);
+	}
+	for (GLuint n = 0; n < nodes.size(); ++n) Trace(blocks, n);
+	
+	// A loop without any junction gets one of its cells as node
+	for (GLuint i = 0; i < count; ++i)
+		if (blocks[i] && place[i] == CORRIDOR_UNREACHED) Trace(blocks, AddNode(i));
+	
+	// Links of all nodes in one array, each edge is linked from both ends and a loop twice from its node
+	offsets.assign(nodes.size() + 1, 0);
+	for (std::vector<Edge>::iterator it = edges.begin(); it != edges.end(); ++it)
+	{
+		++offsets[it->from + 1];
+		++offsets[it->to + 1];
+	}
+	for (GLuint n = 0; n < nodes.size(); ++n) offsets[n + 1] += offsets[n];
+	
+	std::vector<GLuint> fill(offsets.begin(), offsets.end() - 1);
+	links.resize(offsets.back());
+	for (GLuint e = 0; e < edges.size(); ++e)
+	{
+		GLuint a = fill[edges[e].from]++;
+		GLuint b = fill[edges[e].to]++;
+		Link forward = { e, edges[e].to, b, true };
+		Link backward = { e, edges[e].from, a, false };
+		links[a] = forward;
+		links[b] = backward;
+	}
+	searches.reserve(CORRIDOR_CACHE_GOALS);
+}
+
+void CorridorGraph::Reserve()
+{
+	Memory::Scope scope(Memory::MAP);
+	// Searches made up front while they fit in CORRIDOR_RESERVE_BYTES, routing then never allocates; past that the cache grows on demand
+	size_t bytes = nodes.size() * (2 * sizeof(GLuint) + 1) + (links.size() + 2) * sizeof(std::pair<GLuint, GLuint>);
+	while (searches.size() < CORRIDOR_CACHE_GOALS && (searches.size() + 1) * bytes <= CORRIDOR_RESERVE_BYTES)
+	{
+		searches.push_back(Search());
+		Prepare(searches.back());
+	}
+}
+
+GLuint CorridorGraph::AddNode(GLuint cell)
+{
+	place[cell] = nodes.size();
+	nodes.push_back(cell);
+	return place[cell];
+}
+
+void CorridorGraph::Trace(Block **blocks, GLuint node)
+{
+	GLuint start = nodes[node];
+	GLubyte mask = blocks[start]->mask;
+	for (GLuint d = 0; d < 4; ++d)
+	{
+		if (!(mask & (1 << d))) continue;
+		GLuint c = start + NavField::DIRECTIONS[d].y * size.x + NavField::DIRECTIONS[d].x;
+		
+		// Two adjacent nodes are linked from the first one, a corridor already followed from its other end is skipped
+		GLuint p = place[c];
+		if (p != CORRIDOR_UNREACHED && (p & CORRIDOR_INTERIOR || p < node)) continue;
+		
+		Edge edge = { node, 0, (GLuint)cells.size(), 0 };
+		GLuint from = (d + 2) & 3;
+		while (place[c] == CORRIDOR_UNREACHED)
+		{
+			place[c] = CORRIDOR_INTERIOR | cells.size();
+			cells.push_back(c);
+			owners.push_back(edges.size());
+			
+			GLubyte m = blocks[c]->mask;
+			GLuint next = 0;
+			while (next == from || !(m & (1 << next))) ++next;
+			from = (next + 2) & 3;
+			c += NavField::DIRECTIONS[next].y * size.x + NavField::DIRECTIONS[next].x;
+		}
+		edge.to = place[c];
+		edge.length = cells.size() - edge.first;
+		edges.push_back(edge);
+	}
+}
+
+inline GLuint CorridorGraph::GetHeuristic(GLuint node, GLuint cell) const
+{
+	// Manhattan distance, never more than the path length on the grid
+	int a = nodes[node];
+	return abs(a % size.x - (int)cell % size.x) + abs(a / size.x - (int)cell / size.x);
+}
+
+inline GLint CorridorGraph::GetStep(const Link &link) const
+{
+	// First cell entered when leaving a node by a link
+	const Edge &edge = edges[link.edge];
+	if (!edge.length) return nodes[link.node];
+	return cells[link.forward ? edge.first : edge.first + edge.length - 1];
+}
+
+inline void CorridorGraph::Push(Search &search, GLuint node)
+{
+	// Open nodes are ordered by estimated length to the origin of the search
+	search.open.push_back(std::make_pair(search.cost[node] + GetHeuristic(node, search.origin), node));
+	std::push_heap(search.open.begin(), search.open.end(), std::greater<std::pair<GLuint, GLuint> >());
+}
+
+void CorridorGraph::Route(Request *requests, GLuint count)
+{
+	// Requests are grouped by goal, the requests of a group share one search
+	Memory::Scope scope(Memory::MAP);
+	order.resize(count);
+	for (GLuint i = 0; i < count; ++i) order[i] = i;
+	std::sort(order.begin(), order.end(), [requests](GLuint a, GLuint b) { return requests[a].goal < requests[b].goal || (requests[a].goal == requests[b].goal && a < b); });
+	
+	for (GLuint i = 0; i < count; )
+	{
+		Search &search = GetSearch(requests[order[i]].goal, requests[order[i]].from);
+		for (; i < count && requests[order[i]].goal == search.goal; ++i) Resolve(search, requests[order[i]]);
+	}
+}
+
+void CorridorGraph::Reset()
+{
+	// Searches are forgotten but keep their memory
+	for (std::vector<Search>::iterator it = searches.begin(); it != searches.end(); ++it)
+	{
+		it->goal = CORRIDOR_UNREACHED;
+		it->used = 0;
+	}
+	clock = 0;
+	hits = misses = expanded = 0;
+}
+
+CorridorGraph::Search &CorridorGraph::GetSearch(GLuint goal, GLuint origin)
+{
+	// Searches run backward from their goal and are kept, a later request for the same goal resumes one
+	Search *oldest = NULL;
+	for (std::vector<Search>::iterator it = searches.begin(); it != searches.end(); ++it)
+	{
+		if (it->goal == goal)
+		{
+			it->used = ++clock;
+			++hits;
+			return *it;
+		}
+		if (!oldest || it->used < oldest->used) oldest = &*it;
+	}
+	
+	// Past the cache size the least recently used one is recycled, its vectors keep their capacity
+	++misses;
+	if (searches.size() < CORRIDOR_CACHE_GOALS && (!oldest || oldest->used))
+	{
+		searches.push_back(Search());
+		oldest = &searches.back();
+		Prepare(*oldest);
+	}
+	oldest->goal = goal;
+	oldest->origin = origin;
+	oldest->used = ++clock;
+	Seed(*oldest);
+	return *oldest;
+}
+
+void CorridorGraph::Prepare(Search &search)
+{
+	// Every node pushes at most once per link, so the open list never outgrows the links and the two seeds
+	search.goal = CORRIDOR_UNREACHED;
+	search.used = 0;
+	search.cost.assign(nodes.size(), CORRIDOR_UNREACHED);
+	search.via.assign(nodes.size(), CORRIDOR_UNREACHED);
+	search.closed.assign(nodes.size(), false);
+	search.open.reserve(links.size() + 2);
+}
+
+void CorridorGraph::Seed(Search &search)
+{
+	search.cost.assign(nodes.size(), CORRIDOR_UNREACHED);
+	search.via.assign(nodes.size(), CORRIDOR_UNREACHED);
+	search.closed.assign(nodes.size(), false);
+	search.open.clear();
+	
+	GLuint p = place[search.goal];
+	if (p == CORRIDOR_UNREACHED) return;
+	if (!(p & CORRIDOR_INTERIOR))
+	{
+		search.cost[p] = 0;
+		Push(search, p);
+		return;
+	}
+	
+	// A goal inside a corridor is reached from both of its ends
+	GLuint i = p & ~CORRIDOR_INTERIOR;
+	const Edge &edge = edges[owners[i]];
+	GLuint k = i - edge.first;
+	const GLuint ends[2] = { edge.from, edge.to };
+	for (GLuint side = 0; side < 2; ++side)
+	{
+		GLuint node = ends[side];
+		GLuint cost = side ? edge.length - k : k + 1;
+		for (GLuint l = offsets[node]; l < offsets[node + 1]; ++l)
+		{
+			if (links[l].edge != owners[i] || links[l].forward == (side != 0) || cost >= search.cost[node]) continue;
+			search.cost[node] = cost;
+			search.via[node] = l;
+		}
+		Push(search, node);
+	}
+}
+
+bool CorridorGraph::Resume(Search &search, GLuint node)
+{
+	// Reverse resumable A*, a closed node keeps its exact distance to the goal so every later request reuses it
+	std::greater<std::pair<GLuint, GLuint> > later;
+	while (!search.closed[node] && !search.open.empty())
+	{
+		std::pop_heap(search.open.begin(), search.open.end(), later);
+		GLuint n = search.open.back().second;
+		search.open.pop_back();
+		if (search.closed[n]) continue;
+		search.closed[n] = true;
+		++expanded;
+		
+		for (GLuint l = offsets[n]; l < offsets[n + 1]; ++l)
+		{
+			const Link &link = links[l];
+			GLuint cost = search.cost[n] + edges[link.edge].length + 1;
+			if (search.closed[link.node] || cost >= search.cost[link.node]) continue;
+			search.cost[link.node] = cost;
+			search.via[link.node] = link.back;
+			Push(search, link.node);
+		}
+	}
+	return search.closed[node];
+}
+
+void CorridorGraph::Resolve(Search &search, Request &request)
+{
+	request.next = -1;
+	request.distance = CORRIDOR_UNREACHED;
+	GLuint p = place[request.from];
+	GLuint g = place[request.goal];
+	if (p == CORRIDOR_UNREACHED || g == CORRIDOR_UNREACHED) return;
+	if (request.from == request.goal)
+	{
+		request.distance = 0;
+		return;
+	}
+	
+	if (!(p & CORRIDOR_INTERIOR))
+	{
+		if (!Resume(search, p)) return;
+		request.distance = search.cost[p];
+		request.next = GetStep(links[search.via[p]]);
+		return;
+	}
+	
+	// Inside a corridor, toward the end closer to the goal or straight to a goal in the same corridor
+	GLuint i = p & ~CORRIDOR_INTERIOR;
+	const Edge &edge = edges[owners[i]];
+	GLuint k = i - edge.first;
+	if (Resume(search, edge.from) && search.cost[edge.from] + k + 1 < request.distance)
+	{
+		request.distance = search.cost[edge.from] + k + 1;
+		request.next = k ? cells[i - 1] : nodes[edge.from];
+	}
+	if (Resume(search, edge.to) && search.cost[edge.to] + edge.length - k < request.distance)
+	{
+		request.distance = search.cost[edge.to] + edge.length - k;
+		request.next = k + 1 < edge.length ? cells[i + 1] : nodes[edge.to];
+	}
+	if (g & CORRIDOR_INTERIOR && owners[g & ~CORRIDOR_INTERIOR] == owners[i])
+	{
+		GLuint j = g & ~CORRIDOR_INTERIOR;
+		if ((j > i ? j - i : i - j) >= request.distance) return;
+		request.distance = j > i ? j - i : i - j;
+		request.next = cells[j > i ? i + 1 : i - 1];
+	}
+}
+
+constexpr Map::Tile Map::TILES[16];
+const glm::mat4 Map::ROTATIONS[4] =
+{
+	Mat4::IDENTITY,
+	glm::rotate<float>(Mat4::IDENTITY, M_PI / -2, glm::vec3(0, 1, 0)),
+	glm::rotate<float>(Mat4::IDENTITY, -M_PI, glm::vec3(0, 1, 0)),
+	glm::rotate<float>(Mat4::IDENTITY, M_PI / 2, glm::vec3(0, 1, 0))
+};
+
+Block::Block(GLubyte _mask, Model *_model, glm::mat4 _transform) : mask(_mask), model(_model), transform(_transform) {}
+Block::~Block() {}
+
+void Block::Gather(Scene &scene)
+{
+	Scene::Item item = { model, transform };
+	scene.blocks.push_back(item);
+	
+	// Billboarding is done in world.vs, only the position and animation state are streamed
+	for (Enemy *it = enemies.first; it; it = it->nextInBlock)
+	{
+		Enemy::Instance instance;
+		instance.position = it->position;
+		instance.animation = it->animation;
+		instance.frame = it->frame;
+		scene.instances.push_back(instance);
+	}
+}
+
+Map::Map(Block **blocks, const Point &size, const Point &origin)
+{
+	this->blocks = blocks;
+	this->size = size;
+	this->origin = origin;
+	nav = new NavField(size, ENEMY_CHASE_DISTANCE);
+	graph = new CorridorGraph(blocks, size);
+}
+
+Map::~Map()
+{
+	delete graph;
+	delete nav;
+	Array::Delete(blocks, size.x * size.y);
+}
+
+inline float Map::GetX(float x) { return x - origin.x + 0.5f; }
+inline float Map::GetY(float y) { return y - origin.y + 0.5f; }
+inline GLint Map::GetCell(const glm::vec3 &position)
+{
+	float x = GetX(position.x);
+	float y = GetY(position.z);
+	return x < 0 || x >= size.x || y < 0 || y >= size.y ? -1 : (int)y * size.x + (int)x;
+}
+
+inline Block *Map::GetBlock(const glm::vec3 &position)
+{
+	GLint cell = GetCell(position);
+	return cell < 0 ? NULL : blocks[cell];
+}
+
+inline glm::vec3 Map::GetCenter(GLuint cell)
+{
+	// Signed, the origin is negative for cells left or above the walk start
+	return glm::vec3((int)(cell % size.x) + origin.x, 0, (int)(cell / size.x) + origin.y);
+}
+
+void Map::Navigate(const GLuint *cells, GLuint count)
+{
+	// The flow field only changes when a target enters another cell
+	if (count == nav->sources.size() && std::equal(cells, cells + count, nav->sources.begin())) return;
+	nav->Build(blocks, cells, count);
+}
+
+inline bool Map::IsBlocked(int x, int y)
+{
+	return x < 0 || x >= size.x || y < 0 || y >= size.y || blocks[y * size.x + x] == NULL;
+}
+
+inline int Map::GetLine(float value, bool vertical)
+{
+	// Column or row of a world coordinate, every test of the sweep goes through it so a position is always read back the same way
+	return (int)floor(vertical ? GetY(value) : GetX(value));
+}
+
+inline float Map::Sweep(float position, float side, float delta, bool vertical)
+{
+	// World coordinates, the hitbox covers [position +- HITBOX_SIZE] on the moving axis and [side +- HITBOX_SIZE] on the other one
+	int s0 = GetLine(side - HITBOX_SIZE, !vertical);
+	int s1 = GetLine(side + HITBOX_SIZE, !vertical);
+	float target = position + delta;
+	float offset = (vertical ? origin.y : origin.x) - 0.5f;
+	
+	// Every line from the cell holding the leading edge to the one holding it at the target is tested, so any speed is handled
+	// without tunneling, and a hitbox already overlapping a wall is put back in front of it
+	if (delta > 0)
+	{
+		for (int first = GetLine(position + HITBOX_SIZE, vertical), c = first, e = GetLine(target + HITBOX_SIZE, vertical); c <= e; ++c)
+			for (int s = s0; s <= s1; ++s)
+			{
+				if (!(vertical ? IsBlocked(s, c) : IsBlocked(c, s))) continue;
+				float stop = c + offset - HITBOX_SIZE - HITBOX_EPSILON;
+				while (GetLine(stop + HITBOX_SIZE, vertical) >= c) stop = nextafterf(stop, -INFINITY);
+				return c == first ? stop : glm::max(position, stop);
+			}
+	}
+	else if (delta < 0)
+	{
+		for (int first = GetLine(position - HITBOX_SIZE, vertical), c = first, e = GetLine(target - HITBOX_SIZE, vertical); c >= e; --c)
+			for (int s = s0; s <= s1; ++s)
+			{
+				if (!(vertical ? IsBlocked(s, c) : IsBlocked(c, s))) continue;
+				float stop = c + 1 + offset + HITBOX_SIZE + HITBOX_EPSILON;
+				while (GetLine(stop - HITBOX_SIZE, vertical) <= c) stop = nextafterf(stop, INFINITY);
+				return c == first ? stop : glm::min(position, stop);
+			}
+	}
+	return target;
+}
+
+void Map::Move(glm::vec3 &position, const glm::vec3 &direction)
+{
+	// One sweep per axis, a blocked axis stops at the wall and the other one keeps sliding along it
+	position.x = Sweep(position.x, position.z, direction.x, false);
+	position.z = Sweep(position.z, position.x, direction.z, true);
+}
+
+bool Map::Overlaps(const glm::vec3 &position)
+{
+	for (int z = GetLine(position.z - HITBOX_SIZE, true), ez = GetLine(position.z + HITBOX_SIZE, true); z <= ez; ++z)
+		for (int x = GetLine(position.x - HITBOX_SIZE, false), ex = GetLine(position.x + HITBOX_SIZE, false); x <= ex; ++x)
+			if (IsBlocked(x, z)) return true;
+	return false;
+}
+
+int Map::TestSweep()
+{
+	// Walls at 1, 1, at 3, 1 and at 2, 3, the cell x, y is centered on the world position x, 0, y and the map ends at -0.5 and 4.5
+	const char *layout[] = { ".....", ".#.#.", ".....", "..#..", "....." };
+	std::vector<Point> points;
+	for (short y = 0; y < 5; ++y)
+		for (short x = 0; x < 5; ++x) if (layout[y][x] == '.') points.push_back({ x, y });
+	Map *map = Build(points);
+	
+	const float near = 0.5f - HITBOX_SIZE - HITBOX_EPSILON;
+	struct Case
+	{
+		const char *name;
+		glm::vec3 start, direction;
+		GLuint ticks;
+		glm::vec3 expected;
+	};
+	const Case cases[] =
+	{
+		{ "corner, passes the open side then stops", glm::vec3(0.25f, 0, 0.25f), glm::vec3(0.2f, 0, 0.2f), 1, glm::vec3(0.45f, 0, near) },
+		{ "corner, large step", glm::vec3(0.25f, 0, 0.25f), glm::vec3(0.5f, 0, 0.5f), 1, glm::vec3(0.75f, 0, near) },
+		{ "slide along the top border", glm::vec3(0, 0, 0), glm::vec3(0.1f, 0, -0.05f), 30, glm::vec3(3, 0, -near) },
+		{ "slide along the left border", glm::vec3(0, 0, 2), glm::vec3(-0.05f, 0, 0.1f), 20, glm::vec3(-near, 0, 4) },
+		{ "start on a line between open cells", glm::vec3(0.5f, 0, 0), glm::vec3(0, 0, 0.2f), 3, glm::vec3(0.5f, 0, near) },
+		{ "start touching a wall, slides down", glm::vec3(0.5f - HITBOX_SIZE, 0, 1), glm::vec3(0.01f, 0, 0.1f), 5, glm::vec3(near, 0, 1.5f) },
+		{ "start on a line, fast back", glm::vec3(0.5f, 0, 0), glm::vec3(-7, 0, 0), 1, glm::vec3(-near, 0, 0) },
+		{ "high speed across the map", glm::vec3(0, 0, 0), glm::vec3(50, 0, 0), 1, glm::vec3(4 + near, 0, 0) },
+		{ "high speed into a wall", glm::vec3(0, 0, 1), glm::vec3(10, 0, 0), 1, glm::vec3(near, 0, 1) },
+		{ "high speed up into a wall", glm::vec3(2, 0, 4), glm::vec3(0, 0, -10), 1, glm::vec3(2, 0, 3 + 1 - near) },
+		{ "high speed diagonal to the corner", glm::vec3(4, 0, 4), glm::vec3(-30, 0, -30), 1, glm::vec3(-near, 0, -near) },
+	};
+	
+	GLuint failed = 0, count = sizeof(cases) / sizeof(Case);
+	for (GLuint i = 0; i < count; ++i)
+	{
+		const Case &c = cases[i];
+		glm::vec3 position = c.start;
+		bool inside = false;
+		for (GLuint t = 0; t < c.ticks; ++t)
+		{
+			map->Move(position, c.direction);
+			inside |= map->Overlaps(position);
+		}
+		bool ok = !inside && glm::abs(position.x - c.expected.x) < 1e-4f && glm::abs(position.z - c.expected.z) < 1e-4f;
+		std::cout << "  " << (ok ? "ok" : "FAILED") << ": " << c.name << ", ended at " << position.x << ", " << position.z << (inside ? " inside a wall" : "") << std::endl;
+		failed += !ok;
+	}
+	Pointer::Delete(map);
+	
+	// Random moves at several speeds on a generated map, no hitbox may ever overlap a wall
+	Random random(1);
+	map = Generate(4096, random);
+	std::vector<glm::vec3> positions;
+	for (GLuint i = 0, cells = map->size.x * map->size.y; i < cells; ++i)
+		if (map->blocks[i]) positions.push_back(glm::vec3((int)(i % map->size.x) + map->origin.x, 0, (int)(i / map->size.x) + map->origin.y));
+	
+	const float speeds[] = { ENEMY_SPEED, PLAYER_SPEED, 0.5f, 4.0f };
+	for (GLuint s = 0; s < sizeof(speeds) / sizeof(float); ++s)
+	{
+		GLuint inside = 0;
+		for (GLuint i = 0; i < positions.size(); ++i)
+		{
+			glm::vec3 position = positions[i], direction;
+			for (GLuint t = 0; t < TEST_SWEEP_TICKS; ++t)
+			{
+				if (t % 30 == 0)
+				{
+					float angle = random.GetNumber<float>(0, 2 * M_PI);
+					direction = glm::vec3(glm::cos(angle) * speeds[s], 0, glm::sin(angle) * speeds[s]);
+				}
+				map->Move(position, direction);
+				if (map->Overlaps(position))
+				{
+					++inside;
+					break;
+				}
+			}
+			positions[i] = position;
+		}
+		std::cout << "  " << (inside ? "FAILED" : "ok") << ": speed " << speeds[s] << ", " << positions.size() << " entities x " << TEST_SWEEP_TICKS << " ticks, " << inside << " inside a wall" << std::endl;
+		failed += inside != 0;
+		count++;
+	}
+	Pointer::Delete(map);
+	
+	std::cout << "sweep: " << count - failed << " of " << count << " passed" << std::endl;
+	return failed ? 1 : 0;
+}
+
+void Map::Moves::Reserve(GLuint count)
+{
+	enemies.reserve(count);
+	cells.reserve(count);
+	x.reserve(count);
+	z.reserve(count);
+	dx.reserve(count);
+	dz.reserve(count);
+}
+
+inline void Map::Moves::Add(Enemy *enemy, GLint cell, const glm::vec3 &delta)
+{
+	enemies.push_back(enemy);
+	cells.push_back(cell);
+	x.push_back(enemy->position.x);
+	z.push_back(enemy->position.z);
+	dx.push_back(delta.x);
+	dz.push_back(delta.z);
+}
+
+void Map::Move(Moves &moves)
+{
+	// Every x then every z, each enemy still slides along x first like a single move
+	GLuint count = moves.enemies.size();
+	float *x = moves.x.data(), *z = moves.z.data();
+	for (GLuint i = 0; i < count; ++i) x[i] = Sweep(x[i], z[i], moves.dx[i], false);
+	for (GLuint i = 0; i < count; ++i) z[i] = Sweep(z[i], x[i], moves.dz[i], true);
+	
+	// Written back in order, only the enemies that left their cell change block list
+	for (GLuint i = 0; i < count; ++i)
+	{
+		Enemy *enemy = moves.enemies[i];
+		enemy->position.x = x[i];
+		enemy->position.z = z[i];
+		GLint from = moves.cells[i], to = GetCell(enemy->position);
+		if (from == to) continue;
+		if (from >= 0 && blocks[from]) blocks[from]->enemies.Remove(enemy);
+		if (to >= 0 && blocks[to]) blocks[to]->enemies.Add(enemy);
+	}
+	
+	moves.enemies.clear();
+	moves.cells.clear();
+	moves.x.clear();
+	moves.z.clear();
+	moves.dx.clear();
+	moves.dz.clear();
+}
+
+void Map::Relocate(Enemy *enemy, const glm::vec3 &position)
+{
+	Block *from = GetBlock(enemy->position);
+	enemy->position = position;
+	Block *to = GetBlock(position);
+	if (from == to) return;
+	if (from) from->enemies.Remove(enemy);
+	if (to) to->enemies.Add(enemy);
+}
+
+void Map::GetMasks(GLubyte *masks)
+{
+	// One byte per cell, the neighbors mask with the high bit set or 0 for a wall
+	for (GLuint i = 0, cells = size.x * size.y; i < cells; ++i) masks[i] = blocks[i] ? blocks[i]->mask | 0x80 : 0;
+}
+
+void Map::Gather(Scene &scene, const Player *viewer)
+{
+	scene.view = Config::CURRENT.topView ?
+		glm::lookAt(viewer->position, glm::vec3(viewer->position.x + viewer->look.x, 2, viewer->position.z + viewer->look.z), glm::vec3(0, 1, 0)) :
+		glm::lookAt(viewer->position, viewer->position + viewer->look, glm::vec3(0, 1, 0));
+	
+	// The default distance keeps fixed loop bounds, other values take the generic loop
+	int distance = Config::CURRENT.visibleDistance;
+	if (distance == PLAYER_VISIBLE_DISTANCE) GatherCells<PLAYER_VISIBLE_DISTANCE>(scene, viewer, distance);
+	else GatherCells<0>(scene, viewer, distance);
+}
+
+template<int DISTANCE>
+inline void Map::GatherCells(Scene &scene, const Player *viewer, int distance)
+{
+	if (DISTANCE) distance = DISTANCE;
+	
+	for (int z = viewer->position.z - origin.y + 0.5f - distance, ez = z + (distance << 1); z <= ez; ++z)
+	{
+		if (z < 0 || z >= size.y) continue;
+		
+		for (int x = viewer->position.x - origin.x + 0.5f - distance, ex = x + (distance << 1); x <= ex; ++x)
+		{
+			if (x < 0 || x >= size.x) continue;
+			
+			Block *b = blocks[z * size.x + x];
+			if (b != NULL) b->Gather(scene);
+		}
+	}
+}
+
+void Map::Walk(GLuint size, Random &random, std::vector<Point> &points)
+{
+	const Point dirs[] = { { -1, 0 }, { 0, -1 }, { 1, 0 }, { 0, 1 } };
+	
+	Point p = { 0 };
+	points.push_back({0});
+	
+	while (points.size() < size)
+	{
+		Point d = dirs[random.GetNumber<GLuint>(0, 4) & 3];
+		Point n = { p.x + d.x, p.y + d.y };
+		if (std::find(points.begin(), points.end(), n) == points.end()) points.push_back(n);
+		*((int *)&p) = *((int *)&n);
+	}
+}
+
+GLuint Map::Occupy(const std::vector<Point> &points, Point &size, Point &origin, std::vector<unsigned long long> &bits)
+{
+	short l = SHRT_MAX, r = SHRT_MIN, t = SHRT_MAX, b = SHRT_MIN;
+	for (std::vector<Point>::const_iterator it = points.begin(); it != points.end(); ++it)
+	{
+		l = glm::min(l, it->x);
+		r = glm::max(r, it->x);
+		t = glm::min(t, it->y);
+		b = glm::max(b, it->y);
+	}
+	size.Set(r - l + 1, b - t + 1);
+	origin.Set(l, t);
+	
+	// One bit per cell, with an empty row above and below so the first and last rows need no special case
+	GLuint words = (size.x + 63) >> 6;
+	bits.assign((size.y + 2) * words, 0);
+	for (std::vector<Point>::const_iterator it = points.begin(); it != points.end(); ++it)
+	{
+		GLuint x = it->x - l;
+		bits[(it->y - t + 1) * words + (x >> 6)] |= 1ULL << (x & 63);
+	}
+	return words;
+}
+
+const Map::Spread Map::SPREAD;
+
+Map::Spread::Spread()
+{
+	for (GLuint i = 0; i < 256; ++i)
+	{
+		values[i] = 0;
+		for (GLuint k = 0; k < 8; ++k) values[i] |= (unsigned long long)(i >> k & 1) << (k << 3);
+	}
+}
+
+void Map::ClassifyRow(const unsigned long long *above, const unsigned long long *row, const unsigned long long *below, GLuint width, GLubyte *masks)
+{
+	// Shifting the row by one cell gives the left and right neighbors of 64 cells at once
+	for (GLuint i = 0, words = (width + 63) >> 6; i < words; ++i)
+	{
+		unsigned long long cells = row[i];
+		unsigned long long left = cells << 1 | (i ? row[i - 1] >> 63 : 0);
+		unsigned long long top = above[i];
+		unsigned long long right = cells >> 1 | (i + 1 < words ? row[i + 1] << 63 : 0);
+		unsigned long long bottom = below[i];
+		
+		// Eight cells at a time, each bit of a byte spread to the low bit of its own byte
+		GLubyte *out = masks + (i << 6);
+		for (GLuint x = 0, n = glm::min<GLuint>(64, width - (i << 6)); x < n; x += 8)
+		{
+			unsigned long long walkable = SPREAD.values[cells >> x & 0xFF];
+			unsigned long long m = (SPREAD.values[left >> x & 0xFF] | SPREAD.values[top >> x & 0xFF] << 1 | SPREAD.values[right >> x & 0xFF] << 2 | SPREAD.values[bottom >> x & 0xFF] << 3 | walkable << 7) & walkable * 0xFF;
+			
+			// Little endian, the first cell is the lowest byte
+			memcpy(out + x, &m, glm::min<GLuint>(8, n - x));
+		}
+	}
+}
+
+Block *Map::CreateBlock(GLuint c, const Point &p)
+{
+	const Tile &tile = TILES[c & 0x0F];
+	if (!tile.model) return NULL;
+	
+	// Same matrix as translating then rotating, the rotation part is shared by every block of the same tile
+	glm::mat4 transform = ROTATIONS[tile.rotation];
+	transform[3] = glm::vec4(p.x, 0, p.y, 1);
+	return new Block(c, *tile.model, transform);
+}
+
+Map *Map::Build(const std::vector<Point> &points)
+{
+	Memory::Scope scope(Memory::MAP);
+	Point size, origin;
+	std::vector<unsigned long long> bits;
+	GLuint words = Occupy(points, size, origin, bits);
+	
+	std::vector<GLubyte> masks(size.x * size.y);
+	for (int y = 0; y < size.y; ++y) ClassifyRow(&bits[y * words], &bits[(y + 1) * words], &bits[(y + 2) * words], size.x, &masks[y * size.x]);
+	return Create(masks.data(), size, origin);
+}
+
+Map *Map::Create(const GLubyte *masks, const Point &size, const Point &origin)
+{
+	Memory::Scope scope(Memory::MAP);
+	GLuint cells = size.x * size.y;
+	Block **blocks = new Block*[cells];
+	for (GLuint i = 0; i < cells; ++i)
+		blocks[i] = masks[i] ? CreateBlock(masks[i] & 0x0F, { (short)(i % size.x + origin.x), (short)(i / size.x + origin.y) }) : NULL;
+	return new Map(blocks, size, origin);
+}
+
+Map *Map::Generate(GLuint size, Random &random)
+{
+	Memory::Scope scope(Memory::MAP);
+	std::vector<Point> points;
+	Walk(size, random, points);
+	return Build(points);
+}
+
+World::World(Map *_map, GLuint seed) : map(_map), random(seed), tick(0), aiMilliseconds(0)
+{
+	memset(tiers, 0, sizeof(tiers));
+}
+
+World::~World()
+{
+	for (std::vector<Player *>::iterator it = players.begin(); it != players.end(); ++it) Pointer::Delete(*it);
+	for (std::vector<Enemy *>::iterator it = enemies.begin(); it != enemies.end(); ++it) Pointer::Delete(*it);
+	Pointer::Delete(map);
+}
+
+World *World::Generate(GLuint size, GLuint enemies, GLuint seed, GLuint threads)
+{
+	// The same seed always gives the same map, enemies and decisions, whatever the thread count
+	World *world = new World(NULL, seed);
+	Generator *generator = Generator::Create(Config::CURRENT.mapGenerator, threads);
+	world->map = generator->Generate(size, world->random);
+	delete generator;
+	world->AddEnemies(enemies);
+	return world;
+}
+
+Player *World::AddPlayer(const glm::vec3 &position, float angle)
+{
+	Player *player = new Player(position, angle);
+	players.push_back(player);
+	return player;
+}
+
+void World::RemovePlayer(Player *player)
+{
+	std::vector<Player *>::iterator it = std::find(players.begin(), players.end(), player);
+	if (it == players.end()) return;
+	players.erase(it);
+	delete player;
+}
+
+void World::AddEnemies(GLuint number)
+{
+	Memory::Scope scope(Memory::ENEMIES);
+	Point size = map->size;
+	
+	// Enemies are only placed on walkable cells, a map without any would never place them
+	bool walkable = false;
+	for (GLuint i = 0, cells = size.x * size.y; i < cells && !walkable; ++i) walkable = map->blocks[i] != NULL;
+	if (!walkable) number = 0;
+	
+	while (number)
+	{
+		GLuint i = random.GetNumber<GLuint>(0, size.x * size.y - 1);
+		float x = i % size.x + random.GetNumber<float>(HITBOX_SIZE, 1 - HITBOX_SIZE);
+		float z = i / size.x + random.GetNumber<float>(HITBOX_SIZE, 1 - HITBOX_SIZE);
+		if (map->blocks[i])
+		{
+			Enemy *enemy = new Enemy(*this, glm::vec3(x + map->origin.x - 0.5, 0, z + map->origin.y - 0.5));
+			enemy->id = enemies.size();
+			enemies.push_back(enemy);
+			map->blocks[i]->enemies.Add(enemy);
+			--number;
+		}
+	}
+	Reserve();
+}
+
+void World::Reserve()
+{
+	// Every enemy can decide or speak in the same tick, so stepping never grows these
+	speeches.reserve(enemies.size());
+	routes.reserve(enemies.size());
+	routed.reserve(enemies.size());
+	moves.Reserve(enemies.size());
+	map->graph->Reserve();
+}
+
+GLint World::GetTarget(GLint cell)
+{
+	// Nearest player cell on the grid, -1 without players
+	GLint target = -1;
+	int best = INT_MAX;
+	for (std::vector<GLuint>::iterator it = targets.begin(); it != targets.end(); ++it)
+	{
+		int distance = abs((int)(*it % map->size.x) - cell % map->size.x) + abs((int)(*it / map->size.x) - cell / map->size.x);
+		if (distance >= best) continue;
+		best = distance;
+		target = *it;
+	}
+	return target;
+}
+
+inline GLubyte World::GetTier(GLint cell)
+{
+	// Near is what a player can see, mid is what the flow field reaches, far is everything else
+	if (cell < 0) return LOD_FAR;
+	if (near[cell] == tick) return LOD_NEAR;
+	return map->nav->distance[cell] != NAV_UNREACHED ? LOD_MID : LOD_FAR;
+}
+
+template<int DISTANCE>
+inline void World::MarkNear(int cx, int cy, int distance)
+{
+	// Cells drawn around the player, stamped with the tick so nothing has to be cleared
+	if (DISTANCE) distance = DISTANCE;
+	for (int y = glm::max(cy - distance, 0), ey = glm::min(cy + distance, map->size.y - 1); y <= ey; ++y)
+		for (int x = glm::max(cx - distance, 0), ex = glm::min(cx + distance, map->size.x - 1); x <= ex; ++x) near[y * map->size.x + x] = tick;
+}
+
+void World::Step()
+{
+	// Block lists, routes and speeches grow while stepping
+	Memory::Scope scope(Memory::ENEMIES);
+	++tick;
+	speeches.clear();
+	if (near.empty()) near.resize(map->size.x * map->size.y, 0);
+	
+	// Players apply their last buttons, enemies chase the nearest one
+	targets.clear();
+	for (std::vector<Player *>::iterator it = players.begin(); it != players.end(); ++it)
+	{
+		(*it)->Update(*this);
+		GLint cell = map->GetCell((*it)->position);
+		if (cell < 0) continue;
+		targets.push_back(cell);
+		
+		int distance = Config::CURRENT.visibleDistance;
+		if (distance == PLAYER_VISIBLE_DISTANCE) MarkNear<PLAYER_VISIBLE_DISTANCE>(cell % map->size.x, cell / map->size.x, distance);
+		else MarkNear<0>(cell % map->size.x, cell / map->size.x, distance);
+	}
+	map->Navigate(targets.data(), targets.size());
+	
+	double begin = Clock::Milliseconds();
+	
+	// Discrete events only touch the enemies they are due for
+	wheel.Advance([this](Timer &timer) { timer.owner->Fire(*this, timer); });
+	
+	// Far enemies that decided this tick hop along their routes, one search per goal serves all of them
+	if (!routes.empty())
+	{
+		map->graph->Route(routes.data(), routes.size());
+		for (GLuint i = 0; i < routes.size(); ++i) routed[i]->Hop(*this, routes[i].next);
+		routes.clear();
+		routed.clear();
+	}
+	
+	// Near enemies move every tick, mid ones every few ticks with a larger step spread over the ticks by id,
+	// far ones only hop from cell to cell on their decision events, the moves are swept together once all are queued
+	for (std::vector<Enemy *>::iterator it = enemies.begin(); it != enemies.end(); ++it)
+	{
+		Enemy *enemy = *it;
+		GLint cell = map->GetCell(enemy->position);
+		GLubyte tier = GetTier(cell);
+		if (tier != enemy->tier) enemy->SetTier(*this, tier);
+		++tiers[tier];
+		
+		if (tier == LOD_FAR) continue;
+		if (tier == LOD_MID && (tick + enemy->id) % LOD_MID_INTERVAL) continue;
+		
+		enemy->Update(*this, cell, tier == LOD_MID ? LOD_MID_INTERVAL : 1);
+	}
+	map->Move(moves);
+	
+	aiMilliseconds += Clock::Milliseconds() - begin;
+}
+
+Scene::Scene() : view(1), hand(0), sequence(0), input(0) {}
+
+void Scene::Reserve(GLuint enemies)
+{
+	// The visible square and every enemy in it, gathering then never allocates
+	Memory::Scope scope(Memory::RENDER);
+	GLuint side = Config::CURRENT.visibleDistance * 2 + 1;
+	blocks.reserve(side * side);
+	instances.reserve(enemies);
+}
+
+void Scene::Gather(Map *map, const Player *viewer)
+{
+	Memory::Scope scope(Memory::RENDER);
+	// The vectors keep their capacity, a scene is refilled without allocating once it has grown
+	blocks.clear();
+	instances.clear();
+	map->Gather(*this, viewer);
+	hand = viewer->frame;
+}
+
+void Scene::Draw(Renderer &renderer) const
+{
+	renderer.SetCamera(view, Mat4::PROJECTION);
+	
+	GLuint capacity;
+	Enemy::Instance *mapped = renderer.MapInstances(capacity);
+	for (std::vector<Item>::const_iterator it = blocks.begin(); it != blocks.end(); ++it) renderer.Draw(it->model, it->transform, 0, 0);
+	
+	GLuint count = mapped ? glm::min<GLuint>(instances.size(), capacity) : 0;
+	if (count) memcpy(mapped, instances.data(), count * sizeof(Enemy::Instance));
+	renderer.DrawInstances(Model::ENEMY, count);
+	
+	renderer.SetCamera(Mat4::HAND, Mat4::IDENTITY);
+	renderer.Draw(Model::ENEMY, Mat4::IDENTITY, 2, hand);
+}
+
+ThreadPool::ThreadPool(GLuint _threads) : threads(glm::max<GLuint>(_threads, 1)), job(NULL), next(0), count(0), finished(0), generation(0), stopping(false)
+{
+	// The thread calling Run works too
+	for (GLuint i = 1; i < threads; ++i) workers.push_back(std::thread(&ThreadPool::Work, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::vector<std::thread>::iterator it = workers.begin(); it != workers.end(); ++it) it->join();
+}
+
+void ThreadPool::Run(GLuint _count, const std::function<void(GLuint)> &_job)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		job = &_job;
+		count = _count;
+		next = 0;
+		finished = 0;
+		++generation;
+	}
+	wake.notify_all();
+	Drain();
+	
+	// Every worker takes part in every run, so none can still be draining when the next one starts
+	std::unique_lock<std::mutex> lock(mutex);
+	done.wait(lock, [&]() { return finished == threads - 1; });
+}
+
+void ThreadPool::Work()
+{
+	for (GLuint seen = 0;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&]() { return stopping || generation != seen; });
+			if (stopping) return;
+			seen = generation;
+		}
+		
+		Drain();
+		
+		std::lock_guard<std::mutex> lock(mutex);
+		if (++finished == threads - 1) done.notify_one();
+	}
+}
+
+void ThreadPool::Drain()
+{
+	for (GLuint i; (i = next++) < count;) (*job)(i);
+}
+
+Generator *Generator::Create(GLuint kind, GLuint threads)
+{
+	if (kind == MAP_GENERATOR_ROOMS) return new RoomGenerator(threads);
+	return new WalkGenerator();
+}
+
+Map *WalkGenerator::Generate(GLuint cells, Random &random)
+{
+	return Map::Generate(cells, random);
+}
+
+RoomGenerator::RoomGenerator(GLuint threads) : pool(threads) {}
+
+Map *RoomGenerator::Generate(GLuint cells, Random &random)
+{
+	Memory::Scope scope(Memory::MAP);
+	std::vector<GLubyte> grid;
+	Point start;
+	GLuint side = Carve(cells, random.Next(), grid, start);
+	
+	// Packed like Map::Occupy, then classified 64 cells at a time, both by bands of rows on the pool
+	GLuint words = (side + 63) >> 6;
+	GLuint bands = (side + 63) >> 6;
+	std::vector<unsigned long long> bits((side + 2) * words, 0);
+	pool.Run(bands, [&](GLuint band)
+	{
+		for (GLuint y = band << 6, ey = glm::min(y + 64, side); y < ey; ++y)
+		{
+			unsigned long long *row = &bits[(y + 1) * words];
+			for (GLuint x = 0; x < side; ++x) row[x >> 6] |= (unsigned long long)grid[y * side + x] << (x & 63);
+		}
+	});
+	
+	std::vector<GLubyte> masks(side * side);
+	pool.Run(bands, [&](GLuint band)
+	{
+		for (GLuint y = band << 6, ey = glm::min(y + 64, side); y < ey; ++y) Map::ClassifyRow(&bits[y * words], &bits[(y + 1) * words], &bits[(y + 2) * words], side, &masks[y * side]);
+	});
+	
+	// The player spawns at 0, 0, in a room of the first chunk
+	Point size = { (short)side, (short)side };
+	Point origin = { (short)-start.x, (short)-start.y };
+	return Map::Create(masks.data(), size, origin);
+}
+
+GLuint RoomGenerator::Carve(GLuint cells, GLuint seed, std::vector<GLubyte> &grid, Point &start)
+{
+	// A square of about the requested area, cut into chunks of at most ROOMS_CHUNK cells a side
+	GLuint side = glm::max<GLuint>((GLuint)ceil(sqrt((double)cells)), ROOMS_MIN_SIDE);
+	GLuint chunks = (side + ROOMS_CHUNK - 1) / ROOMS_CHUNK;
+	grid.assign(side * side, 0);
+	
+	// Chunks only write their own cells, so they are carved in any order on any thread
+	std::vector<Point> centers(chunks * chunks);
+	pool.Run(chunks * chunks, [&](GLuint i) { centers[i] = CarveChunk(seed, i % chunks, i / chunks, chunks, side, grid.data()); });
+	start = centers[0];
+	return side;
+}
+
+inline GLuint RoomGenerator::GetKey(GLuint seed, GLuint cx, GLuint cy, GLuint salt)
+{
+	GLuint values[] = { seed, cx, cy, salt };
+	return (GLuint)Hash::Fnv(values, sizeof(values));
+}
+
+inline GLuint RoomGenerator::GetDoor(GLuint seed, GLuint cx, GLuint cy, GLuint salt, GLuint length)
+{
+	// Never in a corner, so a door only touches the chunk across its border
+	return 1 + GetKey(seed, cx, cy, salt) % (length - 2);
+}
+
+void RoomGenerator::Dig(GLubyte *grid, GLuint stride, const Point &from, const Point &to, bool horizontal)
+{
+	// One cell wide, along one axis then the other
+	Point corner = horizontal ? Point{ to.x, from.y } : Point{ from.x, to.y };
+	for (int x = glm::min(from.x, corner.x), ex = glm::max(from.x, corner.x); x <= ex; ++x)
+		for (int y = glm::min(from.y, corner.y), ey = glm::max(from.y, corner.y); y <= ey; ++y) grid[y * stride + x] = 1;
+	for (int x = glm::min(corner.x, to.x), ex = glm::max(corner.x, to.x); x <= ex; ++x)
+		for (int y = glm::min(corner.y, to.y), ey = glm::max(corner.y, to.y); y <= ey; ++y) grid[y * stride + x] = 1;
+}
+
+Point RoomGenerator::Split(Random &random, GLubyte *grid, GLuint stride, const Rect &rect)
+{
+	// Leaves longer than ROOMS_MAX_LEAF are cut across their longer side, shorter ones half of the time when both halves keep ROOMS_MIN_LEAF
+	bool vertical = rect.width >= rect.height;
+	int length = vertical ? rect.width : rect.height;
+	if (length > ROOMS_MAX_LEAF || (length >= ROOMS_MIN_LEAF * 2 && random.Next() & 1))
+	{
+		int cut = random.GetNumber<int>(ROOMS_MIN_LEAF, length - ROOMS_MIN_LEAF);
+		Rect a = rect, b = rect;
+		if (vertical)
+		{
+			a.width = cut;
+			b.x += cut;
+			b.width -= cut;
+		}
+		else
+		{
+			a.height = cut;
+			b.y += cut;
+			b.height -= cut;
+		}
+		
+		// A corridor between a room of each half keeps the rooms below connected
+		Point pa = Split(random, grid, stride, a);
+		Point pb = Split(random, grid, stride, b);
+		Dig(grid, stride, pa, pb, random.Next() & 1);
+		return random.Next() & 1 ? pa : pb;
+	}
+	
+	// One room per leaf with a wall cell on each side, so rooms of two leaves never touch
+	int width = random.GetNumber<int>(glm::min(ROOMS_MIN_ROOM, rect.width - 2), rect.width - 2);
+	int height = random.GetNumber<int>(glm::min(ROOMS_MIN_ROOM, rect.height - 2), rect.height - 2);
+	int x = random.GetNumber<int>(rect.x + 1, rect.x + rect.width - 1 - width);
+	int y = random.GetNumber<int>(rect.y + 1, rect.y + rect.height - 1 - height);
+	for (int j = y; j < y + height; ++j) memset(grid + j * stride + x, 1, width);
+	return { (short)(x + width / 2), (short)(y + height / 2) };
+}
+
+Point RoomGenerator::CarveChunk(GLuint seed, GLuint cx, GLuint cy, GLuint chunks, GLuint side, GLubyte *grid)
+{
+	Rect rect = { (int)(side * cx / chunks), (int)(side * cy / chunks), 0, 0 };
+	rect.width = side * (cx + 1) / chunks - rect.x;
+	rect.height = side * (cy + 1) / chunks - rect.y;
+	
+	Random random(GetKey(seed, cx, cy, 2));
+	Point center = Split(random, grid, side, rect);
+	
+	// A door on each inner border, keyed by the chunk on its left or above so both chunks dig the same cell
+	short right = rect.x + rect.width - 1, bottom = rect.y + rect.height - 1;
+	if (cx + 1 < chunks) Dig(grid, side, { right, (short)(rect.y + GetDoor(seed, cx, cy, 0, rect.height)) }, center, true);
+	if (cx) Dig(grid, side, { (short)rect.x, (short)(rect.y + GetDoor(seed, cx - 1, cy, 0, rect.height)) }, center, true);
+	if (cy + 1 < chunks) Dig(grid, side, { (short)(rect.x + GetDoor(seed, cx, cy, 1, rect.width)), bottom }, center, false);
+	if (cy) Dig(grid, side, { (short)(rect.x + GetDoor(seed, cx, cy - 1, 1, rect.width)), (short)rect.y }, center, false);
+	return center;
+}
+
+inline float Renderer::Fog(const glm::vec2 &planes, float depth)
+{
+	// Window depth back to the eye distance, black at the visible distance like post.fs
+	float distance = 2 * planes.x * planes.y / (planes.y + planes.x - (depth * 2 - 1) * (planes.y - planes.x)) / Config::CURRENT.visibleDistance;
+	return glm::clamp(1 - distance * distance, 0.0f, 1.0f);
+}
+
+const char *GLRenderer::STAGE_NAMES[STAGES] = { "scene", "post", "readback" };
+
+GLRenderer::GLRenderer() : readback(Readback::Create()), recorder(NULL), screenshot(NULL), mapped(NULL), planes(Mat4::ClipPlanes(Mat4::PROJECTION)), frame(0), gpuFrames(0), cpuFrames(0), stageStart(0)
+{
+	glGenQueries(POST_TIMER_FRAMES * STAGES, &queries[0][0]);
+	for (GLuint i = 0; i < STAGES; ++i) gpu[i] = cpu[i] = 0;
+}
+
+GLRenderer::~GLRenderer()
+{
+	glDeleteQueries(POST_TIMER_FRAMES * STAGES, &queries[0][0]);
+	delete readback;
+}
+
+void GLRenderer::Begin()
+{
+	Collect();
+	BeginStage(SCENE);
+	
+	FrameBuffer::POST->Bind();
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
+	glViewport(0, 0, Config::CURRENT.bufferWidth, Config::CURRENT.bufferHeight);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	Shader::WORLD->Bind();
+	glActiveTexture(GL_TEXTURE0);
+	Texture::GLOBAL->Bind();
+}
+
+void GLRenderer::SetCamera(const glm::mat4 &view, const glm::mat4 &projection)
+{
+	// The hand has no perspective, the fog keeps the planes of the scene
+	if (projection[2][3]) planes = Mat4::ClipPlanes(projection);
+	glUniformMatrix4fv(1, 1, GL_FALSE, (float *)&view);
+	glUniformMatrix4fv(2, 1, GL_FALSE, (float *)&projection);
+}
+
+void GLRenderer::Draw(Model *model, const glm::mat4 &transform, GLuint animation, GLuint frame)
+{
+	glUniform1i(3, animation);
+	glUniform1i(4, frame);
+	
+	model->Bind();
+	glUniformMatrix4fv(0, 1, GL_FALSE, (float *)&transform);
+	glDrawArrays(GL_TRIANGLES, 0, model->count);
+	model->Unbind();
+}
+
+Enemy::Instance *GLRenderer::MapInstances(GLuint &capacity)
+{
+	capacity = StreamBuffer::ENEMIES->size / sizeof(Enemy::Instance);
+	mapped = (Enemy::Instance *)StreamBuffer::ENEMIES->Map(capacity * sizeof(Enemy::Instance));
+	return mapped;
+}
+
+void GLRenderer::DrawInstances(Model *model, GLuint count)
+{
+	if (mapped) StreamBuffer::ENEMIES->Unmap();
+	mapped = NULL;
+	
+	if (count)
+	{
+		model->Bind();
+		model->BindInstances(StreamBuffer::ENEMIES->id, StreamBuffer::ENEMIES->offset, sizeof(Enemy::Instance));
+		glUniform1i(6, 1);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, model->count, count);
+		glUniform1i(6, 0);
+		model->Unbind();
+	}
+	
+	StreamBuffer::ENEMIES->Fence();
+}
+
+void GLRenderer::End()
+{
+	FrameBuffer::POST->Unbind();
+	EndStage(SCENE);
+	
+	// POST PROCESS, fog and upscale in one pass over the low resolution buffer
+	BeginStage(POST);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+	glViewport(0, 0, App::WindowSize.x, App::WindowSize.y);
+	glClear(GL_COLOR_BUFFER_BIT);
+	Shader::POST->Bind();
+	glUniform3f(4, planes.x, planes.y, (float)Config::CURRENT.visibleDistance);
+	glUniform2f(5, App::WindowSize.x / (float)Config::CURRENT.bufferWidth, App::WindowSize.y / (float)Config::CURRENT.bufferHeight);
+	glActiveTexture(GL_TEXTURE0);
+	FrameBuffer::POST->BindColor();
+	glActiveTexture(GL_TEXTURE1);
+	FrameBuffer::POST->BindDepth();
+	Model::POST->Bind();
+	glDrawArrays(GL_TRIANGLES, 0, Model::POST->count);
+	Model::POST->Unbind();
+	Shader::POST->Unbind();
+	EndStage(POST);
+	
+	// Captures are copied into pixel buffers here and handed to the encoders a frame or two later, once the GPU is done with them
+	BeginStage(READBACK);
+	if (readback)
+	{
+		readback->Poll();
+		if (screenshot && !readback->Request(App::WindowSize.x, App::WindowSize.y, false, screenshot)) std::cerr << "Dropped screenshot, all readback buffers are busy" << std::endl;
+		if (recorder)
+		{
+			// The recording is the low resolution buffer, the encoder applies the fog
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, FrameBuffer::POST->fbo);
+			readback->Request(Config::CURRENT.bufferWidth, Config::CURRENT.bufferHeight, true, recorder, planes);
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+		}
+	}
+	screenshot = NULL;
+	EndStage(READBACK);
+	
+	if (++frame % POST_REPORT_FRAMES == 0) Report();
+}
+
+void GLRenderer::BeginStage(Stage stage)
+{
+	stageStart = Clock::Milliseconds();
+	glBeginQuery(GL_TIME_ELAPSED, queries[frame % POST_TIMER_FRAMES][stage]);
+}
+
+void GLRenderer::EndStage(Stage stage)
+{
+	glEndQuery(GL_TIME_ELAPSED);
+	cpu[stage] += Clock::Milliseconds() - stageStart;
+	if (stage == STAGES - 1) ++cpuFrames;
+}
+
+void GLRenderer::Collect()
+{
+	// The queries of this slot were issued POST_TIMER_FRAMES ago, a result that is still pending is skipped rather than waited for
+	if (frame < POST_TIMER_FRAMES) return;
+	GLuint *slot = queries[frame % POST_TIMER_FRAMES];
+	
+	GLint available = 0;
+	glGetQueryObjectiv(slot[STAGES - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) return;
+	
+	for (GLuint i = 0; i < STAGES; ++i)
+	{
+		GLuint64 nanoseconds = 0;
+		glGetQueryObjectui64v(slot[i], GL_QUERY_RESULT, &nanoseconds);
+		gpu[i] += nanoseconds / 1000000.0;
+	}
+	++gpuFrames;
+}
+
+void GLRenderer::Report()
+{
+	std::cout << "Frame " << frame;
+	for (GLuint i = 0; i < STAGES; ++i) std::cout << ", " << STAGE_NAMES[i] << " " << (gpuFrames ? gpu[i] / gpuFrames : 0.0) << " ms gpu " << (cpuFrames ? cpu[i] / cpuFrames : 0.0) << " ms cpu";
+	if (readback && readback->requested) std::cout << ", " << readback->requested << " readbacks (" << readback->dropped << " dropped)";
+	if (recorder) std::cout << ", " << recorder->frames << " recorded (" << recorder->dropped << " dropped)";
+	std::cout << std::endl;
+	
+	for (GLuint i = 0; i < STAGES; ++i) gpu[i] = cpu[i] = 0;
+	gpuFrames = cpuFrames = 0;
+}
+
+bool SoftwareRenderer::LoadAssets()
+{
+	// Only the CPU side of the assets, there is no GL context without a window
+	Model::E = Model::Load("resources\\models\\E.mol", false);
+	Model::I = Model::Load("resources\\models\\I.mol", false);
+	Model::H = Model::Load("resources\\models\\H.mol", false);
+	Model::L = Model::Load("resources\\models\\L.mol", false);
+	Model::U = Model::Load("resources\\models\\U.mol", false);
+	Model::ENEMY = Model::Load("resources\\models\\enemy.mol", false);
+	Texture::GLOBAL = Texture::Load("resources\\textures\\global.bmp", false);
+	return Model::E && Model::I && Model::H && Model::L && Model::U && Model::ENEMY && Texture::GLOBAL;
+}
+
+void SoftwareRenderer::ReleaseAssets()
+{
+	Pointer::Delete(Texture::GLOBAL);
+	Pointer::Delete(Model::ENEMY);
+	Pointer::Delete(Model::U);
+	Pointer::Delete(Model::L);
+	Pointer::Delete(Model::H);
+	Pointer::Delete(Model::I);
+	Pointer::Delete(Model::E);
+}
+
+SoftwareRenderer *SoftwareRenderer::Create(GLuint width, GLuint height, GLuint threads, GLuint instances)
+{
+	if (!width || !height || !Texture::GLOBAL) return NULL;
+	Memory::Scope scope(Memory::RENDER);
+	return new SoftwareRenderer(width, height, threads, instances);
+}
+
+SoftwareRenderer::SoftwareRenderer(GLuint _width, GLuint _height, GLuint threads, GLuint _instances) : width(_width), height(_height), triangles(0), planes(Mat4::ClipPlanes(Mat4::PROJECTION)), texture(NULL), pool(threads)
+{
+	tilesX = (width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	tilesY = (height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+	bins.resize(tilesX * tilesY);
+	instances.resize(_instances);
+	
+	// Color and depth are stored tile by tile, each depth tile is padded for the 4 wide loads past its last pixel
+	pixels = new GLuint[width * height];
+	colors = new GLuint[tilesX * tilesY * RENDER_TILE_SIZE * RENDER_TILE_SIZE];
+	depth = new float[tilesX * tilesY * (RENDER_TILE_SIZE * RENDER_TILE_SIZE + 4)];
+}
+
+SoftwareRenderer::~SoftwareRenderer()
+{
+	delete[] depth;
+	delete[] colors;
+	delete[] pixels;
+}
+
+void SoftwareRenderer::Begin()
+{
+	texture = Texture::GLOBAL;
+	queue.clear();
+	for (std::vector<std::vector<GLuint> >::iterator it = bins.begin(); it != bins.end(); ++it) it->clear();
+}
+
+void SoftwareRenderer::SetCamera(const glm::mat4 &_view, const glm::mat4 &_projection)
+{
+	view = _view;
+	projection = _projection;
+	if (projection[2][3]) planes = Mat4::ClipPlanes(projection);
+}
+
+void SoftwareRenderer::Draw(Model *model, const glm::mat4 &transform, GLuint animation, GLuint frame)
+{
+	glm::mat4 mvp = projection * view * transform;
+	glm::vec2 offset(frame * 0.25f, animation * -0.25f);
+	glm::vec4 clip[3];
+	glm::vec2 coords[3];
+	
+	for (GLuint i = 0; i + 2 < model->count; i += 3)
+	{
+		for (GLuint j = 0; j < 3; ++j)
+		{
+			const Model::Vertex &v = model->vertices[i + j];
+			clip[j] = mvp * glm::vec4(v.x, v.y, v.z, 1);
+			coords[j] = glm::vec2(v.s, v.t) + offset;
+		}
+		Submit(clip, coords);
+	}
+}
+
+Enemy::Instance *SoftwareRenderer::MapInstances(GLuint &capacity)
+{
+	capacity = instances.size();
+	return instances.empty() ? NULL : &instances[0];
+}
+
+void SoftwareRenderer::DrawInstances(Model *model, GLuint count)
+{
+	// Same billboarding as world.vs, the quad takes the camera right vector
+	glm::vec3 right = glm::normalize(glm::vec3(view[0][0], 0, view[2][0]));
+	glm::mat4 vp = projection * view;
+	glm::vec4 clip[3];
+	glm::vec2 coords[3];
+	
+	for (GLuint n = 0; n < count; ++n)
+	{
+		const Enemy::Instance &instance = instances[n];
+		glm::vec2 offset(instance.frame * 0.25f, instance.animation * -0.25f);
+		for (GLuint i = 0; i + 2 < model->count; i += 3)
+		{
+			for (GLuint j = 0; j < 3; ++j)
+			{
+				const Model::Vertex &v = model->vertices[i + j];
+				clip[j] = vp * glm::vec4(instance.position + right * v.x + glm::vec3(0, v.y, 0), 1);
+				coords[j] = glm::vec2(v.s, v.t) + offset;
+			}
+			Submit(clip, coords);
+		}
+	}
+}
+
+void SoftwareRenderer::End()
+{
+	// Tiles are independent, each one is cleared, rasterized and post processed by a single job
+	triangles = queue.size();
+	pool.Run(tilesX * tilesY, [this](GLuint tile) { Rasterize(tile); });
+}
+
+void SoftwareRenderer::Submit(const glm::vec4 *clip, const glm::vec2 *coords)
+{
+	// Only the near plane needs clipping, the bounding boxes take care of the screen edges
+	glm::vec4 polygon[4];
+	glm::vec2 polygonCoords[4];
+	GLuint count = 0;
+	
+	for (GLuint i = 0; i < 3; ++i)
+	{
+		GLuint j = (i + 1) % 3;
+		float di = clip[i].z + clip[i].w;
+		float dj = clip[j].z + clip[j].w;
+		if (di >= 0)
+		{
+			polygon[count] = clip[i];
+			polygonCoords[count++] = coords[i];
+		}
+		if ((di >= 0) != (dj >= 0))
+		{
+			float f = di / (di - dj);
+			polygon[count] = clip[i] * (1 - f) + clip[j] * f;
+			polygonCoords[count++] = coords[i] * (1 - f) + coords[j] * f;
+		}
+	}
+	
+	for (GLuint i = 2; i < count; ++i) Setup(polygon[0], polygon[i - 1], polygon[i], polygonCoords[0], polygonCoords[i - 1], polygonCoords[i]);
+}
+
+void SoftwareRenderer::Setup(const glm::vec4 &a, const glm::vec4 &b, const glm::vec4 &c, const glm::vec2 &ta, const glm::vec2 &tb, const glm::vec2 &tc)
+{
+	const glm::vec4 *clip[3] = { &a, &b, &c };
+	const glm::vec2 *coords[3] = { &ta, &tb, &tc };
+	float x[3], y[3], z[3], w[3], s[3], t[3];
+	
+	for (GLuint i = 0; i < 3; ++i)
+	{
+		// Window coordinates with the rows going down, depth in [0, 1] like the GL depth buffer
+		w[i] = 1 / clip[i]->w;
+		x[i] = (clip[i]->x * w[i] * 0.5f + 0.5f) * width;
+		y[i] = (0.5f - clip[i]->y * w[i] * 0.5f) * height;
+		z[i] = clip[i]->z * w[i] * 0.5f + 0.5f;
+		s[i] = coords[i]->x * w[i];
+		t[i] = coords[i]->y * w[i];
+	}
+	
+	// Counter clockwise faces turn clockwise once the rows go down, the others are culled like GL_CULL_FACE does
+	float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+	if (area >= 0) return;
+	
+	Triangle triangle;
+	triangle.minX = (int)glm::clamp<float>(floor(glm::min(x[0], glm::min(x[1], x[2]))), 0, width);
+	triangle.maxX = (int)glm::clamp<float>(ceil(glm::max(x[0], glm::max(x[1], x[2]))), 0, width);
+	triangle.minY = (int)glm::clamp<float>(floor(glm::min(y[0], glm::min(y[1], y[2]))), 0, height);
+	triangle.maxY = (int)glm::clamp<float>(ceil(glm::max(y[0], glm::max(y[1], y[2]))), 0, height);
+	if (triangle.minX >= triangle.maxX || triangle.minY >= triangle.maxY) return;
+	
+	// Each edge gives the barycentric weight of the opposite vertex, attributes become planes over the screen
+	float inverse = 1 / area;
+	for (GLuint i = 0; i < 3; ++i)
+	{
+		GLuint j = (i + 1) % 3, k = (i + 2) % 3;
+		triangle.edges[i][0] = (y[j] - y[k]) * inverse;
+		triangle.edges[i][1] = (x[k] - x[j]) * inverse;
+		triangle.edges[i][2] = -(triangle.edges[i][0] * x[j] + triangle.edges[i][1] * y[j]);
+	}
+	
+	float *planes[4] = { triangle.z, triangle.w, triangle.s, triangle.t };
+	const float *values[4] = { z, w, s, t };
+	for (GLuint p = 0; p < 4; ++p)
+		for (GLuint i = 0; i < 3; ++i)
+			planes[p][i] = triangle.edges[0][i] * values[p][0] + triangle.edges[1][i] * values[p][1] + triangle.edges[2][i] * values[p][2];
+	
+	// The bias closes the cracks rounding would leave along edges shared by two triangles
+	for (GLuint i = 0; i < 3; ++i) triangle.edges[i][2] += RENDER_EDGE_BIAS;
+	
+	GLuint index = queue.size();
+	queue.push_back(triangle);
+	for (int ty = triangle.minY / RENDER_TILE_SIZE; ty <= (triangle.maxY - 1) / RENDER_TILE_SIZE; ++ty)
+		for (int tx = triangle.minX / RENDER_TILE_SIZE; tx <= (triangle.maxX - 1) / RENDER_TILE_SIZE; ++tx)
+			bins[ty * tilesX + tx].push_back(index);
+}
+
+inline void SoftwareRenderer::Shade(const Triangle &triangle, float x, float y, float z, GLuint &color, float &depth)
+{
+	// Perspective correct coordinates, nearest texel with clamped edges like the GL sampler
+	float w = 1 / (triangle.w[0] * x + triangle.w[1] * y + triangle.w[2]);
+	float s = (triangle.s[0] * x + triangle.s[1] * y + triangle.s[2]) * w;
+	float t = (triangle.t[0] * x + triangle.t[1] * y + triangle.t[2]) * w;
+	int u = glm::clamp<int>((int)floor(glm::clamp(s, -1.0f, 2.0f) * texture->width), 0, texture->width - 1);
+	int v = glm::clamp<int>((int)floor(glm::clamp(t, -1.0f, 2.0f) * texture->height), 0, texture->height - 1);
+	GLuint texel = texture->texels[v * texture->width + u];
+	
+	// world.fs discards the color key
+	if (texel == RENDER_COLOR_KEY) return;
+	color = texel;
+	depth = z;
+}
+
+void SoftwareRenderer::Rasterize(GLuint tile)
+{
+	int x0 = tile % tilesX * RENDER_TILE_SIZE;
+	int y0 = tile / tilesX * RENDER_TILE_SIZE;
+	int x1 = glm::min<int>(x0 + RENDER_TILE_SIZE, width);
+	int y1 = glm::min<int>(y0 + RENDER_TILE_SIZE, height);
+	GLuint *tileColors = colors + tile * RENDER_TILE_SIZE * RENDER_TILE_SIZE;
+	float *tileDepth = depth + tile * (RENDER_TILE_SIZE * RENDER_TILE_SIZE + 4);
+	
+	for (GLuint i = 0; i < RENDER_TILE_SIZE * RENDER_TILE_SIZE; ++i)
+	{
+		tileColors[i] = RENDER_CLEAR_COLOR;
+		tileDepth[i] = 1;
+	}
+	
+	// Triangles keep their submission order within a tile, the image does not depend on the thread count
+	const std::vector<GLuint> &bin = bins[tile];
+	for (GLuint n = 0; n < bin.size(); ++n)
+	{
+		const Triangle &triangle = queue[bin[n]];
+		int minX = glm::max(triangle.minX, x0), maxX = glm::min(triangle.maxX, x1);
+		int minY = glm::max(triangle.minY, y0), maxY = glm::min(triangle.maxY, y1);
+		
+		for (int y = minY; y < maxY; ++y)
+		{
+			float py = y + 0.5f;
+			int row = (y - y0) * RENDER_TILE_SIZE - x0;
+#if RENDER_SIMD
+			// Coverage and depth test 4 pixels at a time, only the visible ones are textured
+			const __m128 lanes = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+			const __m128 zero = _mm_setzero_ps();
+			const __m128 limit = _mm_set1_ps((float)maxX);
+			__m128 ex[3], ey[3];
+			for (GLuint i = 0; i < 3; ++i)
+			{
+				ex[i] = _mm_set1_ps(triangle.edges[i][0]);
+				ey[i] = _mm_set1_ps(triangle.edges[i][1] * py + triangle.edges[i][2]);
+			}
+			__m128 zx = _mm_set1_ps(triangle.z[0]);
+			__m128 zy = _mm_set1_ps(triangle.z[1] * py + triangle.z[2]);
+			
+			for (int x = minX; x < maxX; x += 4)
+			{
+				__m128 px = _mm_add_ps(_mm_set1_ps((float)x), lanes);
+				__m128 visible = _mm_cmplt_ps(px, limit);
+				for (GLuint i = 0; i < 3; ++i) visible = _mm_and_ps(visible, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(ex[i], px), ey[i]), zero));
+				__m128 pz = _mm_add_ps(_mm_mul_ps(zx, px), zy);
+				visible = _mm_and_ps(visible, _mm_cmplt_ps(pz, _mm_loadu_ps(tileDepth + row + x)));
+				
+				int mask = _mm_movemask_ps(visible);
+				if (!mask) continue;
+				float z[4];
+				_mm_storeu_ps(z, pz);
+				for (int l = 0; l < 4; ++l)
+					if (mask & (1 << l)) Shade(triangle, x + l + 0.5f, py, z[l], tileColors[row + x + l], tileDepth[row + x + l]);
+			}
+#else
+			for (int x = minX; x < maxX; ++x)
+			{
+				float px = x + 0.5f;
+				if (triangle.edges[0][0] * px + triangle.edges[0][1] * py + triangle.edges[0][2] < 0 ||
+					triangle.edges[1][0] * px + triangle.edges[1][1] * py + triangle.edges[1][2] < 0 ||
+					triangle.edges[2][0] * px + triangle.edges[2][1] * py + triangle.edges[2][2] < 0) continue;
+				
+				float z = triangle.z[0] * px + triangle.z[1] * py + triangle.z[2];
+				if (z < tileDepth[row + x]) Shade(triangle, px, py, z, tileColors[row + x], tileDepth[row + x]);
+			}
+#endif
+		}
+	}
+	
+	// Depth fog from post.fs with the planes of the scene projection
+	for (int y = y0; y < y1; ++y)
+	{
+		for (int x = x0; x < x1; ++x)
+		{
+			GLuint i = (y - y0) * RENDER_TILE_SIZE + x - x0;
+			float f = Fog(planes, tileDepth[i]);
+			GLuint c = tileColors[i];
+			pixels[y * width + x] = (GLuint)((c >> 16 & 0xFF) * f + 0.5f) << 16 | (GLuint)((c >> 8 & 0xFF) * f + 0.5f) << 8 | (GLuint)((c & 0xFF) * f + 0.5f);
+		}
+	}
+}
+
+bool SoftwareRenderer::Write(const char *filename, const GLuint *pixels, GLuint width, GLuint height)
+{
+	// Binary PPM, rows from the top
+	std::ostringstream header;
+	header << "P6\n" << width << " " << height << "\n255\n";
+	std::string data = header.str();
+	GLuint offset = data.size();
+	data.resize(offset + width * height * 3);
+	for (GLuint i = 0; i < width * height; ++i)
+	{
+		data[offset + i * 3] = pixels[i] >> 16 & 0xFF;
+		data[offset + i * 3 + 1] = pixels[i] >> 8 & 0xFF;
+		data[offset + i * 3 + 2] = pixels[i] & 0xFF;
+	}
+	return File::WriteAll(filename, data.data(), data.size());
+}
+
+GLuint *SoftwareRenderer::Read(const char *filename, GLuint *width, GLuint *height)
+{
+	GLuint size = 0;
+	char *data = File::ReadAll(filename, &size);
+	if (!data) return NULL;
+	
+	// Binary PPM without comments, as Write makes them
+	int w = 0, h = 0, max = 0, offset = 0;
+	if (size < 2 || data[0] != 'P' || data[1] != '6' || sscanf(data + 2, "%d %d %d%n", &w, &h, &max, &offset) != 3 ||
+		max != 255 || w <= 0 || h <= 0 || 3 + offset + (GLuint)(w * h * 3) > size)
+	{
+		delete[] data;
+		return NULL;
+	}
+	
+	const GLubyte *p = (const GLubyte *)data + 3 + offset;
+	GLuint *pixels = new GLuint[w * h];
+	for (int i = 0; i < w * h; ++i) pixels[i] = p[i * 3] << 16 | p[i * 3 + 1] << 8 | p[i * 3 + 2];
+	delete[] data;
+	
+	*width = w;
+	*height = h;
+	return pixels;
+}
+
+int SoftwareRenderer::Capture(const char *filename, GLuint seed, GLuint ticks, GLuint threads)
+{
+	if (!LoadAssets())
+	{
+		std::cerr << "Failed to loading models and textures !" << std::endl;
+		ReleaseAssets();
+		return 80;
+	}
+	
+	// Same map and player as a new game, the simulation runs a few ticks so the enemies spread out
+	World *world = World::Generate(Config::CURRENT.mapCells, Config::CURRENT.mapEnemies, seed);
+	Player *player = world->AddPlayer(glm::vec3(0, 0, 0), 0);
+	for (GLuint i = 0; i < ticks; ++i) world->Step();
+	
+	SoftwareRenderer *renderer = Create(Config::CURRENT.bufferWidth, Config::CURRENT.bufferHeight, threads, world->enemies.size());
+	Scene scene;
+	scene.Gather(world->map, player);
+	renderer->Begin();
+	scene.Draw(*renderer);
+	renderer->End();
+	
+	bool written = Write(filename, renderer->pixels, renderer->width, renderer->height);
+	if (written) std::cout << filename << ": " << renderer->width << "x" << renderer->height << ", " << renderer->triangles << " triangles" << std::endl;
+	else std::cerr << "Failed to writing " << filename << std::endl;
+	
+	Pointer::Delete(renderer);
+	Pointer::Delete(world);
+	ReleaseAssets();
+	return written ? 0 : 81;
+}
+
+int SoftwareRenderer::Diff(const char *expected, const char *actual, GLuint tolerance, const char *output)
+{
+	GLuint width, height, actualWidth, actualHeight;
+	GLuint *a = Read(expected, &width, &height);
+	GLuint *b = a ? Read(actual, &actualWidth, &actualHeight) : NULL;
+	if (!a || !b || width != actualWidth || height != actualHeight)
+	{
+		std::cerr << "Failed to comparing " << expected << " and " << actual << std::endl;
+		delete[] a;
+		delete[] b;
+		return 2;
+	}
+	
+	// Pixels over the tolerance turn red in the output, the others are dimmed
+	GLuint different = 0, worst = 0;
+	for (GLuint i = 0; i < width * height; ++i)
+	{
+		GLuint delta = 0;
+		for (GLuint shift = 0; shift < 24; shift += 8) delta = glm::max<GLuint>(delta, glm::abs((int)(a[i] >> shift & 0xFF) - (int)(b[i] >> shift & 0xFF)));
+		worst = glm::max(worst, delta);
+		if (delta > tolerance) ++different;
+		b[i] = delta > tolerance ? 0xFF0000 : a[i] >> 2 & 0x3F3F3F;
+	}
+	
+	std::cout << "diff " << width << "x" << height << ": " << different << " pixels over " << tolerance << ", max delta " << worst << std::endl;
+	if (output && !Write(output, b, width, height)) std::cerr << "Failed to writing " << output << std::endl;
+	
+	delete[] a;
+	delete[] b;
+	return different ? 1 : 0;
+}
+
+int Runner::Check(GLuint ticks, GLuint warmup)
+{
+#if MEMORY_TRACKING
+	World *world = World::Generate(Config::CURRENT.mapCells, Config::CURRENT.mapEnemies, RUNNER_SEED);
+	Player *player = world->AddPlayer(glm::vec3(0, 0, 0), 0);
+	Scene scene;
+	scene.Reserve(world->enemies.size());
+	// Only operator new is hooked, malloc calls from SDL, OpenAL, the streams or the unwinder are not seen
+	std::cout << "allocations: " << world->enemies.size() << " enemies, " << warmup << " warm-up ticks, " << ticks << " checked ticks, counting operator new only (not malloc)" << std::endl;
+	
+	// The simulation thread work of a game tick, with the same bot as the runner
+	GLuint failed = 0;
+	unsigned long long total = 0;
+	for (GLuint t = 0; t < warmup + ticks; ++t)
+	{
+		if (t % 30 == 0) player->buttons = world->random.GetNumber<GLuint>(0, 127);
+		if (t == warmup) Memory::Trap(MEMORY_TRACE_STACKS);
+		
+		unsigned long long before = Memory::GetAllocations();
+		world->Step();
+		scene.Gather(world->map, player);
+		unsigned long long count = Memory::GetAllocations() - before;
+		if (t < warmup || !count) continue;
+		
+		if (failed++ < MEMORY_TRACE_STACKS) std::cout << "  tick " << t << ": " << count << " allocations" << std::endl;
+		total += count;
+	}
+	Memory::Trap(0);
+	Pointer::Delete(world);
+	
+	std::cout << "  " << total << " operator new allocations in " << failed << " of " << ticks << " checked ticks" << std::endl;
+	return failed ? 1 : 0;
+#else
+	std::cerr << "Allocations are only counted with MEMORY_TRACKING" << std::endl;
+	return 2;
+#endif
+}
+
+int Runner::Run(GLuint count, GLuint ticks, GLuint threads)
+{
+	std::vector<World *> worlds(count);
+	ThreadPool pool(threads);
+	std::cout << "worlds: " << count << " worlds x " << ticks << " ticks on " << glm::max<GLuint>(threads, 1) << " threads" << std::endl;
+	
+	// Each job only touches its own world, generation included
+	double begin = Clock::Milliseconds();
+	pool.Run(count, [&](GLuint i)
+	{
+		worlds[i] = World::Generate(RUNNER_CELLS, RUNNER_ENEMIES, RUNNER_SEED + i);
+		worlds[i]->AddPlayer(glm::vec3(0, 0, 0), 0);
+	});
+	double generate = Clock::Milliseconds() - begin;
+	
+	begin = Clock::Milliseconds();
+	pool.Run(count, [&](GLuint i)
+	{
+		// A bot holding random buttons for half a second
+		World *world = worlds[i];
+		Player *player = world->players[0];
+		for (GLuint t = 0; t < ticks; ++t)
+		{
+			if (t % 30 == 0) player->buttons = world->random.GetNumber<GLuint>(0, 127);
+			world->Step();
+		}
+	});
+	double step = Clock::Milliseconds() - begin;
+	
+	// Independent of the thread count when the worlds do not share any state
+	unsigned long long checksum = Hash::Fnv(NULL, 0);
+	double events = 0, ai = 0, tiers[LOD_TIERS] = { 0 };
+	for (std::vector<World *>::iterator it = worlds.begin(); it != worlds.end(); ++it)
+	{
+		events += (*it)->wheel.fired;
+		ai += (*it)->aiMilliseconds;
+		for (GLuint t = 0; t < LOD_TIERS; ++t) tiers[t] += (*it)->tiers[t];
+		for (std::vector<Enemy *>::iterator e = (*it)->enemies.begin(); e != (*it)->enemies.end(); ++e) checksum = Hash::Fnv(&(*e)->position, sizeof(glm::vec3), checksum);
+		checksum = Hash::Fnv(&(*it)->players[0]->position, sizeof(glm::vec3), checksum);
+		Pointer::Delete(*it);
+	}
+	
+	double steps = (double)count * ticks;
+	std::cout << "  generate " << generate << " ms" << std::endl;
+	std::cout << "  step " << step << " ms, " << (GLuint)(steps * 1000 / step) << " world ticks/s, " << step * 1000 / steps << " us/world tick, " << events / steps << " events/world tick" << std::endl;
+	std::cout << "  ai " << ai * 1000 / steps << " us/world tick, near " << tiers[LOD_NEAR] / steps << ", mid " << tiers[LOD_MID] / steps << ", far " << tiers[LOD_FAR] / steps << " enemies" << std::endl;
+	std::cout << "  checksum " << std::hex << checksum << std::dec << std::endl;
+	return 0;
+}
+
+const char *Batch::NAMES[COLUMNS] = { "seed", "cells", "width", "height", "dead_ends", "junctions", "corridor", "farthest" };
+
+bool Batch::Filter::Parse(const char *text)
+{
+	// column>=value, column<=value or column=value
+	const char *end = text + strcspn(text, "<>=");
+	for (column = 0; column < COLUMNS; ++column)
+		if (strlen(NAMES[column]) == (size_t)(end - text) && !strncmp(text, NAMES[column], end - text)) break;
+	if (column == COLUMNS || !*end) return false;
+	
+	op = *end;
+	if (op != '=' && *++end != '=') return false;
+	return sscanf(end + 1, "%u", &value) == 1;
+}
+
+bool Batch::Filter::Accept(const GLuint *values) const
+{
+	if (op == '<') return values[column] <= value;
+	if (op == '>') return values[column] >= value;
+	return values[column] == value;
+}
+
+void Batch::Measure(Map *map, GLuint seed, GLuint *values)
+{
+	GLuint cells = map->size.x * map->size.y;
+	memset(values, 0, COLUMNS * sizeof(GLuint));
+	values[SEED] = seed;
+	values[WIDTH] = map->size.x;
+	values[HEIGHT] = map->size.y;
+	
+	std::vector<bool> visited(cells, false);
+	for (GLuint i = 0; i < cells; ++i)
+	{
+		if (!map->blocks[i]) continue;
+		GLubyte mask = map->blocks[i]->mask;
+		GLuint links = (mask & 1) + (mask >> 1 & 1) + (mask >> 2 & 1) + (mask >> 3 & 1);
+		++values[CELLS];
+		if (links == 1) ++values[DEAD_ENDS];
+		else if (links >= 3) ++values[JUNCTIONS];
+		if (links != 2 || visited[i]) continue;
+		
+		// A corridor is a chain of cells with two neighbors, it is followed both ways from the first cell found
+		GLuint length = 1;
+		visited[i] = true;
+		for (GLuint d = 0; d < 4; ++d)
+		{
+			if (!(mask & (1 << d))) continue;
+			GLuint from = (d + 2) & 3;
+			GLint c = i + NavField::DIRECTIONS[d].y * map->size.x + NavField::DIRECTIONS[d].x;
+			for (;;)
+			{
+				GLubyte m = map->blocks[c]->mask;
+				if ((m & 1) + (m >> 1 & 1) + (m >> 2 & 1) + (m >> 3 & 1) != 2 || visited[c]) break;
+				visited[c] = true;
+				++length;
+				
+				GLuint next = 0;
+				while (next == from || !(m & (1 << next))) ++next;
+				from = (next + 2) & 3;
+				c += NavField::DIRECTIONS[next].y * map->size.x + NavField::DIRECTIONS[next].x;
+			}
+		}
+		values[CORRIDOR] = glm::max(values[CORRIDOR], length);
+	}
+	
+	// Path length from the start cell to the farthest one
+	NavField field(map->size, NAV_UNREACHED - 1);
+	GLuint start = map->GetCell(glm::vec3(0, 0, 0));
+	field.Build(map->blocks, &start, 1);
+	for (GLuint i = 0; i < field.visited; ++i) values[FARTHEST] = glm::max<GLuint>(values[FARTHEST], field.distance[field.queue[i]]);
+}
+
+void Batch::Pack(Map *map, GLuint seed, std::string &data)
+{
+	// Seed, size and origin followed by the neighbors masks, two cells per byte and 0 for a wall
+	GLuint cells = map->size.x * map->size.y;
+	short header[4] = { map->size.x, map->size.y, map->origin.x, map->origin.y };
+	data.assign((const char *)&seed, sizeof(GLuint));
+	data.append((const char *)header, sizeof(header));
+	data.resize(data.size() + (cells + 1) / 2, 0);
+	
+	char *masks = &data[sizeof(GLuint) + sizeof(header)];
+	for (GLuint i = 0; i < cells; ++i)
+		if (map->blocks[i]) masks[i >> 1] |= map->blocks[i]->mask << ((i & 1) << 2);
+}
+
+int Batch::Run(GLuint count, GLuint cells, GLuint threads, const char *summary, const char *maps, const char *filter)
+{
+	// "-" skips an output, the arguments after it are positional
+	if (summary && !strcmp(summary, "-")) summary = NULL;
+	if (maps && !strcmp(maps, "-")) maps = NULL;
+	
+	Filter selection;
+	if (filter && !selection.Parse(filter))
+	{
+		std::cerr << "Invalid filter " << filter << ", expected column>=value, column<=value or column=value" << std::endl;
+		return 90;
+	}
+	
+	std::vector<GLuint> stats(count * COLUMNS);
+	std::vector<double> times(count);
+	std::vector<std::string> packed(maps ? count : 0);
+	ThreadPool pool(threads);
+	threads = glm::max<GLuint>(threads, 1);
+	std::cout << "batch: " << count << " maps of " << cells << " cells on " << threads << " threads" << std::endl;
+	
+	// One seed and one generator per task, the results do not depend on the scheduling, and the maps use a single thread each
+	double begin = Clock::Milliseconds();
+	pool.Run(count, [&](GLuint i)
+	{
+		double start = Clock::Milliseconds();
+		GLuint seed = BATCH_SEED + i;
+		Random random(seed);
+		Generator *generator = Generator::Create(Config::CURRENT.mapGenerator, 1);
+		Map *map = generator->Generate(cells, random);
+		delete generator;
+		Measure(map, seed, &stats[i * COLUMNS]);
+		if (maps && (!filter || selection.Accept(&stats[i * COLUMNS]))) Pack(map, seed, packed[i]);
+		Pointer::Delete(map);
+		times[i] = Clock::Milliseconds() - start;
+	});
+	double elapsed = Clock::Milliseconds() - begin;
+	
+	double busy = 0;
+	for (GLuint i = 0; i < count; ++i) busy += times[i];
+	std::cout << "  " << elapsed << " ms, " << count * 1000.0 / elapsed << " maps/s, " << count * 1000.0 / busy << " maps/s per core" << std::endl;
+	
+	for (GLuint c = CELLS; c < COLUMNS && count; ++c)
+	{
+		GLuint low = UINT_MAX, high = 0;
+		double sum = 0;
+		for (GLuint i = 0; i < count; ++i)
+		{
+			GLuint v = stats[i * COLUMNS + c];
+			low = glm::min(low, v);
+			high = glm::max(high, v);
+			sum += v;
+		}
+		std::cout << "  " << NAMES[c] << ": " << low << " to " << high << ", mean " << sum / count << std::endl;
+	}
+	
+	if (summary)
+	{
+		std::ofstream file(summary);
+		for (GLuint c = 0; c < COLUMNS; ++c) file << NAMES[c] << (c + 1 < COLUMNS ? "," : "\n");
+		for (GLuint i = 0; i < count; ++i)
+			for (GLuint c = 0; c < COLUMNS; ++c) file << stats[i * COLUMNS + c] << (c + 1 < COLUMNS ? "," : "\n");
+		if (!file.good())
+		{
+			std::cerr << "Failed to writing " << summary << std::endl;
+			return 91;
+		}
+	}
+	
+	if (maps)
+	{
+		GLuint kept = 0;
+		std::string data("LD0B", 4);
+		data.append(8, 0);
+		for (GLuint i = 0; i < count; ++i)
+		{
+			if (packed[i].empty()) continue;
+			data += packed[i];
+			++kept;
+		}
+		GLuint version = BATCH_VERSION;
+		memcpy(&data[4], &version, sizeof(GLuint));
+		memcpy(&data[8], &kept, sizeof(GLuint));
+		if (!File::WriteAll(maps, data.data(), data.size()))
+		{
+			std::cerr << "Failed to writing " << maps << std::endl;
+			return 92;
+		}
+		std::cout << "  " << kept << " maps saved to " << maps << ", " << data.size() << " bytes" << std::endl;
+	}
+	return 0;
+}
+
+inline GLuint Snapshot::GetEnemiesOffset(GLuint cells)
+{
+	// Header, player, one byte per cell, then the enemies aligned on 4 bytes
+	return (sizeof(Header) + sizeof(PlayerState) + cells + 3) & ~3;
+}
+
+bool Snapshot::Save(const char *filename, World *world)
+{
+	// Single player snapshot, the first player of the world
+	Map *map = world->map;
+	if (world->players.empty()) return false;
+	Player *player = world->players[0];
+	
+	GLuint cells = map->size.x * map->size.y;
+	GLuint offset = GetEnemiesOffset(cells);
+	GLuint size = offset + world->enemies.size() * sizeof(EnemyState);
+	char *data = new char[size];
+	memset(data, 0, offset);
+	
+	Header *header = (Header *)data;
+	memcpy(header->magic, "LD00", 4);
+	header->version = SNAPSHOT_VERSION;
+	header->size = map->size;
+	header->origin = map->origin;
+	header->cells = cells;
+	header->enemies = world->enemies.size();
+	header->random = world->random.state;
+	
+	PlayerState *p = (PlayerState *)(header + 1);
+	p->position = player->position;
+	p->angle = player->angle;
+	p->moving = player->moving;
+	p->frame = player->frame;
+	p->attackTicks = player->attackTicks;
+	p->life = player->life;
+	
+	// Only the neighbors mask is stored, models and transforms are derived from it
+	map->GetMasks((GLubyte *)(p + 1));
+	
+	EnemyState *e = (EnemyState *)(data + offset);
+	for (std::vector<Enemy *>::iterator it = world->enemies.begin(); it != world->enemies.end(); ++it, ++e)
+	{
+		e->position = (*it)->position;
+		e->direction = (*it)->direction;
+		e->decisionTick = world->wheel.GetRemaining((*it)->decision);
+		e->speakTick = world->wheel.GetRemaining((*it)->speak);
+		e->animation = (*it)->animation;
+		e->frame = (*it)->frame;
+		e->animationTick = world->wheel.GetRemaining((*it)->animate);
+	}
+	
+	bool saved = File::WriteAll(filename, data, size);
+	delete[] data;
+	return saved;
+}
+
+bool Snapshot::Load(const char *filename, World **world)
+{
+	Memory::Scope scope(Memory::ENEMIES);
+	MappedFile *file = MappedFile::Open(filename);
+	if (!file) return false;
+	
+	const Header *header = (const Header *)file->data;
+	if (file->size < sizeof(Header) || memcmp(header->magic, "LD00", 4) || header->version != SNAPSHOT_VERSION ||
+		header->size.x <= 0 || header->size.y <= 0 || header->cells != (GLuint)header->size.x * header->size.y ||
+		file->size != GetEnemiesOffset(header->cells) + header->enemies * sizeof(EnemyState))
+	{
+		Pointer::Delete(file);
+		return false;
+	}
+	
+	World *w = new World(Map::Create((const GLubyte *)file->data + sizeof(Header) + sizeof(PlayerState), header->size, header->origin), header->random);
+	
+	const EnemyState *e = (const EnemyState *)(file->data + GetEnemiesOffset(header->cells));
+	w->enemies.reserve(header->enemies);
+	for (GLuint i = 0; i < header->enemies; ++i, ++e)
+	{
+		Enemy *enemy = new Enemy(*w, e->position);
+		enemy->direction = e->direction;
+		// Saved as remaining ticks, 0 when the event is not scheduled
+		const GLushort ticks[] = { e->decisionTick, e->speakTick, e->animationTick };
+		Timer *timers[] = { &enemy->decision, &enemy->speak, &enemy->animate };
+		for (GLuint t = 0; t < 3; ++t)
+		{
+			if (ticks[t]) w->wheel.Schedule(*timers[t], ticks[t]);
+			else timers[t]->Unlink();
+		}
+		enemy->animation = e->animation;
+		enemy->frame = e->frame;
+		enemy->id = i;
+		w->enemies.push_back(enemy);
+		
+		Block *block = w->map->GetBlock(enemy->position);
+		if (block) block->enemies.Add(enemy);
+	}
+	
+	w->Reserve();
+	
+	// Creating the enemies drew numbers, the saved generator continues where it was
+	w->random.state = header->random;
+	
+	const PlayerState *p = (const PlayerState *)(header + 1);
+	Player *pl = w->AddPlayer(p->position, p->angle);
+	pl->moving = p->moving;
+	pl->frame = p->frame;
+	pl->attackTicks = p->attackTicks;
+	pl->life = p->life;
+	
+	Pointer::Delete(file);
+	*world = w;
+	return true;
+}
+
+bool Address::operator==(const Address &o) const { return host == o.host && port == o.port; }
+
+bool Address::Resolve(const char *text, Address &address)
+{
+	// "host:port", the port is optional
+	std::string host = text;
+	size_t colon = host.rfind(':');
+	address.port = NET_PORT;
+	if (colon != std::string::npos)
+	{
+		address.port = (GLushort)atoi(host.c_str() + colon + 1);
+		host.resize(colon);
+	}
+	if (!Socket::Startup()) return false;
+	
+	addrinfo hints, *result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host.empty() ? "127.0.0.1" : host.c_str(), NULL, &hints, &result)) return false;
+	address.host = ((sockaddr_in *)result->ai_addr)->sin_addr.s_addr;
+	freeaddrinfo(result);
+	return true;
+}
+
+bool Socket::Startup()
+{
+#ifdef _WIN32
+	static bool started = false;
+	WSADATA data;
+	if (!started) started = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+	return started;
+#else
+	return true;
+#endif
+}
+
+Socket *Socket::Open(GLushort port)
+{
+	if (!Startup()) return NULL;
+	
+#ifdef _WIN32
+	SOCKET id = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (id == INVALID_SOCKET) return NULL;
+	u_long nonBlocking = 1;
+	ioctlsocket(id, FIONBIO, &nonBlocking);
+#else
+	int id = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (id < 0) return NULL;
+	fcntl(id, F_SETFL, fcntl(id, F_GETFL) | O_NONBLOCK);
+#endif
+	
+	// Snapshots for every client leave in the same tick, larger buffers absorb the burst
+	int buffer = 1 << 20;
+	setsockopt(id, SOL_SOCKET, SO_RCVBUF, (const char *)&buffer, sizeof(buffer));
+	setsockopt(id, SOL_SOCKET, SO_SNDBUF, (const char *)&buffer, sizeof(buffer));
+	
+	sockaddr_in local;
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	local.sin_port = htons(port);
+	
+	Socket *s = new Socket(id);
+	if (bind(id, (sockaddr *)&local, sizeof(local))) Pointer::Delete(s);
+	return s;
+}
+
+#ifdef _WIN32
+Socket::Socket(SOCKET _id) : id(_id) {}
+Socket::~Socket() { closesocket(id); }
+#else
+Socket::Socket(int _id) : id(_id) {}
+Socket::~Socket() { close(id); }
+#endif
+
+bool Socket::Send(const Address &to, const void *data, GLuint size)
+{
+	sockaddr_in remote;
+	memset(&remote, 0, sizeof(remote));
+	remote.sin_family = AF_INET;
+	remote.sin_addr.s_addr = to.host;
+	remote.sin_port = htons(to.port);
+	return sendto(id, (const char *)data, size, 0, (sockaddr *)&remote, sizeof(remote)) == (int)size;
+}
+
+int Socket::Receive(Address &from, void *data, GLuint size)
+{
+	// Non blocking, -1 when nothing is pending
+	sockaddr_in remote;
+	socklen_t length = sizeof(remote);
+	int received = recvfrom(id, (char *)data, size, 0, (sockaddr *)&remote, &length);
+	if (received < 0) return -1;
+	from.host = remote.sin_addr.s_addr;
+	from.port = ntohs(remote.sin_port);
+	return received;
+}
+
+Packet::Packet() : size(0), read(0), overflow(false) {}
+
+// Fields are copied in native byte order, like the snapshot files
+template<typename T>
+inline void Packet::Write(const T &value)
+{
+	if (size + sizeof(T) > NET_PACKET_SIZE)
+	{
+		overflow = true;
+		return;
+	}
+	memcpy(data + size, &value, sizeof(T));
+	size += sizeof(T);
+}
+
+template<typename T>
+inline T Packet::Read()
+{
+	T value = T();
+	if (read + sizeof(T) > size)
+	{
+		overflow = true;
+		return value;
+	}
+	memcpy(&value, data + read, sizeof(T));
+	read += sizeof(T);
+	return value;
+}
+
+void Net::Entity::Set(GLushort _id, const glm::vec3 &position, GLubyte _animation, GLubyte _frame)
+{
+	id = _id;
+	x = (short)floor(position.x * NET_POSITION_SCALE + 0.5f);
+	z = (short)floor(position.z * NET_POSITION_SCALE + 0.5f);
+	animation = _animation;
+	frame = _frame;
+}
+
+bool Net::Entity::operator<(const Entity &o) const { return id < o.id; }
+
+Socket *Server::socket = NULL;
+World *Server::world = NULL;
+Server::Client *Server::clients[NET_MAX_CLIENTS];
+GLubyte *Server::masks = NULL;
+GLuint Server::cells = 0;
+GLuint Server::sequence = 0;
+GLuint Server::tickMicros = 0;
+
+int Server::Start(GLushort port, GLuint size, GLuint enemies, GLuint seconds)
+{
+	socket = Socket::Open(port);
+	if (!socket)
+	{
+		std::cerr << "Failed to opening UDP port " << port << std::endl;
+		return 70;
+	}
+	
+	// Enemy ids are sent on 15 bits, the high bit tags the players
+	world = World::Generate(size, glm::min<GLuint>(enemies, NET_PLAYER_ENTITY), time(0), std::thread::hardware_concurrency());
+	Map *map = world->map;
+	cells = map->size.x * map->size.y;
+	masks = new GLubyte[cells];
+	map->GetMasks(masks);
+	
+	std::cout << "server: port " << port << ", " << map->size.x << "x" << map->size.y << " map, " << world->enemies.size() << " enemies, " << NET_TICK_RATE << " ticks/s" << std::endl;
+	
+	// Fixed rate, a late tick is caught up by sleeping less on the next ones
+	const std::chrono::microseconds period(1000000 / NET_TICK_RATE);
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+	double total = 0, worst = 0;
+	
+	while (!seconds || world->tick < seconds * NET_TICK_RATE)
+	{
+		Receive();
+		
+		double begin = Clock::Milliseconds();
+		Tick();
+		double elapsed = Clock::Milliseconds() - begin;
+		total += elapsed;
+		worst = glm::max(worst, elapsed);
+		
+		if (world->tick % NET_TICK_RATE == 0)
+		{
+			GLuint players = 0, bytes = 0;
+			for (GLuint i = 0; i < NET_MAX_CLIENTS; ++i)
+			{
+				if (!clients[i]) continue;
+				++players;
+				bytes += clients[i]->bytes;
+				clients[i]->bytes = 0;
+			}
+			
+			// The average is also sent in the snapshots so the clients can report it
+			tickMicros = (GLuint)(total * 1000 / NET_TICK_RATE);
+			std::cout << "  " << players << " players, tick " << tickMicros << " us (max " << (GLuint)(worst * 1000) << " us), ai " << (GLuint)(world->aiMilliseconds * 1000 / NET_TICK_RATE) << " us, ";
+			std::cout << "near " << world->tiers[LOD_NEAR] / NET_TICK_RATE << ", mid " << world->tiers[LOD_MID] / NET_TICK_RATE << ", far " << world->tiers[LOD_FAR] / NET_TICK_RATE << " enemies, " << (players ? bytes / players : 0) << " B/s per client, heap " << Memory::TOTAL.live / 1024 << " KB" << std::endl;
+			total = worst = 0;
+			world->aiMilliseconds = 0;
+			memset(world->tiers, 0, sizeof(world->tiers));
+		}
+		
+		next += period;
+		std::this_thread::sleep_until(next);
+	}
+	
+	for (GLuint i = 0; i < NET_MAX_CLIENTS; ++i) if (clients[i]) Remove(clients[i]);
+	Memory::Report(std::cout, "at the end of the run");
+	
+	delete[] masks;
+	masks = NULL;
+	Pointer::Delete(socket);
+	Pointer::Delete(world);
+	return 0;
+}
+
+Server::Client *Server::Find(const Address &address)
+{
+	for (GLuint i = 0; i < NET_MAX_CLIENTS; ++i) if (clients[i] && clients[i]->address == address) return clients[i];
+	return NULL;
+}
+
+Server::Client *Server::Add(const Address &address)
+{
+	for (GLuint i = 0; i < NET_MAX_CLIENTS; ++i)
+	{
+		if (clients[i]) continue;
+		
+		Client *client = new Client();
+		client->address = address;
+		client->id = i;
+		client->player = world->AddPlayer(glm::vec3(0, 0, 0), 0);
+		client->acked = NET_NO_BASELINE;
+		client->heard = world->tick;
+		client->bytes = 0;
+		for (GLuint h = 0; h < NET_HISTORY; ++h) client->sequences[h] = NET_NO_BASELINE;
+		return clients[i] = client;
+	}
+	return NULL;
+}
+
+void Server::Remove(Client *client)
+{
+	clients[client->id] = NULL;
+	world->RemovePlayer(client->player);
+	delete client;
+}
+
+void Server::Receive()
+{
+	Packet packet;
+	Address from;
+	
+	for (int size; (size = socket->Receive(from, packet.data, NET_PACKET_SIZE)) > 0;)
+	{
+		packet.size = size;
+		packet.read = 0;
+		packet.overflow = false;
+		
+		GLubyte type = packet.Read<GLubyte>();
+		Client *client = Find(from);
+		
+		if (type == Net::CONNECT)
+		{
+			// Answered again if the welcome was lost
+			if (!client) client = Add(from);
+			if (!client) continue;
+			
+			Packet welcome;
+			welcome.Write<GLubyte>(Net::WELCOME);
+			welcome.Write(client->id);
+			welcome.Write(world->map->size);
+			welcome.Write(world->map->origin);
+			Send(client, welcome);
+		}
+		else if (!client) continue;
+		else if (type == Net::MAP_REQUEST)
+		{
+			// The map is sent as the snapshot masks, one chunk per request
+			GLuint offset = packet.Read<GLuint>();
+			if (packet.overflow || offset >= cells) continue;
+			
+			GLushort length = (GLushort)glm::min<GLuint>(cells - offset, NET_MAP_CHUNK);
+			Packet chunk;
+			chunk.Write<GLubyte>(Net::MAP_CHUNK);
+			chunk.Write(offset);
+			chunk.Write(length);
+			memcpy(chunk.data + chunk.size, masks + offset, length);
+			chunk.size += length;
+			Send(client, chunk);
+		}
+		else if (type == Net::INPUT)
+		{
+			GLuint acked = packet.Read<GLuint>();
+			GLubyte buttons = packet.Read<GLubyte>();
+			if (packet.overflow) continue;
+			
+			// Inputs may arrive out of order, the acknowledgment never goes back
+			if (acked != NET_NO_BASELINE && (client->acked == NET_NO_BASELINE || acked > client->acked)) client->acked = acked;
+			client->player->buttons = buttons;
+			client->heard = world->tick;
+		}
+		else if (type == Net::DISCONNECT) Remove(client);
+	}
 }
 
-bool Point::operator==(const Point &o) const
+void Server::Tick()
 {
-	return *((int*)this) == *((int*)&o);
+	for (GLuint i = 0; i < NET_MAX_CLIENTS; ++i)
+		if (clients[i] && world->tick - clients[i]->heard > NET_TIMEOUT_TICKS) Remove(clients[i]);
+	
+	// The last received buttons are held until the next input
+	world->Step();
+	
+	if (world->tick % NET_SNAPSHOT_TICKS) return;
+	
+	++sequence;
+	for (GLuint i = 0; i < NET_MAX_CLIENTS; ++i) if (clients[i]) SendSnapshot(clients[i]);
 }
 
-Player *Player::INSTANCE = NULL;
-Player::Player(glm::vec3 _position, float _angle) : position(_position), angle(_angle), look(glm::vec3(glm::cos(angle), 0, glm::sin(angle))), frame(1), attackTicks(0), moving(0) {}
-
-void Player::CheckInput()
+void Server::Gather(Client *client, std::vector<Net::Entity> &entities)
 {
-	char moveMask = Input::KEYBOARD[SDL_SCANCODE_W] || Input::KEYBOARD[SDL_SCANCODE_UP];
-	moveMask |= (Input::KEYBOARD[SDL_SCANCODE_S] || Input::KEYBOARD[SDL_SCANCODE_DOWN]) << 1;
-	moveMask |= Input::KEYBOARD[SDL_SCANCODE_A] << 2;
-	moveMask |= Input::KEYBOARD[SDL_SCANCODE_D] << 3;
+	entities.clear();
 	
-	if (moveMask & 1) Map::INSTANCE->Move(position, look * PLAYER_SPEED);
-	else if (moveMask & 2) Map::INSTANCE->Move(position, look * -PLAYER_SPEED);
+	Map *map = world->map;
+	GLint cell = map->GetCell(client->player->position);
+	if (cell < 0) return;
+	int cx = cell % map->size.x;
+	int cy = cell / map->size.x;
+	int distance = Config::CURRENT.visibleDistance;
+	Net::Entity entity;
 	
-	if (moveMask & 4) Map::INSTANCE->Move(position, glm::vec3(look.z * PLAYER_SPEED, 0, look.x * -PLAYER_SPEED));
-	else if (moveMask & 8) Map::INSTANCE->Move(position, glm::vec3(look.z * -PLAYER_SPEED, 0, look.x * PLAYER_SPEED));
-	
-	if (Input::KEYBOARD[SDL_SCANCODE_LEFT])
-	{
-		angle -= PLAYER_ANGLE_SPEED;
-		look.x = glm::cos(angle);
-		look.z = glm::sin(angle);
-	}
-	else if (Input::KEYBOARD[SDL_SCANCODE_RIGHT])
+	// The other players in range go first, they are never dropped for enemies
+	for (GLuint i = 0; i < NET_MAX_CLIENTS; ++i)
 	{
-		angle += PLAYER_ANGLE_SPEED;
-		look.x = glm::cos(angle);
-		look.z = glm::sin(angle);
+		Client *other = clients[i];
+		if (!other || other == client) continue;
+		
+		GLint c = map->GetCell(other->player->position);
+		if (c < 0 || abs(c % map->size.x - cx) > distance || abs(c / map->size.x - cy) > distance) continue;
+		entity.Set(NET_PLAYER_ENTITY | other->id, other->player->position, 0, 0);
+		entities.push_back(entity);
 	}
 	
-	if (moveMask)
+	size_t players = entities.size();
+	
+	// Interest management, only the enemies in the cells around the player are replicated
+	for (int y = glm::max(cy - distance, 0), ey = glm::min(cy + distance, map->size.y - 1); y <= ey; ++y)
 	{
-		moving += 0.25f;
-		position.y = glm::cos(moving) * 0.05f;
+		for (int x = glm::max(cx - distance, 0), ex = glm::min(cx + distance, map->size.x - 1); x <= ex; ++x)
+		{
+			Block *b = map->blocks[y * map->size.x + x];
+			if (b == NULL) continue;
+			
+			for (Enemy *enemy = b->enemies.first; enemy; enemy = enemy->nextInBlock)
+			{
+				entity.Set(enemy->id, enemy->position, enemy->animation, enemy->frame);
+				entities.push_back(entity);
+			}
+		}
 	}
 	
-	if (attackTicks > 1)
+	// Over the budget the players are kept first and the nearest enemies fill the rest
+	if (entities.size() > NET_MAX_ENTITIES)
 	{
-		--attackTicks;
-		return;
+		Net::Entity self;
+		self.Set(0, client->player->position, 0, 0);
+		auto nearer = [&](const Net::Entity &a, const Net::Entity &b)
+		{
+			int ax = a.x - self.x, az = a.z - self.z, bx = b.x - self.x, bz = b.z - self.z;
+			return (long long)ax * ax + (long long)az * az < (long long)bx * bx + (long long)bz * bz;
+		};
+		std::vector<Net::Entity>::iterator first = entities.begin(), last = entities.end();
+		if (players < NET_MAX_ENTITIES) first += players;
+		else last = first + players;
+		std::nth_element(first, entities.begin() + NET_MAX_ENTITIES, last, nearer);
+		entities.resize(NET_MAX_ENTITIES);
 	}
 	
-	frame = 1;
+	// Only the kept set is sorted by id so the deltas are a merge of two lists
+	std::sort(entities.begin(), entities.end());
+}
+
+void Server::SendSnapshot(Client *client)
+{
+	static const std::vector<Net::Entity> EMPTY;
 	
-	if (attackTicks == 1 && Input::KEYBOARD[SDL_SCANCODE_SPACE]) return;
+	GLuint slot = sequence % NET_HISTORY;
+	std::vector<Net::Entity> &current = client->history[slot];
+	client->sequences[slot] = sequence;
+	Gather(client, current);
 	
-	attackTicks = 0;
+	// Delta against the last snapshot acknowledged by the client, a full one if it is too old
+	GLuint baseline = client->acked;
+	if (baseline != NET_NO_BASELINE && (sequence - baseline >= NET_HISTORY || client->sequences[baseline % NET_HISTORY] != baseline)) baseline = NET_NO_BASELINE;
+	const std::vector<Net::Entity> &base = baseline == NET_NO_BASELINE ? EMPTY : client->history[baseline % NET_HISTORY];
+	
+	Player *player = client->player;
+	Packet packet;
+	packet.Write<GLubyte>(Net::SNAPSHOT);
+	packet.Write(sequence);
+	packet.Write(baseline);
+	packet.Write(tickMicros);
+	packet.Write(player->position);
+	packet.Write(player->angle);
+	packet.Write<GLubyte>(player->frame);
+	packet.Write<GLushort>(player->life);
+	
+	GLuint counts = packet.size;
+	GLushort removed = 0, changed = 0;
+	packet.Write(removed);
+	packet.Write(changed);
 	
-	if (Input::KEYBOARD[SDL_SCANCODE_SPACE])
+	// Ids of the entities which left, then the new and changed entities with only their changed fields
+	for (GLuint i = 0, j = 0; i < base.size(); ++i)
 	{
-		Sound::CROWBAR->Play();
-		
-		attackTicks = PLAYER_ATTACK_TICKS;
-		frame = 2;
-		
-		bool hit = false;
+		while (j < current.size() && current[j].id < base[i].id) ++j;
+		if (j < current.size() && current[j].id == base[i].id) continue;
+		packet.Write(base[i].id);
+		++removed;
+	}
+	
+	for (GLuint i = 0, j = 0; j < current.size(); ++j)
+	{
+		const Net::Entity &e = current[j];
+		while (i < base.size() && base[i].id < e.id) ++i;
 		
-		for (int z = position.z - Map::INSTANCE->origin.y + 0.5f - 1, ez = z + 2; z <= ez; ++z)
+		GLubyte fields = Net::FIELD_X | Net::FIELD_Z | Net::FIELD_ANIMATION | Net::FIELD_FRAME;
+		if (i < base.size() && base[i].id == e.id)
 		{
-			if (z < 0 || z >= Map::INSTANCE->size.y) continue;
-			
-			for (int x = position.x - Map::INSTANCE->origin.x + 0.5f - 1, ex = x + 2; x <= ex; ++x)
-			{
-				if (x < 0 || x >= Map::INSTANCE->size.x) continue;
-				
-				Block *b = Map::INSTANCE->blocks[z * Map::INSTANCE->size.x + x];
-				if (b == NULL) continue;
-				
-				for (int i = 0; i < b->enemies.size; ++i)
-				{
-					Enemy *enemy = b->enemies.data[i];
-					if (enemy->animation > 0) continue;
-					
-					glm::vec3 relative = enemy->position - position;
-					float dp = glm::dot(look, relative);
-					
-					if (dp > 0 && glm::length(relative) < HIT_DISTANCE)
-					{
-						enemy->PlayFallAnimation();
-						hit = true;
-					}
-				}
-			}
+			const Net::Entity &b = base[i];
+			fields = (e.x != b.x ? Net::FIELD_X : 0) | (e.z != b.z ? Net::FIELD_Z : 0) | (e.animation != b.animation ? Net::FIELD_ANIMATION : 0) | (e.frame != b.frame ? Net::FIELD_FRAME : 0);
+			if (!fields) continue;
 		}
 		
-		if (hit) Sound::HIT->Play();
+		packet.Write(e.id);
+		packet.Write(fields);
+		if (fields & Net::FIELD_X) packet.Write(e.x);
+		if (fields & Net::FIELD_Z) packet.Write(e.z);
+		if (fields & Net::FIELD_ANIMATION) packet.Write(e.animation);
+		if (fields & Net::FIELD_FRAME) packet.Write(e.frame);
+		++changed;
 	}
-	else if (!Input::KEYBOARD[SDL_SCANCODE_SPACE]) frame = 1;
+	
+	memcpy(packet.data + counts, &removed, sizeof(removed));
+	memcpy(packet.data + counts + sizeof(removed), &changed, sizeof(changed));
+	Send(client, packet);
+}
+
+void Server::Send(Client *client, const Packet &packet)
+{
+	if (socket->Send(client->address, packet.data, packet.size)) client->bytes += packet.size;
+}
+
+Connection::Connection(Socket *_socket, const Address &_server) : server(_server), id(0), masks(NULL), sequence(NET_NO_BASELINE), position(0), angle(0), frame(1), life(PLAYER_LIFES), bytesReceived(0), bytesSent(0), snapshots(0), errors(0), serverMicros(0), socket(_socket)
+{
+	for (GLuint h = 0; h < NET_HISTORY; ++h) sequences[h] = NET_NO_BASELINE;
 }
 
-void Player::Draw()
+Connection::~Connection()
 {
-	Model::ENEMY->Bind();
+	Packet packet;
+	packet.Write<GLubyte>(Net::DISCONNECT);
+	Send(packet);
 	
-	glUniformMatrix4fv(0, 1, GL_FALSE, (float *)&Mat4::IDENTITY);
-	glUniformMatrix4fv(1, 1, GL_FALSE, (float *)&Mat4::HAND);
-	glUniformMatrix4fv(2, 1, GL_FALSE, (float *)&Mat4::IDENTITY);
-	glUniform1i(3, 2);
-	glUniform1i(4, frame);
-	glDrawArrays(GL_TRIANGLES, 0, Model::ENEMY->count);
-	Model::ENEMY->Unbind();
+	for (std::vector<Enemy *>::iterator it = entities.begin(); it != entities.end(); ++it) Pointer::Delete(*it);
+	delete[] masks;
+	Pointer::Delete(socket);
 }
 
-Enemy::Enemy(glm::vec3 _position) : position(_position)
+Connection *Connection::Open(const Address &server, bool download, GLuint timeout)
 {
-	decisionTick = ENEMY_DECISIONS_TICKS;
-	animationTick = ENEMY_ANIMATION_TICKS;
-	animation = 0;
-	frame = 0;
-	SetDirection();
-	speakTick = Random::GetNumber<GLushort>(ENEMY_SPEAK_MIN_TICKS, ENEMY_SPEAK_MAX_TICKS);
-	source = new Sound(SoundBuffer::ENEMY);
+	Socket *socket = Socket::Open(0);
+	if (!socket) return NULL;
+	Connection *connection = new Connection(socket, server);
+	
+	// Handshake then map download, each request is resent until it is answered
+	GLuint offset = 0, cells = 0;
+	bool welcomed = false;
+	double begin = Clock::Milliseconds(), resend = 0;
+	Packet packet;
+	Address from;
+	
+	while (Clock::Milliseconds() - begin < timeout)
+	{
+		if (Clock::Milliseconds() >= resend)
+		{
+			Packet request;
+			request.Write<GLubyte>(welcomed ? Net::MAP_REQUEST : Net::CONNECT);
+			if (welcomed) request.Write(offset);
+			connection->Send(request);
+			resend = Clock::Milliseconds() + NET_RESEND_MILLISECONDS;
+		}
+		
+		int received = socket->Receive(from, packet.data, NET_PACKET_SIZE);
+		if (received <= 0 || !(from == server))
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+		
+		connection->bytesReceived += received;
+		packet.size = received;
+		packet.read = 0;
+		packet.overflow = false;
+		GLubyte type = packet.Read<GLubyte>();
+		
+		if (type == Net::WELCOME && !welcomed)
+		{
+			connection->id = packet.Read<GLushort>();
+			connection->size = packet.Read<Point>();
+			connection->origin = packet.Read<Point>();
+			if (packet.overflow || connection->size.x <= 0 || connection->size.y <= 0) break;
+			
+			welcomed = true;
+			if (!download) return connection;
+			
+			cells = connection->size.x * connection->size.y;
+			connection->masks = new GLubyte[cells];
+			resend = 0;
+		}
+		else if (type == Net::MAP_CHUNK && welcomed && download)
+		{
+			GLuint at = packet.Read<GLuint>();
+			GLushort length = packet.Read<GLushort>();
+			if (packet.overflow || at != offset || at + length > cells || packet.read + length > packet.size) continue;
+			
+			memcpy(connection->masks + offset, packet.data + packet.read, length);
+			offset += length;
+			resend = 0;
+			if (offset == cells) return connection;
+		}
+	}
+	
+	delete connection;
+	return NULL;
 }
 
-Enemy::~Enemy()
+void Connection::Send(const Packet &packet)
 {
-	Pointer::Delete(source);
+	if (socket->Send(server, packet.data, packet.size)) bytesSent += packet.size;
 }
 
-void Enemy::SetDirection()
+void Connection::SendInput(GLuint buttons)
 {
-	direction.x = Random::GetNumber<float>(-ENEMY_SPEED, ENEMY_SPEED);
-	direction.z = Random::GetNumber<float>(-ENEMY_SPEED, ENEMY_SPEED);
-	decisionTick = Random::GetNumber<GLuint>(0, ENEMY_DECISIONS_TICKS);
+	// Every input also acknowledges the last decoded snapshot, the next deltas are built on it
+	Packet packet;
+	packet.Write<GLubyte>(Net::INPUT);
+	packet.Write(sequence);
+	packet.Write<GLubyte>(buttons);
+	Send(packet);
 }
 
-void Enemy::PlayFallAnimation()
+bool Connection::Receive()
 {
-	frame = 0;
-	animation = 1;
-	animationTick = ENEMY_ANIMATION_FALL_FRAMES;
+	bool updated = false;
+	Packet packet;
+	Address from;
+	
+	for (int received; (received = socket->Receive(from, packet.data, NET_PACKET_SIZE)) > 0;)
+	{
+		if (!(from == server)) continue;
+		
+		bytesReceived += received;
+		packet.size = received;
+		packet.read = 0;
+		packet.overflow = false;
+		if (packet.Read<GLubyte>() == Net::SNAPSHOT && Decode(packet)) updated = true;
+	}
+	return updated;
 }
 
-void Enemy::Update()
+bool Connection::Decode(Packet &packet)
 {
-	if (animation == 2) return;
+	static const std::vector<Net::Entity> EMPTY;
+	
+	GLuint current = packet.Read<GLuint>();
+	GLuint baseline = packet.Read<GLuint>();
+	GLuint micros = packet.Read<GLuint>();
+	glm::vec3 p = packet.Read<glm::vec3>();
+	float a = packet.Read<float>();
+	GLubyte f = packet.Read<GLubyte>();
+	GLushort l = packet.Read<GLushort>();
+	GLushort removedCount = packet.Read<GLushort>();
+	GLushort changedCount = packet.Read<GLushort>();
+	if (packet.overflow || current == NET_NO_BASELINE)
+	{
+		++errors;
+		return false;
+	}
+	
+	// Late snapshots are dropped, a newer one already went past them
+	if (sequence != NET_NO_BASELINE && current <= sequence) return false;
 	
- 	if (animation == 1)
+	if (baseline != NET_NO_BASELINE && sequences[baseline % NET_HISTORY] != baseline)
 	{
-		if (--animationTick == 0)
+		++errors;
+		return false;
+	}
+	const std::vector<Net::Entity> &base = baseline == NET_NO_BASELINE ? EMPTY : history[baseline % NET_HISTORY];
+	
+	removed.clear();
+	for (GLuint i = 0; i < removedCount; ++i) removed.push_back(packet.Read<GLushort>());
+	
+	changed.clear();
+	for (GLuint i = 0; i < changedCount; ++i)
+	{
+		Net::Entity e;
+		e.id = packet.Read<GLushort>();
+		GLubyte fields = packet.Read<GLubyte>();
+		
+		// Fields that did not change come from the same entity in the baseline
+		const Net::Entity *b = NULL;
+		if (fields != (Net::FIELD_X | Net::FIELD_Z | Net::FIELD_ANIMATION | Net::FIELD_FRAME))
 		{
-			if (frame++ == ENEMY_ANIMATION_FALL_FRAMES)
+			std::vector<Net::Entity>::const_iterator it = std::lower_bound(base.begin(), base.end(), e);
+			if (it == base.end() || it->id != e.id)
 			{
-				animation = 2;
-				frame = 0;
+				++errors;
+				return false;
 			}
-			animationTick = ENEMY_ANIMATION_TICKS;
+			b = &*it;
 		}
-		return;
+		
+		e.x = fields & Net::FIELD_X ? packet.Read<short>() : b->x;
+		e.z = fields & Net::FIELD_Z ? packet.Read<short>() : b->z;
+		e.animation = fields & Net::FIELD_ANIMATION ? packet.Read<GLubyte>() : b->animation;
+		e.frame = fields & Net::FIELD_FRAME ? packet.Read<GLubyte>() : b->frame;
+		changed.push_back(e);
 	}
-	
-	if (--speakTick == 0)
+	if (packet.overflow)
 	{
-		speakTick = Random::GetNumber<GLushort>(ENEMY_SPEAK_MIN_TICKS, ENEMY_SPEAK_MAX_TICKS);
-		source->Play();
+		++errors;
+		return false;
 	}
-	if (--decisionTick == 0) SetDirection();
-	if (--animationTick == 0)
+	
+	// Merge the baseline with the changes, everything stays sorted by id
+	GLuint slot = current % NET_HISTORY;
+	std::vector<Net::Entity> &out = history[slot];
+	out.clear();
+	for (GLuint i = 0, j = 0, k = 0; i < base.size() || j < changed.size();)
 	{
-		frame = (frame + 1) % ENEMY_ANIMATION_WALK_FRAMES;
-		animationTick = ENEMY_ANIMATION_TICKS;
+		if (j < changed.size() && (i == base.size() || changed[j].id <= base[i].id))
+		{
+			if (i < base.size() && changed[j].id == base[i].id) ++i;
+			out.push_back(changed[j++]);
+			continue;
+		}
+		
+		while (k < removed.size() && removed[k] < base[i].id) ++k;
+		if (k == removed.size() || removed[k] != base[i].id) out.push_back(base[i]);
+		++i;
 	}
 	
-	Map::INSTANCE->Move(position, direction);
-}
-
-template<GLuint chunk, GLuint ptrSize = sizeof(void *)>
-EnemyList<chunk, ptrSize>::EnemyList()
-{
-	data = new Enemy*[chunk];
-	capacity = chunk;
-	size = 0;
+	sequences[slot] = current;
+	sequence = current;
+	serverMicros = micros;
+	position = p;
+	angle = a;
+	frame = f;
+	life = l;
+	++snapshots;
+	return true;
 }
 
-template<GLuint chunk, GLuint ptrSize = sizeof(void *)>
-EnemyList<chunk, ptrSize>::~EnemyList() { Array::Delete((void **)data, 0); }
-
-template<GLuint chunk, GLuint ptrSize = sizeof(void *)>
-void EnemyList<chunk, ptrSize>::Add(Enemy *enemy)
+void Connection::Apply(World &world)
 {
-	GLuint last = size;
+	Memory::Scope scope(Memory::ENEMIES);
+	Map *map = world.map;
+	if (sequence == NET_NO_BASELINE) return;
+	if (entities.empty()) entities.resize(0x10000, NULL);
+	const std::vector<Net::Entity> &current = history[sequence % NET_HISTORY];
 	
-	if (++size >= capacity)
+	// Entities that left the interest area are dropped
+	Net::Entity key;
+	for (std::vector<GLushort>::iterator it = visible.begin(); it != visible.end(); ++it)
 	{
-		capacity += chunk;
-		Enemy **newData = new Enemy*[capacity];
-		memcpy(newData, data, last * ptrSize);
-		Array::Delete((void **)data, 0);
-		data = newData;
+		key.id = *it;
+		if (std::binary_search(current.begin(), current.end(), key)) continue;
+		
+		Enemy *&enemy = entities[*it];
+		Block *block = map->GetBlock(enemy->position);
+		if (block) block->enemies.Remove(enemy);
+		Pointer::Delete(enemy);
 	}
+	visible.clear();
 	
-	data[last] = enemy;
-}
-
-template<GLuint chunk, GLuint ptrSize = sizeof(void *)>
-void EnemyList<chunk, ptrSize>::Remove(GLuint index)
-{
-	if (size == 0 || index < 0 || index >= size) return;
-	
-	Enemy **dst = data + index;
-	memmove(dst, dst + 1, (--size - index) * ptrSize);
+	// The others are mirrored as enemies in the block lists, so the map draws them as usual
+	for (std::vector<Net::Entity>::const_iterator it = current.begin(); it != current.end(); ++it)
+	{
+		glm::vec3 position(it->x / NET_POSITION_SCALE, 0, it->z / NET_POSITION_SCALE);
+		Enemy *&enemy = entities[it->id];
+		if (!enemy)
+		{
+			enemy = new Enemy(world, position);
+			enemy->id = it->id;
+			Block *block = map->GetBlock(position);
+			if (block) block->enemies.Add(enemy);
+		}
+		else map->Relocate(enemy, position);
+		
+		enemy->animation = it->animation;
+		enemy->frame = it->frame;
+		visible.push_back(it->id);
+	}
 }
 
-Block::Block(Model *_model, glm::mat4 _transform) : model(_model), transform(_transform) {}
-Block::~Block() {}
-
-void Block::Draw()
+int Connection::RunBots(const Address &server, GLuint count, GLuint seconds)
 {
-	glUniform1i(3, 0);
-	glUniform1i(4, 0);
+	std::vector<Connection *> bots;
+	std::vector<GLuint> buttons;
+	Random random(time(0));
+	GLuint step = glm::max<GLuint>(1, count / NET_BOT_STEPS);
+	std::cout << "bots: " << count << " clients, " << step << " more every " << NET_BOT_RAMP_MILLISECONDS << " ms, " << seconds << " s" << std::endl;
 	
-	model->Bind();
-	glUniformMatrix4fv(0, 1, GL_FALSE, (float *)&transform);
-	glDrawArrays(GL_TRIANGLES, 0, model->count);
-	model->Unbind();
+	const std::chrono::microseconds period(1000000 / NET_TICK_RATE);
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+	double begin = Clock::Milliseconds(), join = begin, report = begin + 1000, last = begin;
+	int exit = 0;
 	
-	for (GLuint i = 0; i < enemies.size;)
+	for (GLuint tick = 0; Clock::Milliseconds() - begin < seconds * 1000.0; ++tick)
 	{
-		Enemy *it = enemies.data[i];
-		it->Update();
-		
-		glm::vec3 relative = Player::INSTANCE->position - it->position;
-		alSourcefv(it->source->id, AL_POSITION, (float *)&relative);
-		alSourcefv(it->source->id, AL_DIRECTION, (float *)&relative);
-		
-		Model::ENEMY->Bind();
-		glm::mat4 uModel = glm::rotate(glm::translate(Mat4::IDENTITY, it->position), (float)atan2(relative.x, relative.z), glm::vec3(0, 1, 0));
-		glUniformMatrix4fv(0, 1, GL_FALSE, (float *)&uModel);
-		glUniform1i(3, it->animation);
-		glUniform1i(4, it->frame);
-		glDrawArrays(GL_TRIANGLES, 0, Model::ENEMY->count);
-		Model::ENEMY->Unbind();
+		double now = Clock::Milliseconds();
+		if (bots.size() < count && now >= join)
+		{
+			for (GLuint i = 0; i < step && bots.size() < count; ++i)
+			{
+				Connection *bot = Open(server, false, NET_CONNECT_TIMEOUT);
+				if (!bot)
+				{
+					std::cerr << "Failed to connecting bot " << bots.size() << std::endl;
+					exit = 71;
+					break;
+				}
+				bots.push_back(bot);
+				buttons.push_back(0);
+			}
+			if (exit) break;
+			join += NET_BOT_RAMP_MILLISECONDS;
+		}
 		
-		Block *block = Map::INSTANCE->GetBlock(it->position);
+		// Random walk, each bot holds its buttons for half a second
+		for (GLuint i = 0; i < bots.size(); ++i)
+		{
+			if ((tick + i) % (NET_TICK_RATE / 2) == 0) buttons[i] = random.GetNumber<GLuint>(0, 127);
+			bots[i]->SendInput(buttons[i]);
+			bots[i]->Receive();
+		}
 		
-		if (block == this || block == NULL) ++i;
-		else
+		if (now >= report && bots.size())
 		{
-			block->enemies.Add(it);
-			enemies.Remove(i);
+			double elapsed = (now - last) / 1000.0;
+			double down = 0, up = 0, snapshots = 0;
+			GLuint errors = 0, micros = 0;
+			for (std::vector<Connection *>::iterator it = bots.begin(); it != bots.end(); ++it)
+			{
+				Connection *bot = *it;
+				down += bot->bytesReceived;
+				up += bot->bytesSent;
+				snapshots += bot->snapshots;
+				errors += bot->errors;
+				micros = glm::max(micros, bot->serverMicros);
+				bot->bytesReceived = bot->bytesSent = bot->snapshots = bot->errors = 0;
+			}
+			
+			GLuint players = bots.size();
+			std::cout << "  " << players << " players: " << (GLuint)(down / players / elapsed) << " B/s down, " << (GLuint)(up / players / elapsed) << " B/s up per client, " << snapshots / players / elapsed << " snapshots/s, server tick " << micros << " us, " << errors << " decode errors" << std::endl;
+			last = now;
+			report += 1000;
 		}
+		
+		next += period;
+		std::this_thread::sleep_until(next);
 	}
+	
+	for (std::vector<Connection *>::iterator it = bots.begin(); it != bots.end(); ++it) delete *it;
+	return exit;
 }
 
-Map *Map::INSTANCE = NULL;
-
-Map::Map(Block **blocks, const Point &size, const Point &origin)
-{
-	this->blocks = blocks;
-	this->size = size;
-	this->origin = origin;
-}
+Acoustics::Acoustics() : map(NULL), field(NULL), cell(-1) {}
 
-Map::~Map()
-{
-	Array::Delete((void **)blocks, size.x * size.y);
-	Array::Delete((void **)&enemies[0], enemies.size());
-}
+Acoustics::~Acoustics() { Pointer::Delete(field); }
 
-inline float Map::GetX(float x) { return x - origin.x + 0.5f; }
-inline float Map::GetY(float y) { return y - origin.y + 0.5f; }
-inline Block *Map::GetBlock(const glm::vec3 &position)
+void Acoustics::Listen(Map *_map, const glm::vec3 &_listener)
 {
-	int x = (int)GetX(position.x);
-	int y = (int)GetY(position.z);
-	return x < 0 || x >= size.x || y < 0 || y >= size.y ? NULL : blocks[y * size.x + x];
+	listener = _listener;
+	if (_map != map)
+	{
+		Pointer::Delete(field);
+		map = _map;
+		field = new NavField(map->size, AUDIO_RANGE);
+		cell = -1;
+	}
+	
+	// The propagation field only depends on the listener cell, it is rebuilt when the player crosses into another one
+	GLint c = map->GetCell(listener);
+	if (c == cell) return;
+	cell = c;
+	GLuint source = c;
+	field->Build(map->blocks, &source, c < 0 ? 0 : 1);
 }
 
-bool Map::CanMove(glm::vec3 &position, const glm::vec3 &direction)
+bool Acoustics::Evaluate(const glm::vec3 &emitter, Path &path)
 {
-	float x = position.x + direction.x;
-	float z = position.z + direction.z;
-	float hx = GetX(x) + (direction.x < 0 ? -HITBOX_SIZE : HITBOX_SIZE);
-	float hz = GetY(z) + (direction.z < 0 ? -HITBOX_SIZE : HITBOX_SIZE);
+	// Sound travels along the corridors, the path through the grid replaces the straight distance
+	GLint c = cell < 0 ? -1 : map->GetCell(emitter);
+	if (c < 0 || field->distance[c] == NAV_UNREACHED) return false;
+	
+	glm::vec3 delta = emitter - listener;
+	delta.y = 0;
+	float direct = glm::length(delta);
+	float length = glm::max((float)field->distance[c], direct);
+	path.gain = AUDIO_REFERENCE / (AUDIO_REFERENCE + AUDIO_ROLLOFF * glm::max(length - AUDIO_REFERENCE, 0.0f));
+	if (path.gain < AUDIO_MIN_GAIN) return false;
 	
-	if (hx < 0 || hx >= size.x || hz < 0 || hz >= size.y) return false;
-	if (blocks[(int)hz * size.x + (int)hx] == NULL) return false;
+	// Every cell of detour around the walls muffles the high frequencies a bit more
+	path.gainHF = glm::exp(-AUDIO_OCCLUSION * (length - direct));
 	
-	position.x = x;
-	position.z = z;
+	// The sound comes out of the corridor leading to the emitter, at its path distance
+	GLint first = c;
+	while (field->distance[first] > 1) first = field->GetNext(first);
+	glm::vec3 apparent = first == c ? delta : map->GetCenter(first) - listener;
+	apparent.y = 0;
+	float distance = glm::length(apparent);
+	path.position = distance > 0 ? listener + apparent * (length / distance) : listener;
 	return true;
 }
 
-void Map::Move(glm::vec3 &position, const glm::vec3 &direction)
+LPALGENFILTERS Audio::GenFilters = NULL;
+LPALDELETEFILTERS Audio::DeleteFilters = NULL;
+LPALFILTERI Audio::Filteri = NULL;
+LPALFILTERF Audio::Filterf = NULL;
+
+Audio::Audio(bool _efx) : efx(_efx)
 {
-	if (CanMove(position, direction)) return;
-	if (CanMove(position, glm::vec3(0, 0, direction.z))) return;
-	if (CanMove(position, glm::vec3(direction.x, 0, 0))) return;
+	// Attenuation comes from the grid, OpenAL only pans the voices
+	alDistanceModel(AL_NONE);
+	for (GLuint i = 0; i < AUDIO_VOICES; ++i)
+	{
+		Voice &voice = voices[i];
+		voice.sound = new Sound(SoundBuffer::ENEMY);
+		voice.filter = 0;
+		voice.emitter = NULL;
+		if (!efx) continue;
+		GenFilters(1, &voice.filter);
+		Filteri(voice.filter, AL_FILTER_TYPE, AL_FILTER_LOWPASS);
+	}
 }
 
-void Map::AddEnemies(GLuint number)
+Audio::~Audio()
 {
-	while (number)
+	for (GLuint i = 0; i < AUDIO_VOICES; ++i)
 	{
-		float x = Random::GetNumber<float>(0, size.x);
-		float z = Random::GetNumber<float>(0, size.y);
-		GLuint i = (int)z * size.x + (int)x;
-		if (blocks[i])
-		{
-			Enemy *enemy = new Enemy(glm::vec3(x + origin.x - 0.5, 0, z + origin.y - 0.5));
-			enemies.push_back(enemy);
-			blocks[i]->enemies.Add(enemy);
-			--number;
-		}
+		Pointer::Delete(voices[i].sound);
+		if (voices[i].filter) DeleteFilters(1, &voices[i].filter);
 	}
 }
 
-void Map::Draw()
+Audio *Audio::Create(ALCdevice *device)
 {
-#if TOP_VIEW_MODE==1
-	glm::mat4 uView = glm::lookAt(Player::INSTANCE->position, glm::vec3(Player::INSTANCE->position.x + Player::INSTANCE->look.x, 2, Player::INSTANCE->position.z + Player::INSTANCE->look.z), glm::vec3(0, 1, 0));
-#else
-	glm::mat4 uView = glm::lookAt(Player::INSTANCE->position, Player::INSTANCE->position + Player::INSTANCE->look, glm::vec3(0, 1, 0));
-#endif
+	if (!SoundBuffer::ENEMY) return NULL;
+	Memory::Scope scope(Memory::AUDIO);
 	
-	glUniformMatrix4fv(1, 1, GL_FALSE, (float *)&uView);
-	glUniformMatrix4fv(2, 1, GL_FALSE, (float *)&Mat4::PROJECTION);
+	// Without the EFX extension the occlusion can only lower the gain
+	bool efx = device && alcIsExtensionPresent(device, "ALC_EXT_EFX");
+	if (efx)
+	{
+		GenFilters = (LPALGENFILTERS)alGetProcAddress("alGenFilters");
+		DeleteFilters = (LPALDELETEFILTERS)alGetProcAddress("alDeleteFilters");
+		Filteri = (LPALFILTERI)alGetProcAddress("alFilteri");
+		Filterf = (LPALFILTERF)alGetProcAddress("alFilterf");
+		efx = GenFilters && DeleteFilters && Filteri && Filterf;
+	}
+	return new Audio(efx);
+}
+
+void Audio::Update(World &world, const Player *player)
+{
+	Memory::Scope scope(Memory::AUDIO);
+	float orientation[6] = { player->look.x, player->look.y, player->look.z, 0, 1, 0 };
+	alListenerfv(AL_POSITION, (float *)&player->position);
+	alListenerfv(AL_ORIENTATION, orientation);
+	acoustics.Listen(world.map, player->position);
 	
-	for (int z = Player::INSTANCE->position.z - origin.y + 0.5f - PLAYER_VISIBLE_DISTANCE, ez = z + (PLAYER_VISIBLE_DISTANCE << 1); z <= ez; ++z)
+	// Playing voices follow their emitter, finished or inaudible ones are released
+	Acoustics::Path path;
+	for (GLuint i = 0; i < AUDIO_VOICES; ++i)
 	{
-		if (z < 0 || z >= size.y) continue;
-		
-		for (int x = Player::INSTANCE->position.x - origin.x + 0.5f - PLAYER_VISIBLE_DISTANCE, ex = x + (PLAYER_VISIBLE_DISTANCE << 1); x <= ex; ++x)
+		Voice &voice = voices[i];
+		if (!voice.emitter) continue;
+		if (voice.sound->GetState() != AL_PLAYING || !acoustics.Evaluate(voice.emitter->position, path))
 		{
-			if (x < 0 || x >= size.x) continue;
-			
-			Block *b = blocks[z * size.x + x];
-			if (b != NULL) b->Draw();
+			voice.sound->Stop();
+			voice.emitter = NULL;
+			continue;
 		}
+		Apply(voice, path, false);
+	}
+	
+	// Inaudible speeches are culled, the others take a free voice or the quietest one
+	for (std::vector<Enemy *>::iterator it = world.speeches.begin(); it != world.speeches.end(); ++it)
+	{
+		if (!acoustics.Evaluate((*it)->position, path)) continue;
+		
+		Voice *voice = voices;
+		for (GLuint i = 1; i < AUDIO_VOICES && voice->emitter; ++i)
+			if (!voices[i].emitter || voices[i].path.gain < voice->path.gain) voice = &voices[i];
+		if (voice->emitter && voice->path.gain >= path.gain) continue;
+		
+		voice->sound->Stop();
+		voice->emitter = *it;
+		Apply(*voice, path, true);
+		voice->sound->Play();
 	}
 }
 
-Map *Map::Generate(GLuint size)
+void Audio::Reset()
 {
-	std::vector<Point> points;
-	const Point dirs[] = { { -1, 0 }, { 0, -1 }, { 1, 0 }, { 0, 1 } };
-	
-	Point p = { 0 };
-	points.push_back({0});
-	
-	short l = INT_MAX, r = INT_MIN, t = INT_MAX, b = INT_MIN;
-	
-	srand(time(0));
-	
-	while (points.size() < size)
+	// The emitters belonged to a world that is gone
+	for (GLuint i = 0; i < AUDIO_VOICES; ++i)
 	{
-		Point d = dirs[Random::GetNumber<GLuint>(0, 4)];
-		Point n = { p.x + d.x, p.y + d.y };
-		if (std::find(points.begin(), points.end(), n) == points.end())
+		voices[i].sound->Stop();
+		voices[i].emitter = NULL;
+	}
+	acoustics.map = NULL;
+}
+
+void Audio::Apply(Voice &voice, const Acoustics::Path &path, bool force)
+{
+	// Changes below the thresholds cannot be heard, skipping them saves the AL calls
+	if (force || glm::abs(path.gain - voice.path.gain) > AUDIO_GAIN_THRESHOLD || glm::abs(path.gainHF - voice.path.gainHF) > AUDIO_GAIN_THRESHOLD)
+	{
+		if (efx)
 		{
-			if (n.x < l) l = n.x;
-			else if (n.x > r) r = n.x;
-			if (n.y < t) t = n.y;
-			else if (n.y > b) b = n.y;
-			points.push_back(n);
+			voice.sound->SetVolume(path.gain);
+			Filterf(voice.filter, AL_LOWPASS_GAINHF, path.gainHF);
+			alSourcei(voice.sound->id, AL_DIRECT_FILTER, voice.filter);
 		}
-		*((int *)&p) = *((int *)&n);
+		else voice.sound->SetVolume(path.gain * (0.5f + 0.5f * path.gainHF));
+		voice.path.gain = path.gain;
+		voice.path.gainHF = path.gainHF;
+	}
+	if (force || glm::distance(path.position, voice.path.position) > AUDIO_POSITION_THRESHOLD)
+	{
+		alSourcefv(voice.sound->id, AL_POSITION, (float *)&path.position);
+		voice.path.position = path.position;
 	}
+}
+
+Point App::WindowSize;
+World *App::world = NULL;
+SpscQueue<Input::Event, INPUT_QUEUE_SIZE> App::events;
+TripleBuffer<Scene> App::scenes;
+std::atomic<bool> App::running(false);
+std::atomic<double> App::acknowledged(0);
+Connection *App::connection = NULL;
+Audio *App::audio = NULL;
+GLRenderer *App::renderer = NULL;
+GLuint App::filter = 0;
+Encoder *App::recorder = NULL;
+Encoder *App::screenshots = NULL;
+SDL_Window *App::window = NULL;
+SDL_GLContext App::videoContext = NULL;
+ALCcontext *App::audioContext = NULL;
+
+int App::Start()
+{
+	SDL_Event event;
 	
-	short w = glm::abs(l) + glm::abs(r) + 1;
-	short h = glm::abs(t) + glm::abs(b) + 1;
-	size = w * h;
-	Block **blocks = new Block*[size];
-	memset(blocks, 0, size * sizeof(void *));
+	// This thread keeps the window, the GL context and the events, the world is stepped by the simulation thread
+	running = true;
+	std::thread simulation(Simulate);
 	
-	for (std::vector<Point>::iterator beg = points.begin(), end = points.end(), it = beg; it != end; ++it)
+	GLuint shown = 0, frames = 0, samples = 0, dropped = 0;
+	double latency = 0, worst = 0;
+	bool quit = false;
+	while (!quit)
 	{
-		// Find neighbors left, top, right, bottom
-		GLuint c = std::find(beg, end, p.Set(it->x - 1, it->y)) != end;
-		c |= (std::find(beg, end, p.Set(it->x, it->y - 1)) != end) << 1;
-		c |= (std::find(beg, end, p.Set(it->x + 1, it->y)) != end) << 2;
-		c |= (std::find(beg, end, p.Set(it->x, it->y + 1)) != end) << 3;
+		while (SDL_PollEvent(&event))
+		{
+			if (event.type == SDL_QUIT) quit = true;
+			
+			if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_RESIZED)
+			{
+				WindowSize.x = event.window.data1;
+				WindowSize.y = event.window.data2;
+				continue;
+			}
+			
+			if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
+			{
+				if (event.key.keysym.scancode >= MAX_KEYS) continue;
+				
+				// Keys that touch GL or the window stay here, the others go to the simulation
+				if (event.type == SDL_KEYDOWN && !event.key.repeat)
+				{
+					if (event.key.keysym.scancode == SDL_SCANCODE_ESCAPE) quit = true;
+					else if (event.key.keysym.scancode == SDL_SCANCODE_F6) CycleFilter();
+					else if (event.key.keysym.scancode == SDL_SCANCODE_F7) Memory::Report(std::cout, "now");
+					else if (event.key.keysym.scancode == SDL_SCANCODE_F12) Screenshot();
+				}
+				
+				Input::Event input = { Clock::Milliseconds(), (GLushort)event.key.keysym.scancode, event.type == SDL_KEYDOWN };
+				if (!events.Push(input)) ++dropped;
+				continue;
+			}
+		}
+		
+		if (Shader::Reload()) SetupShaders();
+		
+		// Nothing new to show, the last frame stays on screen
+		const Scene *scene = scenes.Latest();
+		if (!scene || scene->sequence == shown)
+		{
+			SDL_Delay(1);
+			continue;
+		}
+		shown = scene->sequence;
+		
+		GLuint bytes = scene->instances.size() * sizeof(Enemy::Instance);
+		if (bytes > StreamBuffer::ENEMIES->size)
+		{
+			Pointer::Delete(StreamBuffer::ENEMIES);
+			StreamBuffer::ENEMIES = StreamBuffer::Create(GL_ARRAY_BUFFER, bytes);
+		}
 		
-		GLuint i = (it->y - t) * w + (it->x - l);
+		// RENDER
+		renderer->Begin();
+		scene->Draw(*renderer);
+		renderer->End();
+		
+		// SWAP BUFFERS
+		SDL_GL_SwapWindow(window);
 		
-		// E
-		if (c == 0b1111) blocks[i] = new Block(Model::E, glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)));
-		// I
-		else if (c == 0b1110) blocks[i] = new Block(Model::I, glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)));
-		else if (c == 0b1101) blocks[i] = new Block(Model::I, glm::rotate<float>(glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)), M_PI / -2, glm::vec3(0, 1, 0)));
-		else if (c == 0b1011) blocks[i] = new Block(Model::I, glm::rotate<float>(glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)), -M_PI, glm::vec3(0, 1, 0)));
-		else if (c == 0b0111) blocks[i] = new Block(Model::I, glm::rotate<float>(glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)), M_PI / 2, glm::vec3(0, 1, 0)));
-		// H
-		else if (c == 0b1010) blocks[i] = new Block(Model::H, glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)));
-		else if (c == 0b0101) blocks[i] = new Block(Model::H, glm::rotate<float>(glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)), M_PI / 2, glm::vec3(0, 1, 0)));
-		// L
-		else if (c == 0b1100) blocks[i] = new Block(Model::L, glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)));
-		else if (c == 0b1001) blocks[i] = new Block(Model::L, glm::rotate<float>(glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)), M_PI / -2, glm::vec3(0, 1, 0)));
-		else if (c == 0b0011) blocks[i] = new Block(Model::L, glm::rotate<float>(glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)), -M_PI, glm::vec3(0, 1, 0)));
-		else if (c == 0b0110) blocks[i] = new Block(Model::L, glm::rotate<float>(glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)), M_PI / 2, glm::vec3(0, 1, 0)));
-		// U
-		else if (c == 0b1000) blocks[i] = new Block(Model::U, glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)));
-		else if (c == 0b0001) blocks[i] = new Block(Model::U, glm::rotate<float>(glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)), M_PI / -2, glm::vec3(0, 1, 0)));
-		else if (c == 0b0010) blocks[i] = new Block(Model::U, glm::rotate<float>(glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)), -M_PI, glm::vec3(0, 1, 0)));
-		else if (c == 0b0100) blocks[i] = new Block(Model::U, glm::rotate<float>(glm::translate(Mat4::IDENTITY, glm::vec3(it->x, 0, it->y)), M_PI / 2, glm::vec3(0, 1, 0)));
+		// Input to photon, from the first key event the scene has seen to the end of the swap that shows it
+		if (scene->input > acknowledged)
+		{
+			double elapsed = Clock::Milliseconds() - scene->input;
+			latency += elapsed;
+			worst = glm::max(worst, elapsed);
+			++samples;
+			acknowledged = scene->input;
+		}
+		if (++frames % LATENCY_REPORT_FRAMES == 0)
+		{
+			std::cout << "Input latency " << (samples ? latency / samples : 0.0) << " ms average, " << worst << " ms worst over " << samples << " inputs";
+			if (dropped) std::cout << ", " << dropped << " events dropped";
+			std::cout << std::endl;
+			latency = worst = 0;
+			samples = dropped = 0;
+		}
 	}
 	
-	return new Map(blocks, { w, h }, { l, t });
+	running = false;
+	simulation.join();
+	
+	// Everything is released by now, what is still live was leaked
+	int exit = Shutdown(0, NULL);
+	Memory::Report(std::cout, "at exit");
+	return exit;
 }
 
-Point App::WindowSize;
-SDL_Window *App::window = NULL;
-SDL_GLContext App::videoContext = NULL;
-ALCcontext *App::audioContext = NULL;
-
-int App::Start()
+void App::Simulate()
 {
-	SDL_Event event;
-
-	for (;;)
+	Input::Event input;
+	GLuint sequence = 0;
+	double pending = 0;
+	double next = Clock::Milliseconds();
+	
+	while (running)
 	{
-		while (SDL_PollEvent(&event))
+		// The render thread has shown the last measured input, the next one can be measured
+		if (pending && acknowledged >= pending) pending = 0;
+		
+		while (events.Pop(input))
 		{
-			if (event.type == SDL_QUIT) return Shutdown(0, NULL);
-			
-			if (event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_RESIZED)
+			if (input.down && !Input::KEYBOARD[input.scancode])
 			{
-				WindowSize.x = event.window.data1;
-				WindowSize.y = event.window.data2;
-				continue;
+				if (input.scancode == SDL_SCANCODE_F5) QuickSave();
+				else if (input.scancode == SDL_SCANCODE_F9) QuickLoad();
 			}
-			
-			if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP)
+			Input::KEYBOARD[input.scancode] = input.down;
+			if (!pending) pending = input.time;
+		}
+		
+		if (connection)
+		{
+			// The server owns the simulation, the client sends its buttons and shows the last snapshot
+			connection->SendInput(Input::Read());
+			if (connection->Receive())
 			{
-				if (event.key.keysym.scancode < MAX_KEYS) Input::KEYBOARD[event.key.keysym.scancode] = event.type == SDL_KEYDOWN;
-				continue;
+				Player *player = world->players[0];
+				if (connection->frame == 2 && player->frame != 2) Sound::CROWBAR->Play();
+				player->position = connection->position;
+				player->angle = connection->angle;
+				player->look = glm::vec3(glm::cos(player->angle), 0, glm::sin(player->angle));
+				player->frame = connection->frame;
+				player->life = connection->life;
+				connection->Apply(*world);
 			}
 		}
+		else
+		{
+			world->players[0]->buttons = Input::Read();
+			world->Step();
+			if (audio) audio->Update(*world, world->players[0]);
+		}
 		
-		// INPUT CHECKING
-		if (Input::KEYBOARD[SDL_SCANCODE_ESCAPE]) return Shutdown(0, NULL);
-		Player::INSTANCE->CheckInput();
-		
-		// RENDER
-		FrameBuffer::POST->Bind();
-		glEnable(GL_DEPTH_TEST);
-		glEnable(GL_CULL_FACE);
-		glViewport(0, 0, BUFFER_WIDTH, BUFFER_HEIGHT);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		Shader::WORLD->Bind();
-		glActiveTexture(GL_TEXTURE0);
-		Texture::GLOBAL->Bind();
-		Map::INSTANCE->Draw();
-		Player::INSTANCE->Draw();
-		FrameBuffer::POST->Unbind();
-		
-		// POST PROCESS
-		glDisable(GL_DEPTH_TEST);
-		glDisable(GL_CULL_FACE);
-		glViewport(0, 0, WindowSize.x, WindowSize.y);
-		glClear(GL_COLOR_BUFFER_BIT);
-		Shader::POST->Bind();
-		glActiveTexture(GL_TEXTURE0);
-		FrameBuffer::POST->BindColor();
-		glActiveTexture(GL_TEXTURE1);
-		FrameBuffer::POST->BindDepth();
-		Model::POST->Bind();
-		glDrawArrays(GL_TRIANGLES, 0, Model::POST->count);
-		Model::POST->Unbind();
-		Shader::POST->Unbind();
+		// Publishing never waits, the render thread picks the newest complete scene
+		Scene &scene = scenes.Back();
+		scene.Gather(world->map, world->players[0]);
+		scene.sequence = ++sequence;
+		scene.input = pending;
+		scenes.Publish();
 		
-		// SWAP BUFFERS
-		SDL_GL_SwapWindow(window);
-		SDL_Delay(FPS);
+		// Fixed ticks, a late tick is not caught up so a stall does not turn into a burst
+		next += Config::CURRENT.frameDelay;
+		double now = Clock::Milliseconds();
+		if (next > now) std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(next - now));
+		else next = now;
 	}
-
-	return Shutdown(0, NULL);
 }
 
-int App::Initialize()
+int App::Initialize(const char *snapshot, const char *server, const char *record)
 {
 	if (SDL_Init(SDL_INIT_VIDEO)) return Shutdown(1, "Failed to SDL initialization !");
 	
-	window = SDL_CreateWindow("3D game", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WINDOW_WIDTH, WINDOW_HEIGHT, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
+	window = SDL_CreateWindow("3D game", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, Config::CURRENT.windowWidth, Config::CURRENT.windowHeight, SDL_WINDOW_OPENGL | SDL_WINDOW_RESIZABLE);
 	if (!window) return Shutdown(2, "Failed to create window !");
 	
-	WindowSize.x = WINDOW_WIDTH;
-	WindowSize.y = WINDOW_HEIGHT;
+	WindowSize.x = Config::CURRENT.windowWidth;
+	WindowSize.y = Config::CURRENT.windowHeight;
 	SDL_ShowCursor(SDL_DISABLE);
 
 	SDL_GL_SetAttribute(SDL_GL_ACCELERATED_VISUAL, 1);
@@ -782,10 +5225,12 @@ int App::Initialize()
 	if (!audioContext) return Shutdown(5, "Failed to creating context openAL !");
 	alcMakeContextCurrent(audioContext);
 
-	Shader::WORLD = Shader::Load(0b101, "resources\\shaders\\world");
+	Shader::WORLD = Shader::Load(0b101, SHADER_DIRECTORY "/world");
 	if (!Shader::WORLD) return Shutdown(10, "Failed to loading WORLD shader !");
-	Shader::POST = Shader::Load(0b101, "resources\\shaders\\post");
+	filter = Config::CURRENT.postFilter;
+	Shader::POST = LoadPost(filter);
 	if (!Shader::POST) return Shutdown(11, "Failed to loading POST shader !");
+	Shader::Watch(SHADER_DIRECTORY);
 
 	Texture::GLOBAL = Texture::Load("resources\\textures\\global.bmp");
 	if (!Texture::GLOBAL) return Shutdown(20, "Failed to loading GLOBAL texture !");
@@ -799,9 +5244,15 @@ int App::Initialize()
 	SoundBuffer::ENEMY = SoundBuffer::Load("resources\\sounds\\enemy.wav");
 	if (!SoundBuffer::ENEMY) return Shutdown(33, "Failed to loading ENEMY sound !");
 	
-	Sound::MUSIC = new Sound(SoundBuffer::MUSIC);
-	Sound::HIT = new Sound(SoundBuffer::HIT);
-	Sound::CROWBAR = new Sound(SoundBuffer::CROWBAR);
+	{
+		Memory::Scope scope(Memory::AUDIO);
+		Sound::MUSIC = new Sound(SoundBuffer::MUSIC);
+		Sound::HIT = new Sound(SoundBuffer::HIT);
+		Sound::CROWBAR = new Sound(SoundBuffer::CROWBAR);
+	}
+	
+	audio = Audio::Create(alcGetContextsDevice(audioContext));
+	if (!audio) return Shutdown(34, "Failed to creating audio voices !");
 	
 	Model::E = Model::Load("resources\\models\\E.mol");
 	if (!Model::E) return Shutdown(40, "Failed to loading E model !");
@@ -818,31 +5269,45 @@ int App::Initialize()
 	Model::POST = Model::Load("resources\\models\\post.mol");
 	if (!Model::POST) return Shutdown(46, "Failed to loading POST model !");
 	
-	FrameBuffer::POST = FrameBuffer::Create(BUFFER_WIDTH, BUFFER_HEIGHT);
+	FrameBuffer::POST = FrameBuffer::Create(Config::CURRENT.bufferWidth, Config::CURRENT.bufferHeight);
 	if (!FrameBuffer::POST) return Shutdown(50, "Failed to creating framebuffer !");
+	renderer = new GLRenderer();
+	if (record)
+	{
+		recorder = renderer->recorder = Encoder::Create(record, ENCODER_FPS);
+		if (!recorder) return Shutdown(52, "Failed to creating the recording !");
+	}
+	
+	if (server)
+	{
+		// The map comes from the server, enemies and other players only exist in its snapshots
+		Address address;
+		connection = Address::Resolve(server, address) ? Connection::Open(address, true, NET_CONNECT_TIMEOUT) : NULL;
+		if (!connection) return Shutdown(60, "Failed to connecting to the server !");
+		
+		world = new World(Map::Create(connection->masks, connection->size, connection->origin), time(0));
+		world->AddPlayer(glm::vec3(0, 0, 0), 0);
+	}
+	else if (!snapshot || !Snapshot::Load(snapshot, &world))
+	{
+		if (snapshot) std::cerr << "Failed to loading snapshot " << snapshot << ", generating a new map" << std::endl;
+		
+		world = World::Generate(Config::CURRENT.mapCells, Config::CURRENT.mapEnemies, time(0), std::thread::hardware_concurrency());
+		world->AddPlayer(glm::vec3(0, Config::CURRENT.topView ? 5 : 0, 0), 0);
+	}
 	
-	Map::INSTANCE = Map::Generate(256);
-	Map::INSTANCE->AddEnemies(256);
+	GLuint instances = connection ? NET_MAX_ENTITIES : world->enemies.size();
+	// A world without enemies still gets one instance, GL refuses empty buffer storage and the draw loop grows it on demand
+	StreamBuffer::ENEMIES = StreamBuffer::Create(GL_ARRAY_BUFFER, glm::max<GLuint>(instances, 1) * sizeof(Enemy::Instance));
+	if (!StreamBuffer::ENEMIES) return Shutdown(51, "Failed to creating enemies stream buffer !");
+	scenes.Prepare([instances](Scene &scene) { scene.Reserve(instances); });
 	
 	Input::KEYBOARD = new bool[MAX_KEYS];
 	memset(Input::KEYBOARD, 0, MAX_KEYS);
 	
-	#if TOP_VIEW_MODE==1
-		Player::INSTANCE = new Player(glm::vec3(0, 5, 0), 0);
-	#else
-		Player::INSTANCE = new Player(glm::vec3(0, 0, 0), 0);
-	#endif
-	
 	glClearColor(0.1, 0.5, 0.8, 1);
 	
-	Shader::WORLD->Bind();
-	glUniform1i(5, 0);
-	Shader::WORLD->Unbind();
-	
-	Shader::POST->Bind();
-	glUniform1i(2, 0);
-	glUniform1i(3, 1);
-	Shader::POST->Unbind();
+	SetupShaders();
 	
 	Sound::MUSIC->SetLooping(true);
 	Sound::MUSIC->SetVolume(0.3f);
@@ -853,6 +5318,79 @@ int App::Initialize()
 	return 0;
 }
 
+void App::QuickSave()
+{
+	// The simulation lives on the server when connected
+	if (connection) return;
+	if (!Snapshot::Save(SNAPSHOT_FILENAME, world)) std::cerr << "Failed to saving " << SNAPSHOT_FILENAME << std::endl;
+}
+
+void App::QuickLoad()
+{
+	if (connection) return;
+	
+	World *loaded;
+	if (!Snapshot::Load(SNAPSHOT_FILENAME, &loaded))
+	{
+		std::cerr << "Failed to loading " << SNAPSHOT_FILENAME << std::endl;
+		return;
+	}
+	
+	// Scenes hold copies, the render thread never reads the old world
+	if (audio) audio->Reset();
+	Pointer::Delete(world);
+	world = loaded;
+}
+
+Shader *App::LoadPost(GLuint filter)
+{
+	// Every upscale filter is a variant of the same fused fog pass
+	std::ostringstream defines;
+	defines << "#define FILTER " << filter << "\n";
+	return Shader::Load(0b101, SHADER_DIRECTORY "/post", defines.str());
+}
+
+void App::CycleFilter()
+{
+	static const char *names[POST_FILTERS] = { "nearest", "bilinear", "sharp bilinear", "sharpen" };
+	
+	// On error the current filter stays, the log is already printed
+	GLuint next = (filter + 1) % POST_FILTERS;
+	Shader *shader = LoadPost(next);
+	if (!shader) return;
+	
+	Pointer::Delete(Shader::POST);
+	Shader::POST = shader;
+	filter = next;
+	SetupShaders();
+	std::cout << "Post filter " << names[filter] << std::endl;
+}
+
+void App::Screenshot()
+{
+	// One numbered sequence per run
+	if (!screenshots)
+	{
+		std::ostringstream filename;
+		filename << POST_SCREENSHOT_FILENAME << "-" << time(0) << ".png";
+		screenshots = Encoder::Create(filename.str(), ENCODER_FPS);
+	}
+	renderer->screenshot = screenshots;
+}
+
+void App::SetupShaders()
+{
+	Shader::WORLD->Bind();
+	glUniform1i(5, 0);
+	glUniform1i(6, 0);
+	Shader::WORLD->Unbind();
+	
+	Shader::POST->Bind();
+	glUniform1i(2, 0);
+	glUniform1i(3, 1);
+	Shader::POST->Unbind();
+}
+
 int App::Shutdown(int exit, const char *msg)
 {
 	glActiveTexture(GL_TEXTURE0);
@@ -860,10 +5398,15 @@ int App::Shutdown(int exit, const char *msg)
 	glActiveTexture(GL_TEXTURE1);
 	Texture::GLOBAL->Unbind();
 	
-	Pointer::Delete(Player::INSTANCE);
-	Pointer::Delete(Input::KEYBOARD);
-	Pointer::Delete(Map::INSTANCE);
+	delete[] Input::KEYBOARD;
+	Input::KEYBOARD = NULL;
+	Pointer::Delete(world);
+	Pointer::Delete(connection);
 	
+	Pointer::Delete(renderer);
+	Pointer::Delete(recorder);
+	Pointer::Delete(screenshots);
+	Pointer::Delete(StreamBuffer::ENEMIES);
 	Pointer::Delete(FrameBuffer::POST);
 	
 	Pointer::Delete(Model::POST);
@@ -874,6 +5417,7 @@ int App::Shutdown(int exit, const char *msg)
 	Pointer::Delete(Model::I);
 	Pointer::Delete(Model::E);
 	
+	Pointer::Delete(audio);
 	Pointer::Delete(Sound::CROWBAR);
 	Pointer::Delete(Sound::HIT);
 	Pointer::Delete(Sound::MUSIC);
@@ -885,6 +5429,7 @@ int App::Shutdown(int exit, const char *msg)
 	
 	Pointer::Delete(Texture::GLOBAL);
 	
+	Shader::Unwatch();
 	Pointer::Delete(Shader::POST);
 	Pointer::Delete(Shader::WORLD);
 	
@@ -905,9 +5450,551 @@ int App::Shutdown(int exit, const char *msg)
 	return exit;
 }
 
+std::vector<Benchmark::Result> Benchmark::RESULTS;
+volatile GLuint Benchmark::SINK = 0;
+
+template<typename F>
+void Benchmark::Measure(const std::string &name, GLuint operations, F run)
+{
+	run();
+	
+	GLuint iterations = 0;
+	double begin = Clock::Milliseconds();
+	double elapsed = 0;
+	do
+	{
+		run();
+		++iterations;
+		elapsed = Clock::Milliseconds() - begin;
+	}
+	while (elapsed < BENCHMARK_MIN_MILLISECONDS || iterations < BENCHMARK_MIN_ITERATIONS);
+	
+	Result result = { name, iterations, elapsed * 1e6 / ((double)iterations * operations) };
+	RESULTS.push_back(result);
+	std::cerr << name << ": " << result.ns << " ns/op (" << iterations << " iterations)" << std::endl;
+}
+
+int Benchmark::Run(const char *filename)
+{
+	// Headless, only the simulation and the parsers are measured, nothing touches SDL, GL or AL
+	RESULTS.clear();
+	Random random(1);
+	
+	const GLuint sizes[] = { 256, 1024, 4096 };
+	for (GLuint s = 0; s < sizeof(sizes) / sizeof(GLuint); ++s)
+	{
+		GLuint size = sizes[s];
+		std::string suffix = "/" + std::to_string(size);
+		std::vector<Point> points;
+		points.reserve(size);
+		
+		Measure("Map::Walk" + suffix, size, [&]() { points.clear(); Map::Walk(size, random, points); });
+		
+		Point area, origin;
+		std::vector<unsigned long long> bits;
+		GLuint words = Map::Occupy(points, area, origin, bits);
+		std::vector<GLubyte> masks(area.x * area.y);
+		Measure("Map::Classify" + suffix, size, [&]()
+		{
+			for (int y = 0; y < area.y; ++y) Map::ClassifyRow(&bits[y * words], &bits[(y + 1) * words], &bits[(y + 2) * words], area.x, &masks[y * area.x]);
+			SINK = masks[0];
+		});
+		Measure("Map::Build" + suffix, size, [&]() { Map *map = Map::Build(points); Pointer::Delete(map); });
+	}
+	
+	{
+		// A 2048x2048 grid with random walls, far larger than a walk can generate
+		const GLuint side = 2048, words = side >> 6;
+		std::vector<unsigned long long> bits((side + 2) * words, 0);
+		for (GLuint i = words; i < (side + 1) * words; ++i) bits[i] = (unsigned long long)random.Next() << 32 | random.Next();
+		std::vector<GLubyte> masks(side * side);
+		Measure("Map::Classify/grid", side * side, [&]()
+		{
+			for (GLuint y = 0; y < side; ++y) Map::ClassifyRow(&bits[y * words], &bits[(y + 1) * words], &bits[(y + 2) * words], side, &masks[y * side]);
+			SINK = masks[0];
+		});
+	}
+	
+	{
+		// On one thread, so the case does not depend on the cores
+		RoomGenerator generator(1);
+		Measure("RoomGenerator/65536", 65536, [&]() { Map *rooms = generator.Generate(65536, random); Pointer::Delete(rooms); });
+	}
+	
+	World *world = World::Generate(1024, 10000, 1);
+	Map *map = world->map;
+	std::vector<Enemy *> &enemies = world->enemies;
+	GLuint count = enemies.size();
+	
+	std::vector<glm::vec3> positions(count);
+	for (GLuint i = 0; i < count; ++i) positions[i] = enemies[i]->position;
+	Measure("Map::Move/10000", count, [&]()
+	{
+		for (GLuint i = 0; i < count; ++i) map->Move(positions[i], enemies[i]->direction);
+	});
+	Measure("Map::Move/blocked", count, [&]()
+	{
+		// Straight into the walls, every move ends up sliding or stopped
+		for (GLuint i = 0; i < count; ++i) map->Move(positions[i], glm::vec3(ENEMY_SPEED, 0, -ENEMY_SPEED) * 50.0f);
+	});
+	Measure("World::Step/10000", count, [&]() { world->Step(); });
+	
+	GLuint cell = map->GetCell(enemies[0]->position);
+	Measure("NavField::Build/1024", 1, [&]() { map->nav->Build(map->blocks, &cell, 1); });
+	Measure("CorridorGraph::Build/1024", 1, [&]() { CorridorGraph graph(map->blocks, map->size); SINK = graph.nodes.size(); });
+	
+	// Far enemies of one tick heading for 4 players, the searches start over each iteration
+	std::vector<CorridorGraph::Request> requests(count);
+	for (GLuint i = 0; i < count; ++i)
+	{
+		CorridorGraph::Request request = { (GLuint)map->GetCell(enemies[i]->position), (GLuint)map->GetCell(enemies[i % 4]->position), -1, 0 };
+		requests[i] = request;
+	}
+	Measure("CorridorGraph::Route/10000", count, [&]() { map->graph->Reset(); map->graph->Route(requests.data(), count); SINK = requests[0].distance; });
+	
+	// Every emitter is evaluated against a listener walking from cell to cell, the worst case for the audio side
+	Acoustics acoustics;
+	Acoustics::Path path;
+	GLuint step = 0;
+	Measure("Acoustics::Listen/1024", 1, [&]() { acoustics.Listen(map, enemies[step++ % count]->position); });
+	Measure("Acoustics::Evaluate/10000", count, [&]()
+	{
+		GLuint audible = 0;
+		for (GLuint i = 0; i < count; ++i) audible += acoustics.Evaluate(enemies[i]->position, path);
+		SINK = audible;
+	});
+	
+	// Enemies of their own, the ones of the world are already linked in their blocks
+	Enemy *walkers[BENCHMARK_LIST_WALKERS];
+	for (GLuint i = 0; i < BENCHMARK_LIST_WALKERS; ++i) walkers[i] = new Enemy(*world, enemies[i]->position);
+	Measure("EnemyList::Add+Remove/10000", count, [&]()
+	{
+		// Enemies walking across cells, the list stays small, the oldest one leaves first
+		EnemyList list;
+		for (GLuint i = 0; i < count; ++i)
+		{
+			list.Add(walkers[i % BENCHMARK_LIST_WALKERS]);
+			if (list.size > 8) list.Remove(list.first);
+		}
+		while (list.first) list.Remove(list.first);
+		SINK = list.size;
+	});
+	for (GLuint i = 0; i < BENCHMARK_LIST_WALKERS; ++i) delete walkers[i];
+	
+	world->AddPlayer(glm::vec3(0, 0, 0), 0);
+	Measure("Snapshot::Save/1024", 1, [&]() { Snapshot::Save("benchmark.ld0", world); });
+	Measure("Snapshot::Load/1024", 1, [&]()
+	{
+		World *loaded;
+		if (Snapshot::Load("benchmark.ld0", &loaded)) Pointer::Delete(loaded);
+	});
+	Measure("World::Generate/1024", 1, [&]()
+	{
+		World *generated = World::Generate(1024, count, 1);
+		Pointer::Delete(generated);
+	});
+	remove("benchmark.ld0");
+	Pointer::Delete(world);
+	
+	const char *models[] = { "resources\\models\\E.mol", "resources\\models\\U.mol", "resources\\models\\enemy.mol" };
+	for (GLuint i = 0; i < sizeof(models) / sizeof(char *); ++i)
+	{
+		GLuint size = 0;
+		float *vertices = Model::Parse(models[i], &size);
+		if (!vertices) { std::cerr << "Failed to loading " << models[i] << " !" << std::endl; continue; }
+		delete[] vertices;
+		std::string name = models[i];
+		Measure("Model::Parse/" + name.substr(name.find_last_of('\\') + 1), 1, [&]() { delete[] Model::Parse(models[i], &size); });
+	}
+	
+	const char *sound = "resources\\sounds\\enemy.wav";
+	GLuint samples = 0;
+	char *data = SoundBuffer::Parse(sound, &samples);
+	if (data) Measure("SoundBuffer::Parse/enemy.wav", 1, [&]() { delete[] SoundBuffer::Parse(sound, &samples); });
+	else std::cerr << "Failed to loading " << sound << " !" << std::endl;
+	delete[] data;
+	
+	const char *texture = "resources\\textures\\global.bmp";
+	GLuint width = 0, height = 0;
+	char *pixels = Texture::Parse(texture, &width, &height);
+	if (pixels) Measure("Texture::Parse/global.bmp", 1, [&]() { delete[] Texture::Parse(texture, &width, &height); });
+	else std::cerr << "Failed to loading " << texture << " !" << std::endl;
+	delete[] pixels;
+	
+	std::ofstream file;
+	if (filename) file.open(filename);
+	std::ostream &os = filename ? file : std::cout;
+	os << "{" << std::endl << "\t\"benchmarks\": [" << std::endl;
+	for (GLuint i = 0; i < RESULTS.size(); ++i)
+	{
+		std::string name = RESULTS[i].name;
+		for (size_t p = 0; (p = name.find('\\', p)) != std::string::npos; p += 2) name.insert(p, 1, '\\');
+		os << "\t\t{ \"name\": \"" << name << "\", \"iterations\": " << RESULTS[i].iterations << ", \"ns\": " << RESULTS[i].ns << " }" << (i + 1 < RESULTS.size() ? "," : "") << std::endl;
+	}
+	os << "\t]" << std::endl << "}" << std::endl;
+	
+	return os.good() ? 0 : 1;
+}
+
+bool Benchmark::Read(const char *filename, std::vector<Result> &results)
+{
+	// Only reads back the one result per line layout written by Run
+	std::ifstream is(filename);
+	if (!is.is_open()) return false;
+	
+	std::string line;
+	while (std::getline(is, line))
+	{
+		size_t name = line.find("\"name\": \"");
+		size_t ns = line.find("\"ns\": ");
+		if (name == std::string::npos || ns == std::string::npos) continue;
+		
+		name += 9;
+		Result result = { line.substr(name, line.find("\", \"", name) - name), 0, atof(line.c_str() + ns + 6) };
+		results.push_back(result);
+	}
+	return true;
+}
+
+int Benchmark::Compare(const char *base, const char *current, float threshold)
+{
+	std::vector<Result> before, after;
+	if (!Read(base, before) || !Read(current, after))
+	{
+		std::cerr << "Failed to reading benchmark results !" << std::endl;
+		return 2;
+	}
+	
+	GLuint regressions = 0;
+	for (std::vector<Result>::iterator it = after.begin(); it != after.end(); ++it)
+	{
+		std::vector<Result>::iterator b = before.begin();
+		while (b != before.end() && b->name != it->name) ++b;
+		if (b == before.end())
+		{
+			std::cout << it->name << ": " << it->ns << " ns (new)" << std::endl;
+			continue;
+		}
+		
+		double delta = (it->ns - b->ns) / b->ns * 100.0;
+		bool regression = delta > threshold;
+		regressions += regression;
+		std::cout << it->name << ": " << b->ns << " -> " << it->ns << " ns (" << (delta > 0 ? "+" : "") << delta << "%)" << (regression ? " REGRESSION" : "") << std::endl;
+	}
+	
+	std::cout << regressions << " regression(s) over " << threshold << "%" << std::endl;
+	return regressions ? 1 : 0;
+}
+
+int Benchmark::Stream(GLuint instances, GLuint frames)
+{
+	GLuint bytes = instances * sizeof(glm::vec4);
+	StreamBuffer *stream = StreamBuffer::Create(GL_ARRAY_BUFFER, bytes);
+	if (!stream) return App::Shutdown(60, "Failed to creating stream buffer !");
+	
+	// The GPU consumes every section with a copy, the same way a draw call would read the instances
+	GLuint scratch;
+	glGenBuffers(1, &scratch);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, scratch);
+	glBufferData(GL_COPY_WRITE_BUFFER, bytes, NULL, GL_STREAM_COPY);
+	
+	double write = 0;
+	double begin = Clock::Milliseconds();
+	
+	for (GLuint f = 0; f < frames; ++f)
+	{
+		double start = Clock::Milliseconds();
+		glm::vec4 *p = (glm::vec4 *)stream->Map(bytes);
+		for (GLuint i = 0; i < instances; ++i) p[i] = glm::vec4((float)i, 0, (float)f, 1);
+		stream->Unmap();
+		write += Clock::Milliseconds() - start;
+		
+		glBindBuffer(GL_COPY_READ_BUFFER, stream->id);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, stream->offset, 0, bytes);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		stream->Fence();
+		glFlush();
+	}
+	glFinish();
+	
+	double total = Clock::Milliseconds() - begin;
+	std::cout << "stream " << (stream->persistent ? "persistent" : "orphaning") << ": " << instances << " instances x " << frames << " frames" << std::endl;
+	std::cout << "  write " << write / frames << " ms/frame, " << (double)bytes * frames / (write * 1000.0) << " MB/s" << std::endl;
+	std::cout << "  total " << total / frames << " ms/frame, " << stream->waits << " fence waits" << std::endl;
+	
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glDeleteBuffers(1, &scratch);
+	Pointer::Delete(stream);
+	
+	return App::Shutdown(0, NULL);
+}
+
+int Benchmark::Sweep(GLuint cells, GLuint entities, GLuint ticks)
+{
+	World *world = World::Generate(cells, entities, 1);
+	Map *map = world->map;
+	std::vector<Enemy *> &enemies = world->enemies;
+	const float speeds[] = { ENEMY_SPEED, PLAYER_SPEED, 0.5f, 4.0f };
+	
+	std::cout << "sweep: " << map->size.x << "x" << map->size.y << " map, " << entities << " entities x " << ticks << " ticks" << std::endl;
+	GLuint outside = 0, differ = 0;
+	std::vector<glm::vec3> starts(entities), ends(entities);
+	for (GLuint s = 0; s < sizeof(speeds) / sizeof(float); ++s)
+	{
+		for (GLuint i = 0; i < entities; ++i)
+		{
+			float angle = world->random.GetNumber<float>(0, 2 * M_PI);
+			enemies[i]->direction = glm::vec3(glm::cos(angle) * speeds[s], 0, glm::sin(angle) * speeds[s]);
+		}
+		
+		// One by one with the block lists kept up to date, like the enemies used to be moved
+		for (GLuint i = 0; i < entities; ++i) starts[i] = enemies[i]->position;
+		double begin = Clock::Milliseconds();
+		for (GLuint t = 0; t < ticks; ++t)
+			for (GLuint i = 0; i < entities; ++i)
+			{
+				Enemy *enemy = enemies[i];
+				Block *from = map->GetBlock(enemy->position);
+				map->Move(enemy->position, enemy->direction);
+				Block *to = map->GetBlock(enemy->position);
+				if (from == to) continue;
+				if (from) from->enemies.Remove(enemy);
+				if (to) to->enemies.Add(enemy);
+			}
+		double single = Clock::Milliseconds() - begin;
+		for (GLuint i = 0; i < entities; ++i)
+		{
+			ends[i] = enemies[i]->position;
+			map->Relocate(enemies[i], starts[i]);
+		}
+		
+		// The same moves from the same starts through the batch of the world step
+		begin = Clock::Milliseconds();
+		for (GLuint t = 0; t < ticks; ++t)
+		{
+			for (GLuint i = 0; i < entities; ++i) world->moves.Add(enemies[i], map->GetCell(enemies[i]->position), enemies[i]->direction);
+			map->Move(world->moves);
+		}
+		double batch = Clock::Milliseconds() - begin;
+		
+		GLuint overlapping = 0;
+		for (GLuint i = 0; i < entities; ++i)
+		{
+			overlapping += map->Overlaps(enemies[i]->position);
+			differ += enemies[i]->position != ends[i];
+		}
+		outside += overlapping;
+		
+		std::cout << "  speed " << speeds[s] << ": " << single * 1e6 / ((double)entities * ticks) << " ns/move, batched " << batch * 1e6 / ((double)entities * ticks) << " ns/move, " << overlapping << " outside" << std::endl;
+	}
+	
+	// The block lists must hold every enemy once after all the moves
+	GLuint listed = 0, misplaced = 0;
+	for (GLuint c = 0, count = map->size.x * map->size.y; c < count; ++c)
+	{
+		if (!map->blocks[c]) continue;
+		for (Enemy *enemy = map->blocks[c]->enemies.first; enemy; enemy = enemy->nextInBlock, ++listed) misplaced += map->GetCell(enemy->position) != (GLint)c;
+	}
+	std::cout << "  " << differ << " batched moves differ from single ones, " << listed << " of " << entities << " enemies listed, " << misplaced << " in the wrong block" << std::endl;
+	
+	// A hitbox overlapping a wall is a tunneling bug, the run fails like a batch that disagrees with single moves
+	Pointer::Delete(world);
+	return outside || differ || listed != entities || misplaced ? 1 : 0;
+}
+
+int Benchmark::Paths(GLuint cells, GLuint queries, GLuint goals)
+{
+	Random random(1);
+	Map *map = Map::Generate(cells, random);
+	
+	// The map already built its graph, it is built again to be timed alone
+	double begin = Clock::Milliseconds();
+	Pointer::Delete(map->graph);
+	CorridorGraph *graph = map->graph = new CorridorGraph(map->blocks, map->size);
+	double build = Clock::Milliseconds() - begin;
+	
+	std::vector<GLuint> walkable;
+	for (GLuint i = 0, count = map->size.x * map->size.y; i < count; ++i) if (map->blocks[i]) walkable.push_back(i);
+	std::cout << "paths: " << map->size.x << "x" << map->size.y << " map, " << walkable.size() << " cells, " << graph->nodes.size() << " nodes, " << graph->edges.size() << " edges, built in " << build << " ms" << std::endl;
+	
+	std::vector<CorridorGraph::Request> requests(queries);
+	auto report = [&](const char *name, GLuint count, double milliseconds)
+	{
+		unsigned long long length = 0;
+		for (GLuint i = 0; i < count; ++i) length += requests[i].distance;
+		std::cout << "  " << name << ": " << count << " queries, " << count * 1000.0 / milliseconds << " queries/s, " << (double)graph->expanded / count << " nodes expanded per query, "
+			<< graph->hits << " hits, " << graph->misses << " misses, " << (double)length / count << " cells per path" << std::endl;
+	};
+	
+	// Every query with its own goal, a new search each time
+	GLuint single = glm::max<GLuint>(queries / 100, 1);
+	for (GLuint i = 0; i < single; ++i)
+	{
+		CorridorGraph::Request request = { walkable[random.Next() % walkable.size()], walkable[random.Next() % walkable.size()], -1, 0 };
+		requests[i] = request;
+	}
+	graph->Reset();
+	begin = Clock::Milliseconds();
+	for (GLuint i = 0; i < single; ++i) graph->Route(&requests[i], 1);
+	report("single", single, Clock::Milliseconds() - begin);
+	
+	// Many agents sharing a few goals in one batch, then the same batch with the searches already done
+	std::vector<GLuint> targets(glm::max<GLuint>(goals, 1));
+	for (GLuint i = 0; i < targets.size(); ++i) targets[i] = walkable[random.Next() % walkable.size()];
+	for (GLuint i = 0; i < queries; ++i)
+	{
+		CorridorGraph::Request request = { walkable[random.Next() % walkable.size()], targets[i % targets.size()], -1, 0 };
+		requests[i] = request;
+	}
+	graph->Reset();
+	begin = Clock::Milliseconds();
+	graph->Route(requests.data(), queries);
+	report("batched", queries, Clock::Milliseconds() - begin);
+	
+	graph->hits = graph->misses = graph->expanded = 0;
+	begin = Clock::Milliseconds();
+	graph->Route(requests.data(), queries);
+	report("cached", queries, Clock::Milliseconds() - begin);
+	
+	Pointer::Delete(map);
+	return 0;
+}
+
+int Benchmark::Rooms(GLuint cells, GLuint threads)
+{
+	// The same seed on one thread then on several, both maps must be identical
+	GLuint counts[] = { 1, glm::max<GLuint>(threads, 2) };
+	std::vector<GLubyte> masks[2];
+	for (GLuint i = 0; i < 2; ++i)
+	{
+		RoomGenerator generator(counts[i]);
+		std::vector<GLubyte> grid;
+		Point start;
+		double begin = Clock::Milliseconds();
+		GLuint side = generator.Carve(cells, 1, grid, start);
+		double carve = Clock::Milliseconds() - begin;
+		
+		Random random(1);
+		begin = Clock::Milliseconds();
+		Map *map = generator.Generate(cells, random);
+		double total = Clock::Milliseconds() - begin;
+		
+		masks[i].resize(map->size.x * map->size.y);
+		map->GetMasks(masks[i].data());
+		if (!i)
+		{
+			GLuint walkable = 0, chunks = (side + ROOMS_CHUNK - 1) / ROOMS_CHUNK;
+			for (GLuint c = 0; c < masks[i].size(); ++c) walkable += masks[i][c] != 0;
+			std::cout << "rooms: " << side << "x" << side << " map, " << walkable << " walkable cells, " << chunks * chunks << " chunks" << std::endl;
+		}
+		std::cout << "  " << counts[i] << (counts[i] > 1 ? " threads" : " thread") << ": carved in " << carve << " ms, whole map with blocks and corridor graph in " << total << " ms" << std::endl;
+		Pointer::Delete(map);
+	}
+	
+	bool same = masks[0] == masks[1];
+	std::cout << "  " << (same ? "same map on both" : "the maps differ !") << std::endl;
+	return same ? 0 : 1;
+}
+
+int Benchmark::Render(GLuint frames, GLuint threads, const char *capture)
+{
+	if (!SoftwareRenderer::LoadAssets())
+	{
+		std::cerr << "Failed to loading models and textures !" << std::endl;
+		SoftwareRenderer::ReleaseAssets();
+		return 80;
+	}
+	
+	World *world = World::Generate(Config::CURRENT.mapCells, Config::CURRENT.mapEnemies, 1);
+	Player *player = world->AddPlayer(glm::vec3(0, 0, 0), 0);
+	SoftwareRenderer *renderer = SoftwareRenderer::Create(Config::CURRENT.bufferWidth, Config::CURRENT.bufferHeight, threads, world->enemies.size());
+	Encoder *encoder = capture ? Encoder::Create(capture, ENCODER_FPS) : NULL;
+	if (capture && !encoder)
+	{
+		Pointer::Delete(renderer);
+		Pointer::Delete(world);
+		SoftwareRenderer::ReleaseAssets();
+		return 82;
+	}
+	
+	// The player turns on the spot while the enemies walk, every frame sees a different view
+	Scene scene;
+	double render = 0, push = 0;
+	unsigned long long triangles = 0;
+	for (GLuint f = 0; f < frames; ++f)
+	{
+		player->buttons = INPUT_TURN_LEFT;
+		world->Step();
+		
+		double start = Clock::Milliseconds();
+		scene.Gather(world->map, player);
+		renderer->Begin();
+		scene.Draw(*renderer);
+		renderer->End();
+		render += Clock::Milliseconds() - start;
+		triangles += renderer->triangles;
+		
+		if (encoder)
+		{
+			start = Clock::Milliseconds();
+			encoder->Push(renderer->pixels, renderer->width, renderer->height, false);
+			push += Clock::Milliseconds() - start;
+		}
+	}
+	
+	std::cout << "render " << renderer->width << "x" << renderer->height << ": " << frames << " frames, " << glm::max<GLuint>(threads, 1) << " threads, " << (RENDER_SIMD ? "SSE2" : "scalar") << std::endl;
+	std::cout << "  " << render / frames << " ms/frame, " << frames * 1000.0 / render << " frames/s, " << triangles / frames << " triangles/frame" << std::endl;
+	if (encoder) std::cout << "  capture " << push / frames << " ms/frame on the render thread" << std::endl;
+	
+	Pointer::Delete(encoder);
+	Pointer::Delete(renderer);
+	Pointer::Delete(world);
+	SoftwareRenderer::ReleaseAssets();
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
-	int err = App::Initialize();
+	argc = Config::Parse(argc, argv);
+	if (argc < 0) return 90;
+	if (argc > 1 && !strcmp(argv[1], "--show-config"))
+	{
+		Config::Print(std::cout);
+		return 0;
+	}
+	
+	if (argc > 1 && !strcmp(argv[1], "--bench")) return Benchmark::Run(argc > 2 ? argv[2] : NULL);
+	if (argc > 3 && !strcmp(argv[1], "--bench-compare")) return Benchmark::Compare(argv[2], argv[3], argc > 4 ? (float)atof(argv[4]) : BENCHMARK_REGRESSION_THRESHOLD);
+	if (argc > 1 && !strcmp(argv[1], "--test-sweep")) return Map::TestSweep();
+	if (argc > 1 && !strcmp(argv[1], "--bench-sweep")) return Benchmark::Sweep(BENCHMARK_SWEEP_CELLS, BENCHMARK_SWEEP_ENTITIES, BENCHMARK_SWEEP_TICKS);
+	if (argc > 1 && !strcmp(argv[1], "--alloc-check")) return Runner::Check(argc > 2 ? atoi(argv[2]) : RUNNER_CHECK_TICKS, argc > 3 ? atoi(argv[3]) : RUNNER_CHECK_WARMUP);
+	if (argc > 1 && !strcmp(argv[1], "--bench-rooms")) return Benchmark::Rooms(argc > 2 ? atoi(argv[2]) : BENCHMARK_ROOMS_CELLS, argc > 3 ? atoi(argv[3]) : glm::max<GLuint>(std::thread::hardware_concurrency(), BENCHMARK_ROOMS_THREADS));
+	if (argc > 1 && !strcmp(argv[1], "--bench-paths")) return Benchmark::Paths(argc > 2 ? atoi(argv[2]) : BENCHMARK_PATHS_CELLS, argc > 3 ? atoi(argv[3]) : BENCHMARK_PATHS_QUERIES, argc > 4 ? atoi(argv[4]) : BENCHMARK_PATHS_GOALS);
+	if (argc > 1 && !strcmp(argv[1], "--bench-render")) return Benchmark::Render(argc > 2 ? atoi(argv[2]) : BENCHMARK_RENDER_FRAMES, argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency(), argc > 4 ? argv[4] : NULL);
+	
+	if (argc > 2 && !strcmp(argv[1], "--render")) return SoftwareRenderer::Capture(argv[2], argc > 3 ? atoi(argv[3]) : 1, argc > 4 ? atoi(argv[4]) : 0, argc > 5 ? atoi(argv[5]) : std::thread::hardware_concurrency());
+	if (argc > 3 && !strcmp(argv[1], "--render-diff")) return SoftwareRenderer::Diff(argv[2], argv[3], argc > 4 ? atoi(argv[4]) : 0, argc > 5 ? argv[5] : NULL);
+	
+	if (argc > 1 && !strcmp(argv[1], "--worlds")) return Runner::Run(argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency(), argc > 3 ? atoi(argv[3]) : RUNNER_TICKS, argc > 4 ? atoi(argv[4]) : std::thread::hardware_concurrency());
+	if (argc > 1 && !strcmp(argv[1], "--generate")) return Batch::Run(argc > 2 ? atoi(argv[2]) : BATCH_MAPS, argc > 3 ? atoi(argv[3]) : BATCH_CELLS, argc > 4 ? atoi(argv[4]) : std::thread::hardware_concurrency(), argc > 5 ? argv[5] : NULL, argc > 6 ? argv[6] : NULL, argc > 7 ? argv[7] : NULL);
+	if (argc > 1 && !strcmp(argv[1], "--server")) return Server::Start(argc > 2 ? atoi(argv[2]) : NET_PORT, argc > 3 ? atoi(argv[3]) : 256, argc > 4 ? atoi(argv[4]) : 256, argc > 5 ? atoi(argv[5]) : 0);
+	if (argc > 2 && !strcmp(argv[1], "--bots"))
+	{
+		Address address;
+		const char *host = argc > 3 ? argv[3] : "127.0.0.1";
+		if (!Address::Resolve(host, address))
+		{
+			std::cerr << "Failed to resolving " << host << std::endl;
+			return 72;
+		}
+		return Connection::RunBots(address, atoi(argv[2]), argc > 4 ? atoi(argv[4]) : 30);
+	}
+	
+	const char *snapshot = argc > 2 && !strcmp(argv[1], "--load") ? argv[2] : NULL;
+	const char *server = argc > 2 && !strcmp(argv[1], "--connect") ? argv[2] : NULL;
+	const char *record = argc > 2 && !strcmp(argv[1], "--record") ? argv[2] : NULL;
+	int err = App::Initialize(snapshot, server, record);
 	if (err) return err;
+	if (argc > 1 && !strcmp(argv[1], "--bench-stream")) return Benchmark::Stream(BENCHMARK_STREAM_INSTANCES, BENCHMARK_STREAM_FRAMES);
 	return App::Start();
 }
\ No newline at end of file
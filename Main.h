@@ -2,8 +2,50 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <sstream>
+#include <iomanip>
 #include <algorithm>
 #include <time.h>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <new>
+#include <cstdlib>
+#include <sys/stat.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <direct.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <cerrno>
+#endif
+#ifdef __GLIBC__
+#include <execinfo.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RENDER_SIMD 1
+#else
+#define RENDER_SIMD 0
+#endif
 #include <sdl2/sdl.h>
 #include <gl/glew.h>
 #include <glm/glm.hpp>
@@ -11,7 +53,11 @@
 #include <glm/gtc/matrix_access.hpp>
 #include <al/al.h>
 #include <al/alc.h>
+#include <al/efx.h>
 
+#define CONFIG_FILENAME "config.ini"
+
+// Defaults of the runtime configuration, see Config
 #define TOP_VIEW_MODE 0
 
 #define WINDOW_WIDTH 640
@@ -22,6 +68,10 @@
 
 #define FPS 16
 
+#define MAP_CELLS 256
+#define MAP_ENEMIES 256
+#define MAP_GENERATOR MAP_GENERATOR_WALK
+
 #define MAX_KEYS 128
 
 #define PLAYER_SPEED 0.05f
@@ -31,6 +81,7 @@
 #define PLAYER_LIFES 100
 
 #define HITBOX_SIZE 0.05f
+#define HITBOX_EPSILON 0.001f
 #define HIT_DISTANCE 0.3f
 
 #define ENEMY_SPEED 0.02f
@@ -40,34 +91,308 @@
 #define ENEMY_ANIMATION_TICKS 16
 #define ENEMY_ANIMATION_WALK_FRAMES 2
 #define ENEMY_ANIMATION_FALL_FRAMES 3
+#define ENEMY_CHASE_DISTANCE 16
+
+#define NAV_UNREACHED 0xFFFF
+
+#define CORRIDOR_UNREACHED 0xFFFFFFFF
+#define CORRIDOR_INTERIOR 0x80000000
+#define CORRIDOR_CACHE_GOALS 32
+#define CORRIDOR_RESERVE_BYTES (16 << 20)
+
+#define MAP_GENERATOR_WALK 0
+#define MAP_GENERATOR_ROOMS 1
+#define MAP_GENERATORS 2
+
+#define ROOMS_CHUNK 64
+#define ROOMS_MIN_SIDE 16
+#define ROOMS_MIN_LEAF 8
+#define ROOMS_MAX_LEAF 16
+#define ROOMS_MIN_ROOM 3
+
+#define LOD_NEAR 0
+#define LOD_MID 1
+#define LOD_FAR 2
+#define LOD_TIERS 3
+#define LOD_MID_INTERVAL 4
+
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+
+#define AUDIO_VOICES 16
+#define AUDIO_RANGE 12
+#define AUDIO_REFERENCE 1.0f
+#define AUDIO_ROLLOFF 1.0f
+#define AUDIO_OCCLUSION 0.35f
+#define AUDIO_MIN_GAIN 0.1f
+#define AUDIO_GAIN_THRESHOLD 0.02f
+#define AUDIO_POSITION_THRESHOLD 0.1f
+
+#define INPUT_FORWARD 1
+#define INPUT_BACKWARD 2
+#define INPUT_STRAFE_LEFT 4
+#define INPUT_STRAFE_RIGHT 8
+#define INPUT_TURN_LEFT 16
+#define INPUT_TURN_RIGHT 32
+#define INPUT_ATTACK 64
+#define INPUT_QUEUE_SIZE 256
+
+#define LATENCY_REPORT_FRAMES 300
+
+#define SHADER_DIRECTORY "resources/shaders"
+#define SHADER_CACHE_DIRECTORY "resources/shaders/cache"
+#define SHADER_INCLUDE_DEPTH 8
+#define SHADER_WATCH_TICKS 30
+
+#define STREAM_BUFFER_SECTIONS 3
+
+#define RENDER_TILE_SIZE 32
+#define RENDER_EDGE_BIAS 0.0001f
+#define RENDER_CLEAR_COLOR 0x1A80CC
+#define RENDER_COLOR_KEY 0xFF8C00
+
+#define POST_FILTER_NEAREST 0
+#define POST_FILTER_BILINEAR 1
+#define POST_FILTER_SHARP_BILINEAR 2
+#define POST_FILTER_SHARPEN 3
+#define POST_FILTERS 4
+#define POST_FILTER POST_FILTER_NEAREST
+#define POST_TIMER_FRAMES 4
+#define POST_REPORT_FRAMES 300
+#define POST_SCREENSHOT_FILENAME "screenshot"
+
+#define READBACK_BUFFERS 3
+
+#define ENCODER_FPS 60
+#define ENCODER_QUEUE_FRAMES 8
+
+#define MEMORY_TRACKING 1
+#define MEMORY_FLUSH_OPERATIONS 64
+#define MEMORY_FLUSH_BYTES 65536
+#define MEMORY_TRACE_STACKS 8
+#define MEMORY_TRACE_FRAMES 32
+
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_FILENAME "quicksave.ld0"
+
+#define NET_PORT 27960
+#define NET_PACKET_SIZE 1400
+#define NET_TICK_RATE 60
+#define NET_SNAPSHOT_TICKS 2
+#define NET_HISTORY 32
+#define NET_MAX_CLIENTS 256
+#define NET_MAX_ENTITIES 96
+#define NET_MAP_CHUNK 1024
+#define NET_POSITION_SCALE 64.0f
+#define NET_NO_BASELINE 0xFFFFFFFF
+#define NET_PLAYER_ENTITY 0x8000
+#define NET_TIMEOUT_TICKS 300
+#define NET_CONNECT_TIMEOUT 5000
+#define NET_RESEND_MILLISECONDS 200
+#define NET_BOT_STEPS 8
+#define NET_BOT_RAMP_MILLISECONDS 2000
+
+#define RUNNER_CELLS 256
+#define RUNNER_ENEMIES 256
+#define RUNNER_TICKS 600
+#define RUNNER_SEED 1
+#define RUNNER_CHECK_TICKS 3600
+#define RUNNER_CHECK_WARMUP 600
+
+#define BATCH_MAPS 1000
+#define BATCH_CELLS 256
+#define BATCH_SEED 1
+#define BATCH_VERSION 1
+
+#define BENCHMARK_MIN_MILLISECONDS 200
+#define BENCHMARK_MIN_ITERATIONS 3
+#define BENCHMARK_REGRESSION_THRESHOLD 10.0f
+
+#define BENCHMARK_STREAM_INSTANCES 100000
+#define BENCHMARK_STREAM_FRAMES 600
+#define BENCHMARK_SWEEP_CELLS 4096
+#define BENCHMARK_SWEEP_ENTITIES 100000
+#define BENCHMARK_SWEEP_TICKS 100
+#define TEST_SWEEP_TICKS 300
+#define BENCHMARK_RENDER_FRAMES 600
+#define BENCHMARK_PATHS_CELLS 262144
+#define BENCHMARK_PATHS_QUERIES 100000
+#define BENCHMARK_PATHS_GOALS 16
+#define BENCHMARK_ROOMS_CELLS 1048576
+#define BENCHMARK_ROOMS_THREADS 4
+#define BENCHMARK_LIST_WALKERS 16
 
 
 struct Random
 {
+	GLuint state;
+	
+	Random(GLuint seed);
+	
+	inline GLuint Next();
 	template<typename T>
-	static inline T GetNumber(T min, T max);
+	inline T GetNumber(T min, T max);
 };
 
 struct Pointer
 {
-	static inline void Delete(void *p);
+	template<typename T>
+	static inline void Delete(T *&p);
 };
 
 struct Array
 {
-	static inline void Delete(void **p, GLuint count);
+	template<typename T>
+	static inline void Delete(T **&p, GLuint count);
 };
 
 struct File
 {
 	static char *ReadAll(const char *filename, GLuint *size = 0);
+	static bool WriteAll(const char *filename, const void *data, GLuint size);
+	static long long GetModified(const char *filename);
+	static void MakeDirectory(const char *directory);
+};
+
+struct MappedFile
+{
+	const char *data;
+	GLuint size;
+	
+	static MappedFile *Open(const char *filename);
+	~MappedFile();
+	
+private:
+#ifdef _WIN32
+	HANDLE file, mapping;
+	MappedFile(HANDLE _file, HANDLE _mapping, const char *_data, GLuint _size);
+#else
+	int file;
+	MappedFile(int _file, const char *_data, GLuint _size);
+#endif
+};
+
+struct Hash
+{
+	static inline unsigned long long Fnv(const void *data, size_t size, unsigned long long hash = 14695981039346656037ULL);
+	static GLuint Crc32(const void *data, size_t size, GLuint crc = 0);
+	static GLuint Adler32(const void *data, size_t size, GLuint adler = 1);
+};
+
+struct Clock
+{
+	static inline double Milliseconds();
+};
+
+struct Memory
+{
+	enum Tag { OTHER, MAP, ENEMIES, ASSETS, AUDIO, RENDER, TAGS };
+	enum Object { BUFFERS, TEXTURES, FRAMEBUFFERS, SHADERS, PROGRAMS, SOUNDS, OBJECTS };
+	
+	struct Counter
+	{
+		std::atomic<long long> live, peak;
+		std::atomic<unsigned long long> allocations, frees;
+		
+		inline void Update(long long bytes, GLuint allocated, GLuint freed);
+	};
+	
+	struct Scope
+	{
+		GLuint previous;
+		
+		Scope(GLuint tag);
+		~Scope();
+	};
+	
+	static Counter HEAP[TAGS];
+	static Counter TOTAL;
+	static Counter DEVICE[OBJECTS];
+	static const char *TAG_NAMES[TAGS];
+	static const char *OBJECT_NAMES[OBJECTS];
+	
+	static void *Allocate(size_t size);
+	static void Free(void *p);
+	static void Flush();
+	static inline unsigned long long GetAllocations();
+	static void Trap(GLuint stacks);
+	static inline void Created(GLuint object, long long bytes);
+	static inline void Deleted(GLuint object, long long bytes);
+	static void Report(std::ostream &os, const char *title);
+	
+private:
+	struct alignas(16) Header
+	{
+		size_t size;
+		GLuint tag;
+	};
+	
+	struct Pending
+	{
+		long long bytes[TAGS];
+		GLuint allocations[TAGS], frees[TAGS];
+		GLuint operations;
+		unsigned long long allocated;
+		
+		~Pending();
+	};
+	
+	static thread_local GLuint scope;
+	static thread_local Pending pending;
+	static thread_local GLuint trap;
+	
+	static void Trace(size_t size);
+};
+
+struct Config
+{
+	// Window and rendering
+	int windowWidth, windowHeight;
+	int bufferWidth, bufferHeight;
+	int frameDelay;
+	int postFilter;
+	bool topView;
+	
+	// Simulation
+	int visibleDistance;
+	int enemyDecisionTicks;
+	int enemySpeakMinTicks, enemySpeakMaxTicks;
+	int enemyAnimationTicks;
+	
+	// New games
+	int mapCells, mapEnemies;
+	int mapGenerator;
+	
+	static Config CURRENT;
+	static int Parse(int argc, char *argv[]);
+	static bool Load(const char *filename);
+	static bool Set(const std::string &key, const std::string &value);
+	static void Print(std::ostream &os);
+	
+	Config();
+	
+private:
+	struct Key
+	{
+		const char *name;
+		size_t offset;
+		bool flag;
+		int min, max;
+	};
+	
+	static const Key KEYS[];
+	
+	static void Apply();
 };
 
 struct Mat4
 {
-	static const glm::mat4 PROJECTION;
+	static glm::mat4 PROJECTION;
 	static const glm::mat4 IDENTITY;
 	static const glm::mat4 HAND;
+	
+	static inline glm::vec2 ClipPlanes(const glm::mat4 &projection);
 };
 
 class Shader
@@ -75,7 +400,10 @@ class Shader
 public:
 	static Shader *WORLD;
 	static Shader *POST;
-	static Shader *Load(GLuint mask, const std::string &filename);
+	static Shader *Load(GLuint mask, const std::string &filename, const std::string &defines = "");
+	static void Watch(const char *directory);
+	static void Unwatch();
+	static bool Reload();
 	
 	GLuint id;
 	~Shader();
@@ -84,9 +412,25 @@ public:
 	inline void Unbind();
 
 private:
-	static GLuint Compile(GLuint id, GLenum type, const std::string &filename);
+	static std::vector<Shader *> LOADED;
+	static int watcher;
+	static GLuint watchTicks;
+	
+	GLuint mask;
+	std::string filename;
+	std::string defines;
+	std::vector<std::string> files;
+	std::vector<long long> modified;
+	bool dirty;
+	
+	static GLuint Build(GLuint mask, const std::string &filename, const std::string &defines, std::vector<std::string> &files);
+	static bool Preprocess(const std::string &filename, const std::string &defines, std::string &out, std::vector<std::string> &files, GLuint depth);
+	static GLuint Compile(GLuint id, GLenum type, const std::string &source, const std::string &filename);
+	static GLuint LoadBinary(const std::string &filename);
+	static void SaveBinary(GLuint id, const std::string &filename);
 	
-	Shader(GLuint _id);
+	Shader(GLuint _id, GLuint _mask, const std::string &_filename, const std::string &_defines, const std::vector<std::string> &_files);
+	void Track();
 };
 
 class Model
@@ -106,32 +450,38 @@ public:
 	static Model *U;
 	static Model *ENEMY;
 	static Model *POST;
-	static Model *Load(const std::string &filename);
+	static float *Parse(const std::string &filename, GLuint *size);
+	static Model *Load(const std::string &filename, bool upload = true);
 
 	GLuint vbo, vao, count;
+	Vertex *vertices;
 	~Model();
 
 	inline void Bind();
 	inline void Unbind();
+	void BindInstances(GLuint buffer, GLuint offset, GLuint stride);
 	
 private:
-	Model(GLuint _vbo, GLuint _vao, GLuint _count);
+	Model(GLuint _vbo, GLuint _vao, GLuint _count, Vertex *_vertices);
 };
 
 class Texture
 {
 public:
 	static Texture *GLOBAL;
-	static Texture *Load(const std::string &filename);
+	static char *Parse(const std::string &filename, GLuint *width, GLuint *height);
+	static Texture *Load(const std::string &filename, bool upload = true);
 	
 	GLuint id;
+	GLuint width, height;
+	GLuint *texels;
 	~Texture();
 
 	inline void Bind();
 	inline void Unbind();
 	
 private:
-	Texture(GLuint _id);
+	Texture(GLuint _id, GLuint _width, GLuint _height, GLuint *_texels);
 };
 
 class SoundBuffer
@@ -142,13 +492,15 @@ public:
 	static SoundBuffer *CROWBAR;
 	static SoundBuffer *ENEMY;
 	
+	static char *Parse(const std::string &filename, GLuint *size);
 	static SoundBuffer *Load(const std::string &filename);
 	
 	GLuint id;
+	GLuint size;
 	~SoundBuffer();
 	
 private:
-	SoundBuffer(GLuint _id);
+	SoundBuffer(GLuint _id, GLuint _size);
 };
 
 struct Sound
@@ -171,6 +523,37 @@ struct Sound
 	inline void SetVolume(float volume);
 };
 
+class StreamBuffer
+{
+public:
+	static StreamBuffer *ENEMIES;
+	static StreamBuffer *Create(GLenum target, GLuint size);
+	
+	GLuint id;
+	GLuint size;
+	GLuint offset;
+	GLuint waits;
+	bool persistent;
+	
+	~StreamBuffer();
+	
+	void *Map(GLuint bytes);
+	void Unmap();
+	void Fence();
+	inline void Bind();
+	inline void Unbind();
+	
+private:
+	GLenum target;
+	GLuint section;
+	GLuint used;
+	char *memory;
+	GLsync fences[STREAM_BUFFER_SECTIONS];
+	
+	StreamBuffer(GLenum _target, GLuint _id, GLuint _size, char *_memory);
+	void Wait();
+};
+
 class FrameBuffer
 {
 public:
@@ -180,6 +563,7 @@ public:
 	GLuint fbo;
 	GLuint color;
 	GLuint depth;
+	GLuint width, height;
 	
 	~FrameBuffer();
 	
@@ -189,12 +573,127 @@ public:
 	inline void BindDepth();
 	
 private:
-	FrameBuffer(GLuint _fbo, GLuint _tex, GLuint _rbo);
+	FrameBuffer(GLuint _fbo, GLuint _tex, GLuint _rbo, GLuint _width, GLuint _height);
+};
+
+class Encoder
+{
+public:
+	enum Format { Y4M, PNG, PPM };
+	
+	static Encoder *Create(const std::string &filename, GLuint fps);
+	
+	std::string filename;
+	std::atomic<GLuint> frames, dropped;
+	std::atomic<unsigned long long> microseconds;
+	
+	~Encoder();
+	
+	bool Push(const GLuint *pixels, GLuint width, GLuint height, bool bottomUp, const float *depth = NULL, const glm::vec2 &planes = glm::vec2());
+	
+private:
+	struct Frame
+	{
+		std::vector<GLuint> pixels;
+		std::vector<float> depth;
+		GLuint width, height;
+		bool bottomUp;
+		glm::vec2 planes;
+	};
+	
+	Format format;
+	GLuint fps;
+	bool header;
+	std::ofstream stream;
+	std::vector<unsigned char> bytes;
+	std::vector<Frame *> queue, spare;
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable wake;
+	bool stopping;
+	
+	Encoder(const std::string &_filename, Format _format, GLuint _fps);
+	void Work();
+	bool Encode(Frame &frame);
+	bool WriteY4m(const Frame &frame);
+	bool WritePng(const Frame &frame, const std::string &path);
+};
+
+class Readback
+{
+public:
+	static Readback *Create();
+	
+	GLuint requested, dropped;
+	
+	~Readback();
+	
+	bool Request(GLuint width, GLuint height, bool depth, Encoder *encoder, const glm::vec2 &planes = glm::vec2());
+	void Poll();
+	
+private:
+	struct Slot
+	{
+		GLuint pbo, size, width, height;
+		bool depth;
+		GLsync fence;
+		Encoder *encoder;
+		glm::vec2 planes;
+	};
+	
+	Slot slots[READBACK_BUFFERS];
+	GLuint next, pending;
+	
+	Readback();
 };
 
 struct Input
 {
+	struct Event
+	{
+		double time;
+		GLushort scancode;
+		bool down;
+	};
+	
 	static bool *KEYBOARD;
+	
+	static GLuint Read();
+};
+
+template<typename T, GLuint SIZE>
+class SpscQueue
+{
+public:
+	SpscQueue();
+	
+	inline bool Push(const T &item);
+	inline bool Pop(T &item);
+	
+private:
+	T items[SIZE];
+	std::atomic<GLuint> head, tail;
+};
+
+template<typename T>
+class TripleBuffer
+{
+public:
+	TripleBuffer();
+	
+	inline T &Back();
+	inline void Publish();
+	inline const T *Latest();
+	template<typename F>
+	void Prepare(F prepare);
+	
+private:
+	static const GLuint FRESH = 4;
+	
+	T slots[3];
+	GLuint back, front;
+	bool ready;
+	std::atomic<GLuint> middle;
 };
 
 struct Point
@@ -204,10 +703,12 @@ struct Point
 	bool operator==(const Point &o) const;
 };
 
+struct World;
+struct Scene;
+class Renderer;
+
 struct Player
 {
-	static Player *INSTANCE;
-	
 	glm::vec3 position;
 	glm::vec3 look;
 	float angle;
@@ -216,77 +717,761 @@ struct Player
 	GLuint frame;
 	GLuint attackTicks;
 	GLuint life;
+	GLuint buttons;
 	
 	Player(glm::vec3 _position, float _angle);
 	
-	void CheckInput();
-	void Draw();
+	void Update(World &world);
+};
+
+struct Enemy;
+
+struct Timer
+{
+	Timer *prev, *next;
+	GLuint due;
+	Enemy *owner;
+	
+	Timer();
+	~Timer();
+	
+	inline bool IsScheduled() const;
+	inline void Unlink();
+	inline void Append(Timer &timer);
+};
+
+class TimerWheel
+{
+public:
+	GLuint now;
+	GLuint fired;
+	
+	TimerWheel();
+	
+	void Schedule(Timer &timer, GLuint delay);
+	inline GLuint GetRemaining(const Timer &timer) const;
+	template<typename F>
+	void Advance(F fire);
+	
+private:
+	Timer slots[TIMER_LEVELS][TIMER_SLOTS];
+	
+	void Insert(Timer &timer);
+	void Cascade(GLuint level);
 };
 
 struct Enemy
 {
+	struct Instance
+	{
+		glm::vec3 position;
+		GLubyte animation, frame;
+		GLubyte _unused[2];
+	};
+	
 	glm::vec3 position;
 	glm::vec3 direction;
-	GLushort decisionTick, speakTick;
-	GLuint animation, frame, animationTick;
-	Sound *source;
+	GLuint animation, frame;
+	Timer decision, speak, animate;
+	Enemy *prevInBlock, *nextInBlock;
+	GLuint id;
+	GLubyte tier;
 	
-	Enemy(glm::vec3 _position);
-	~Enemy();
+	Enemy(World &world, glm::vec3 _position);
 	
-	void SetDirection();
-	void PlayFallAnimation();
-	void Update();
+	void SetDirection(World &world);
+	void PlayFallAnimation(World &world);
+	void Fire(World &world, const Timer &timer);
+	void SetTier(World &world, GLubyte _tier);
+	void Plan(World &world);
+	void Hop(World &world, GLint next);
+	inline void Update(World &world, GLint cell, GLuint steps = 1);
 };
 
-template<GLuint chunk, GLuint ptrSize = sizeof(void *)>
 struct EnemyList
 {
-	Enemy **data;
+	Enemy *first, *last;
 	GLuint size;
-	GLuint capacity;
 	
 	EnemyList();
-	~EnemyList();
 	
-	void Add(Enemy *enemy);
-	void Remove(GLuint index);
+	inline void Add(Enemy *enemy);
+	inline void Remove(Enemy *enemy);
 };
 
 struct Block
 {
+	GLubyte mask;
 	Model *model;
 	glm::mat4 transform;
-	EnemyList<4> enemies;
+	EnemyList enemies;
 	
-	Block(Model *_model, glm::mat4 _transform);
+	Block(GLubyte _mask, Model *_model, glm::mat4 _transform);
 	~Block();
 	
-	void Draw();
+	void Gather(Scene &scene);
 };
 
-struct Map
+struct NavField
 {
-	static Map *INSTANCE;
+	static const Point DIRECTIONS[4];
+	
+	Point size;
+	GLuint range;
+	GLushort *distance;
+	GLbyte *next;
+	GLuint *queue;
+	GLuint visited;
+	std::vector<GLuint> sources;
+	
+	NavField(const Point &_size, GLuint _range);
+	~NavField();
+	
+	inline GLint GetNext(GLuint cell);
+	void Build(Block **blocks, const GLuint *cells, GLuint count);
+};
 
+struct CorridorGraph
+{
+	struct Edge
+	{
+		GLuint from, to;
+		GLuint first, length;
+	};
+	
+	struct Link
+	{
+		GLuint edge;
+		GLuint node;
+		GLuint back;
+		bool forward;
+	};
+	
+	struct Search
+	{
+		GLuint goal;
+		GLuint origin;
+		GLuint used;
+		std::vector<GLuint> cost;
+		std::vector<GLuint> via;
+		std::vector<bool> closed;
+		std::vector<std::pair<GLuint, GLuint> > open;
+	};
+	
+	struct Request
+	{
+		GLuint from, goal;
+		GLint next;
+		GLuint distance;
+	};
+	
+	Point size;
+	std::vector<GLuint> nodes;
+	std::vector<GLuint> offsets;
+	std::vector<Link> links;
+	std::vector<Edge> edges;
+	std::vector<GLuint> cells;
+	std::vector<GLuint> owners;
+	std::vector<GLuint> place;
+	std::vector<Search> searches;
+	GLuint clock;
+	unsigned long long hits, misses, expanded;
+	
+	CorridorGraph(Block **blocks, const Point &_size);
+	
+	void Route(Request *requests, GLuint count);
+	void Reserve();
+	void Reset();
+	
+private:
+	std::vector<GLuint> order;
+	
+	GLuint AddNode(GLuint cell);
+	void Trace(Block **blocks, GLuint node);
+	inline GLuint GetHeuristic(GLuint node, GLuint cell) const;
+	inline GLint GetStep(const Link &link) const;
+	inline void Push(Search &search, GLuint node);
+	void Prepare(Search &search);
+	Search &GetSearch(GLuint goal, GLuint origin);
+	void Seed(Search &search);
+	bool Resume(Search &search, GLuint node);
+	void Resolve(Search &search, Request &request);
+};
+
+struct Map
+{
 	Block **blocks;
 	Point size;
 	Point origin;
-	std::vector<Enemy *> enemies;
+	NavField *nav;
+	CorridorGraph *graph;
 	
 	Map(Block **blocks, const Point &size, const Point &origin);
 	~Map();
 	
 	inline float GetX(float x);
 	inline float GetY(float y);
+	inline GLint GetCell(const glm::vec3 &position);
 	inline Block *GetBlock(const glm::vec3 &position);
+	inline glm::vec3 GetCenter(GLuint cell);
 	
-	bool CanMove(glm::vec3 &position, const glm::vec3 &direction);
+	void Navigate(const GLuint *cells, GLuint count);
+	inline bool IsBlocked(int x, int y);
+	inline int GetLine(float value, bool vertical);
+	inline float Sweep(float position, float side, float delta, bool vertical);
 	void Move(glm::vec3 &position, const glm::vec3 &direction);
+	bool Overlaps(const glm::vec3 &position);
+	
+	// Enemies moved together, one coordinate per array so each axis is swept in one pass
+	struct Moves
+	{
+		std::vector<Enemy *> enemies;
+		std::vector<GLint> cells;
+		std::vector<float> x, z, dx, dz;
+		
+		void Reserve(GLuint count);
+		inline void Add(Enemy *enemy, GLint cell, const glm::vec3 &delta);
+	};
+	void Move(Moves &moves);
+	void Relocate(Enemy *enemy, const glm::vec3 &position);
+	void GetMasks(GLubyte *masks);
+	void Gather(Scene &scene, const Player *viewer);
+	template<int DISTANCE>
+	inline void GatherCells(Scene &scene, const Player *viewer, int distance);
+	
+	struct Tile
+	{
+		Model **model;
+		GLubyte rotation;
+	};
+	
+	static constexpr Tile TILES[16] =
+	{
+		{ NULL, 0 }, { &Model::U, 1 }, { &Model::U, 2 }, { &Model::L, 2 },
+		{ &Model::U, 3 }, { &Model::H, 3 }, { &Model::L, 3 }, { &Model::I, 3 },
+		{ &Model::U, 0 }, { &Model::L, 1 }, { &Model::H, 0 }, { &Model::I, 2 },
+		{ &Model::L, 0 }, { &Model::I, 1 }, { &Model::I, 0 }, { &Model::E, 0 }
+	};
+	static const glm::mat4 ROTATIONS[4];
+	
+	struct Spread
+	{
+		unsigned long long values[256];
+		Spread();
+	};
+	static const Spread SPREAD;
+	
+	static void Walk(GLuint size, Random &random, std::vector<Point> &points);
+	static GLuint Occupy(const std::vector<Point> &points, Point &size, Point &origin, std::vector<unsigned long long> &bits);
+	static void ClassifyRow(const unsigned long long *above, const unsigned long long *row, const unsigned long long *below, GLuint width, GLubyte *masks);
+	static Block *CreateBlock(GLuint c, const Point &p);
+	static Map *Build(const std::vector<Point> &points);
+	static Map *Generate(GLuint size, Random &random);
+	static Map *Create(const GLubyte *masks, const Point &size, const Point &origin);
+	static int TestSweep();
+};
+
+struct World
+{
+	Map *map;
+	std::vector<Player *> players;
+	std::vector<Enemy *> enemies;
+	Random random;
+	TimerWheel wheel;
+	GLuint tick;
+	unsigned long long tiers[LOD_TIERS];
+	double aiMilliseconds;
+	std::vector<Enemy *> speeches;
+	std::vector<CorridorGraph::Request> routes;
+	std::vector<Enemy *> routed;
+	Map::Moves moves;
+	
+	World(Map *_map, GLuint seed);
+	~World();
+	
+	Player *AddPlayer(const glm::vec3 &position, float angle);
+	void RemovePlayer(Player *player);
 	void AddEnemies(GLuint number);
-	void Draw();
+	void Reserve();
+	GLint GetTarget(GLint cell);
+	void Step();
+	
+	static World *Generate(GLuint size, GLuint enemies, GLuint seed, GLuint threads = 1);
+	
+private:
+	std::vector<GLuint> targets;
+	std::vector<GLuint> near;
+	
+	inline GLubyte GetTier(GLint cell);
+	template<int DISTANCE>
+	inline void MarkNear(int cx, int cy, int distance);
+};
+
+struct Scene
+{
+	struct Item
+	{
+		Model *model;
+		glm::mat4 transform;
+	};
+	
+	glm::mat4 view;
+	std::vector<Item> blocks;
+	std::vector<Enemy::Instance> instances;
+	GLuint hand;
+	GLuint sequence;
+	double input;
+	
+	Scene();
+	
+	void Reserve(GLuint enemies);
+	void Gather(Map *map, const Player *viewer);
+	void Draw(Renderer &renderer) const;
+};
+
+class ThreadPool
+{
+public:
+	ThreadPool(GLuint _threads);
+	~ThreadPool();
+	
+	void Run(GLuint count, const std::function<void(GLuint)> &job);
+	
+private:
+	GLuint threads;
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	const std::function<void(GLuint)> *job;
+	std::atomic<GLuint> next;
+	GLuint count, finished, generation;
+	bool stopping;
+	
+	void Work();
+	void Drain();
+};
+
+class Generator
+{
+public:
+	static Generator *Create(GLuint kind, GLuint threads);
+	
+	virtual ~Generator() {}
+	
+	virtual Map *Generate(GLuint cells, Random &random) = 0;
+};
+
+class WalkGenerator : public Generator
+{
+public:
+	Map *Generate(GLuint cells, Random &random);
+};
+
+class RoomGenerator : public Generator
+{
+public:
+	RoomGenerator(GLuint threads);
+	
+	Map *Generate(GLuint cells, Random &random);
+	GLuint Carve(GLuint cells, GLuint seed, std::vector<GLubyte> &grid, Point &start);
+	
+private:
+	struct Rect
+	{
+		int x, y, width, height;
+	};
 	
-	static Map *Generate(GLuint size);
+	ThreadPool pool;
+	
+	static inline GLuint GetKey(GLuint seed, GLuint cx, GLuint cy, GLuint salt);
+	static inline GLuint GetDoor(GLuint seed, GLuint cx, GLuint cy, GLuint salt, GLuint length);
+	static void Dig(GLubyte *grid, GLuint stride, const Point &from, const Point &to, bool horizontal);
+	static Point Split(Random &random, GLubyte *grid, GLuint stride, const Rect &rect);
+	static Point CarveChunk(GLuint seed, GLuint cx, GLuint cy, GLuint chunks, GLuint side, GLubyte *grid);
+};
+
+class Renderer
+{
+public:
+	static inline float Fog(const glm::vec2 &planes, float depth);
+	
+	virtual ~Renderer() {}
+	
+	virtual void Begin() = 0;
+	virtual void SetCamera(const glm::mat4 &view, const glm::mat4 &projection) = 0;
+	virtual void Draw(Model *model, const glm::mat4 &transform, GLuint animation, GLuint frame) = 0;
+	virtual Enemy::Instance *MapInstances(GLuint &capacity) = 0;
+	virtual void DrawInstances(Model *model, GLuint count) = 0;
+	virtual void End() = 0;
+};
+
+class GLRenderer : public Renderer
+{
+public:
+	enum Stage { SCENE, POST, READBACK, STAGES };
+	
+	static const char *STAGE_NAMES[STAGES];
+	
+	Readback *readback;
+	Encoder *recorder;
+	Encoder *screenshot;
+	
+	GLRenderer();
+	~GLRenderer();
+	
+	void Begin();
+	void SetCamera(const glm::mat4 &view, const glm::mat4 &projection);
+	void Draw(Model *model, const glm::mat4 &transform, GLuint animation, GLuint frame);
+	Enemy::Instance *MapInstances(GLuint &capacity);
+	void DrawInstances(Model *model, GLuint count);
+	void End();
+	
+private:
+	Enemy::Instance *mapped;
+	glm::vec2 planes;
+	GLuint queries[POST_TIMER_FRAMES][STAGES];
+	GLuint frame, gpuFrames, cpuFrames;
+	double gpu[STAGES], cpu[STAGES];
+	double stageStart;
+	
+	void BeginStage(Stage stage);
+	void EndStage(Stage stage);
+	void Collect();
+	void Report();
+};
+
+class SoftwareRenderer : public Renderer
+{
+public:
+	static bool LoadAssets();
+	static void ReleaseAssets();
+	static SoftwareRenderer *Create(GLuint width, GLuint height, GLuint threads, GLuint instances);
+	static GLuint *Read(const char *filename, GLuint *width, GLuint *height);
+	static int Capture(const char *filename, GLuint seed, GLuint ticks, GLuint threads);
+	static int Diff(const char *expected, const char *actual, GLuint tolerance, const char *output);
+	static bool Write(const char *filename, const GLuint *pixels, GLuint width, GLuint height);
+	
+	GLuint width, height;
+	GLuint *pixels;
+	GLuint triangles;
+	
+	~SoftwareRenderer();
+	
+	void Begin();
+	void SetCamera(const glm::mat4 &view, const glm::mat4 &projection);
+	void Draw(Model *model, const glm::mat4 &transform, GLuint animation, GLuint frame);
+	Enemy::Instance *MapInstances(GLuint &capacity);
+	void DrawInstances(Model *model, GLuint count);
+	void End();
+	
+private:
+	struct Triangle
+	{
+		float edges[3][3];
+		float z[3], w[3], s[3], t[3];
+		int minX, minY, maxX, maxY;
+	};
+	
+	glm::mat4 view, projection;
+	glm::vec2 planes;
+	const Texture *texture;
+	std::vector<Triangle> queue;
+	std::vector<std::vector<GLuint> > bins;
+	std::vector<Enemy::Instance> instances;
+	GLuint tilesX, tilesY;
+	GLuint *colors;
+	float *depth;
+	ThreadPool pool;
+	
+	SoftwareRenderer(GLuint _width, GLuint _height, GLuint threads, GLuint _instances);
+	
+	void Submit(const glm::vec4 *clip, const glm::vec2 *coords);
+	void Setup(const glm::vec4 &a, const glm::vec4 &b, const glm::vec4 &c, const glm::vec2 &ta, const glm::vec2 &tb, const glm::vec2 &tc);
+	inline void Shade(const Triangle &triangle, float x, float y, float z, GLuint &color, float &depth);
+	void Rasterize(GLuint tile);
+};
+
+struct Runner
+{
+	static int Run(GLuint worlds, GLuint ticks, GLuint threads);
+	static int Check(GLuint ticks, GLuint warmup);
+};
+
+struct Batch
+{
+	enum Column { SEED, CELLS, WIDTH, HEIGHT, DEAD_ENDS, JUNCTIONS, CORRIDOR, FARTHEST, COLUMNS };
+	
+	struct Filter
+	{
+		GLuint column;
+		char op;
+		GLuint value;
+		
+		bool Parse(const char *text);
+		bool Accept(const GLuint *values) const;
+	};
+	
+	static const char *NAMES[COLUMNS];
+	
+	static void Measure(Map *map, GLuint seed, GLuint *values);
+	static void Pack(Map *map, GLuint seed, std::string &data);
+	static int Run(GLuint count, GLuint cells, GLuint threads, const char *summary, const char *maps, const char *filter);
+};
+
+struct Benchmark
+{
+	struct Result
+	{
+		std::string name;
+		GLuint iterations;
+		double ns;
+	};
+	
+	static std::vector<Result> RESULTS;
+	static volatile GLuint SINK;
+	
+	template<typename F>
+	static void Measure(const std::string &name, GLuint operations, F run);
+	static int Run(const char *filename);
+	static int Compare(const char *base, const char *current, float threshold);
+	static bool Read(const char *filename, std::vector<Result> &results);
+	
+	static int Stream(GLuint instances, GLuint frames);
+	static int Sweep(GLuint cells, GLuint entities, GLuint ticks);
+	static int Render(GLuint frames, GLuint threads, const char *capture = NULL);
+	static int Paths(GLuint cells, GLuint queries, GLuint goals);
+	static int Rooms(GLuint cells, GLuint threads);
+};
+
+struct Snapshot
+{
+	struct Header
+	{
+		char magic[4];
+		GLuint version;
+		Point size;
+		Point origin;
+		GLuint cells;
+		GLuint enemies;
+		GLuint random;
+	};
+	
+	struct PlayerState
+	{
+		glm::vec3 position;
+		float angle;
+		float moving;
+		GLuint frame;
+		GLuint attackTicks;
+		GLuint life;
+	};
+	
+	struct EnemyState
+	{
+		glm::vec3 position;
+		glm::vec3 direction;
+		GLushort decisionTick, speakTick;
+		GLubyte animation, frame;
+		GLushort animationTick;
+	};
+	
+	static inline GLuint GetEnemiesOffset(GLuint cells);
+	static bool Save(const char *filename, World *world);
+	static bool Load(const char *filename, World **world);
+};
+
+struct Address
+{
+	GLuint host;
+	GLushort port;
+	
+	bool operator==(const Address &o) const;
+	static bool Resolve(const char *text, Address &address);
+};
+
+class Socket
+{
+public:
+	static bool Startup();
+	static Socket *Open(GLushort port);
+	
+	~Socket();
+	
+	bool Send(const Address &to, const void *data, GLuint size);
+	int Receive(Address &from, void *data, GLuint size);
+	
+private:
+#ifdef _WIN32
+	SOCKET id;
+	Socket(SOCKET _id);
+#else
+	int id;
+	Socket(int _id);
+#endif
+};
+
+struct Packet
+{
+	char data[NET_PACKET_SIZE];
+	GLuint size;
+	GLuint read;
+	bool overflow;
+	
+	Packet();
+	
+	template<typename T>
+	inline void Write(const T &value);
+	template<typename T>
+	inline T Read();
+};
+
+struct Net
+{
+	enum Message : GLubyte { CONNECT, WELCOME, MAP_REQUEST, MAP_CHUNK, INPUT, SNAPSHOT, DISCONNECT };
+	
+	// Positions are quantized on the ground plane, the fields of a changed entity are flagged one by one
+	enum Field : GLubyte { FIELD_X = 1, FIELD_Z = 2, FIELD_ANIMATION = 4, FIELD_FRAME = 8 };
+	
+	struct Entity
+	{
+		GLushort id;
+		short x, z;
+		GLubyte animation, frame;
+		
+		void Set(GLushort _id, const glm::vec3 &position, GLubyte _animation, GLubyte _frame);
+		bool operator<(const Entity &o) const;
+	};
+};
+
+class Server
+{
+public:
+	struct Client
+	{
+		Address address;
+		GLushort id;
+		Player *player;
+		GLuint acked;
+		GLuint heard;
+		GLuint bytes;
+		std::vector<Net::Entity> history[NET_HISTORY];
+		GLuint sequences[NET_HISTORY];
+	};
+	
+	static int Start(GLushort port, GLuint cells, GLuint enemies, GLuint seconds);
+	
+private:
+	static Socket *socket;
+	static World *world;
+	static Client *clients[NET_MAX_CLIENTS];
+	static GLubyte *masks;
+	static GLuint cells;
+	static GLuint sequence;
+	static GLuint tickMicros;
+	
+	static Client *Find(const Address &address);
+	static Client *Add(const Address &address);
+	static void Remove(Client *client);
+	static void Receive();
+	static void Tick();
+	static void Gather(Client *client, std::vector<Net::Entity> &entities);
+	static void SendSnapshot(Client *client);
+	static void Send(Client *client, const Packet &packet);
+};
+
+class Connection
+{
+public:
+	Address server;
+	GLushort id;
+	Point size;
+	Point origin;
+	GLubyte *masks;
+	
+	GLuint sequence;
+	glm::vec3 position;
+	float angle;
+	GLuint frame;
+	GLuint life;
+	
+	GLuint bytesReceived, bytesSent;
+	GLuint snapshots, errors;
+	GLuint serverMicros;
+	
+	static Connection *Open(const Address &server, bool download, GLuint timeout);
+	static int RunBots(const Address &server, GLuint count, GLuint seconds);
+	
+	~Connection();
+	
+	void SendInput(GLuint buttons);
+	bool Receive();
+	void Apply(World &world);
+	
+private:
+	Socket *socket;
+	std::vector<Net::Entity> history[NET_HISTORY];
+	GLuint sequences[NET_HISTORY];
+	std::vector<Net::Entity> changed;
+	std::vector<GLushort> removed;
+	std::vector<Enemy *> entities;
+	std::vector<GLushort> visible;
+	
+	Connection(Socket *_socket, const Address &_server);
+	void Send(const Packet &packet);
+	bool Decode(Packet &packet);
+};
+
+struct Acoustics
+{
+	struct Path
+	{
+		float gain, gainHF;
+		glm::vec3 position;
+	};
+	
+	Map *map;
+	NavField *field;
+	GLint cell;
+	glm::vec3 listener;
+	
+	Acoustics();
+	~Acoustics();
+	
+	void Listen(Map *_map, const glm::vec3 &_listener);
+	bool Evaluate(const glm::vec3 &emitter, Path &path);
+};
+
+class Audio
+{
+public:
+	static Audio *Create(ALCdevice *device);
+	
+	~Audio();
+	
+	void Update(World &world, const Player *player);
+	void Reset();
+	
+private:
+	struct Voice
+	{
+		Sound *sound;
+		ALuint filter;
+		Enemy *emitter;
+		Acoustics::Path path;
+	};
+	
+	static LPALGENFILTERS GenFilters;
+	static LPALDELETEFILTERS DeleteFilters;
+	static LPALFILTERI Filteri;
+	static LPALFILTERF Filterf;
+	
+	Voice voices[AUDIO_VOICES];
+	Acoustics acoustics;
+	bool efx;
+	
+	Audio(bool _efx);
+	
+	void Apply(Voice &voice, const Acoustics::Path &path, bool force);
 };
 
 class App
@@ -295,12 +1480,30 @@ public:
 	static Point WindowSize;
 
 	static int Start();
-	static int Initialize();
+	static int Initialize(const char *snapshot = NULL, const char *server = NULL, const char *record = NULL);
+	static int Shutdown(int exit, const char *msg);
 
 private:
+	static void Simulate();
+	static void QuickSave();
+	static void QuickLoad();
+	static void SetupShaders();
+	static Shader *LoadPost(GLuint filter);
+	static void CycleFilter();
+	static void Screenshot();
+
+	static World *world;
+	static SpscQueue<Input::Event, INPUT_QUEUE_SIZE> events;
+	static TripleBuffer<Scene> scenes;
+	static std::atomic<bool> running;
+	static std::atomic<double> acknowledged;
+	static Connection *connection;
+	static Audio *audio;
+	static GLRenderer *renderer;
+	static GLuint filter;
+	static Encoder *recorder;
+	static Encoder *screenshots;
 	static SDL_Window *window;
 	static SDL_GLContext videoContext;
 	static ALCcontext *audioContext;
-
-	static int Shutdown(int exit, const char *msg);
 };
\ No newline at end of file
@@ -1,18 +1,66 @@
 #version 330 core
 #extension GL_ARB_explicit_uniform_location: enable
 
+// FILTER selects the upscale: 0 nearest, 1 bilinear, 2 sharp bilinear, 3 bilinear with contrast adaptive sharpening
+#ifndef FILTER
+#define FILTER 0
+#endif
+
 layout(location = 0) out vec4 oColor;
 
 in vec2 vCoord;
 
 layout(location = 2) uniform sampler2D uColorSampler;
 layout(location = 3) uniform sampler2D uDepthSampler;
+layout(location = 4) uniform vec3 uFog;
+layout(location = 5) uniform vec2 uScale;
+
+// Fog is applied to every source texel before filtering, near and far come from the scene projection
+vec3 Fetch(ivec2 p)
+{
+	p = clamp(p, ivec2(0), textureSize(uColorSampler, 0) - 1);
+	float z = texelFetch(uDepthSampler, p, 0).x * 2.0 - 1.0;
+	float eye = 2.0 * uFog.x * uFog.y / (uFog.y + uFog.x - z * (uFog.y - uFog.x));
+	float fog = clamp(1.0 - (eye * eye) / (uFog.z * uFog.z), 0.0, 1.0);
+	return texelFetch(uColorSampler, p, 0).rgb * fog;
+}
 
-const float near = 0.1;
-const float far = 8.0;
+vec3 Bilinear(vec2 coord)
+{
+	coord -= 0.5;
+	ivec2 p = ivec2(floor(coord));
+	vec2 f = coord - vec2(p);
+	return mix(mix(Fetch(p), Fetch(p + ivec2(1, 0)), f.x), mix(Fetch(p + ivec2(0, 1)), Fetch(p + ivec2(1, 1)), f.x), f.y);
+}
 
 void main()
 {
-	float depth = (2.2 * near) / (far + near - texture2D(uDepthSampler, vCoord).x * (far - near));
-	oColor = texture(uColorSampler, vCoord) * (1.0 - depth * depth);
-}
\ No newline at end of file
+	vec2 coord = vCoord * vec2(textureSize(uColorSampler, 0));
+
+#if FILTER == 0
+	vec3 color = Fetch(ivec2(coord));
+#elif FILTER == 1
+	vec3 color = Bilinear(coord);
+#elif FILTER == 2
+	// Nearest inside the texels, bilinear only across the last output pixel of each edge
+	vec2 prescale = max(floor(uScale), vec2(1.0));
+	vec2 region = 0.5 - 0.5 / prescale;
+	vec2 center = fract(coord) - 0.5;
+	vec3 color = Bilinear(floor(coord) + (center - clamp(center, -region, region)) * prescale + 0.5);
+#else
+	// Bilinear, then sharpened by the cross around the texel, less where the neighborhood is near black or white
+	ivec2 p = ivec2(coord);
+	vec3 b = Fetch(p + ivec2(0, -1));
+	vec3 d = Fetch(p + ivec2(-1, 0));
+	vec3 f = Fetch(p + ivec2(1, 0));
+	vec3 h = Fetch(p + ivec2(0, 1));
+	vec3 e = Bilinear(coord);
+	vec3 low = min(min(min(b, d), min(f, h)), e);
+	vec3 high = max(max(max(b, d), max(f, h)), e);
+	vec3 amount = sqrt(clamp(min(low, 1.0 - high) / max(high, vec3(0.0001)), 0.0, 1.0));
+	vec3 w = amount * -0.2;
+	vec3 color = clamp((e + (b + d + f + h) * w) / (1.0 + 4.0 * w), 0.0, 1.0);
+#endif
+
+	oColor = vec4(color, 1.0);
+}
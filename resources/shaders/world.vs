@@ -3,6 +3,8 @@
 
 layout(location = 0) in vec3 iVertex;
 layout(location = 1) in vec2 iCoord;
+layout(location = 2) in vec3 iPosition;
+layout(location = 3) in uvec2 iAnimation;
 
 out vec2 vCoord;
 
@@ -13,9 +15,21 @@ layout(location = 2) uniform mat4 uProjection;
 layout(location = 3) uniform int uAnimationIndex;
 layout(location = 4) uniform int uAnimationFrame;
 
+layout(location = 6) uniform bool uInstanced;
+
 
 void main()
 {
+	if (uInstanced)
+	{
+		// Billboard around the Y axis, the quad takes the camera right vector (first row of the view matrix)
+		vec3 right = normalize(vec3(uView[0][0], 0, uView[2][0]));
+		vec3 world = iPosition + right * iVertex.x + vec3(0, iVertex.y, 0);
+		gl_Position = (uProjection * uView) * vec4(world, 1);
+		vCoord = vec2(iCoord.x + int(iAnimation.y) * 0.25, iCoord.y - int(iAnimation.x) * 0.25);
+		return;
+	}
+	
 	gl_Position = (uProjection * uView * uModel) * vec4(iVertex, 1);
 	vCoord = vec2(iCoord.x + uAnimationFrame * 0.25, iCoord.y - uAnimationIndex * 0.25);
-}
\ No newline at end of file
+}